@@ -23,9 +23,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "imageKernels.h"
+#include "imageThreads.h"
 #include "instrumentation.h"
+#include "xxhash64.h"
 
 // The data structure
 //
@@ -35,9 +46,14 @@
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
-// For example, in a 100-pixel wide image (img->width == 100),
+// Each row is padded to a multiple of PIX_ALIGN bytes (the stride), so
+// that every row starts at an address aligned for the widest SIMD vectors.
+// For example, in a 100-pixel wide image (img->width == 100,
+// img->stride == 128),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
-//   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//   pixel position (x,y) = (22,1) is stored in img->pixel[150].
+// The padding bytes hold no pixels; whole-image point operations may
+// process them anyway, since that avoids handling partial vectors.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -47,11 +63,21 @@
 const uint8 PixMax = 255;
 
 // Internal structure for storing 8-bit graymap images
+// (Dimensions are ints, but an image may have more than INT_MAX pixels:
+// pixel counts, sizes and indices are computed in size_t.)
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  size_t stride;   // distance (in bytes) between the starts of consecutive rows
+  size_t capacity; // size of the pixel buffer (bytes), at least stride*height
+  int* refs;       // number of images sharing the pixel buffer (see ImageClone), or NULL
+  uint32_t* sat;   // cached integral image (see satOf), or NULL
+  int satX, satY;  // its entries right of column satX and below row satY are stale
+  struct histCache* hist;  // cached histograms of bands of rows (see histOf), or NULL
+  int ndirty;      // number of dirty rectangles (see dirtyAdd)
+  ImageRect dirty[IMAGE_DIRTY_MAX];
 };
 
 
@@ -143,11 +169,14 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and select the
+/// pixel kernels best suited to the running CPU.
 void ImageInit(void) { ///
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   InstrName[1] = "count";   // InstrCount[1] will count function comparsions
+  KernelsInit();            // select the best kernels for this CPU
+  ThreadsInit();            // one thread per CPU, unless IMAGE8BIT_THREADS says otherwise
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -156,6 +185,535 @@ void ImageInit(void) { ///
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+/// CPU dispatch information.
+/// Returns a description of the instruction set levels supported by the CPU
+/// and of the kernels selected (in ImageInit) for each operation.
+/// The level may be forced with environment variable IMAGE8BIT_SIMD.
+const char* ImageCpuInfo(void) { ///
+  return KernelsInfo();
+}
+
+
+/// Pixel buffers
+
+// Rows are aligned to PIX_ALIGN bytes: the width of the widest SIMD vectors
+// (AVX-512) and of a cache line.
+#define PIX_ALIGN 64
+
+// Stride (in bytes) of rows with the given width.
+static inline size_t strideOf(int width) {
+  return ((size_t)width + PIX_ALIGN - 1) & ~(size_t)(PIX_ALIGN - 1);
+}
+
+// Pointer to the first pixel of row y, which must satisfy (0 <= y < img->height).
+// This internal function is used by operations that process whole rows.
+static inline uint8* rowPtr(Image img, int y) {
+  assert (0 <= y && y < img->height);
+  return img->pixel + (size_t)y * img->stride;
+}
+
+// Destroyed images give their pixel buffers back to a pool, and new images
+// take buffers from it, so that long pipelines and batch runs, which keep
+// creating and destroying images of the same few sizes, stop churning
+// malloc/free (and the page faults of fresh memory).
+// A pooled buffer is reused for requests between 3/4 of its size and its
+// size, so little memory is wasted.  When the pool is full, the oldest
+// buffers are freed first.
+#define POOL_SLOTS 32
+
+// Buffers of at least PIX_MMAP_MIN bytes bypass the pool and are mapped
+// directly from the system: fresh mappings are already zero, so a large
+// new image costs no memory until its pixels are written (a gigapixel
+// mosaic that is mostly black stays sparse), and unmapping returns the
+// memory at once.
+#define PIX_MMAP_MIN ((size_t)32 << 20)
+
+static struct {
+  uint8* buf;
+  size_t size;
+} pool[POOL_SLOTS];   // free buffers, oldest first
+static int poolCount = 0;       // number of buffers in the pool
+static size_t poolBytes = 0;    // total size of the buffers in the pool
+static size_t poolLimit = (size_t)256 << 20;  // maximum poolBytes
+
+// Remove buffer i from the pool (without freeing it).
+static void poolRemove(int i) {
+  poolBytes -= pool[i].size;
+  poolCount--;
+  memmove(&pool[i], &pool[i+1], (poolCount - i) * sizeof(pool[0]));
+}
+
+// Allocate a pixel buffer of at least (*size) bytes, aligned to PIX_ALIGN.
+// On success, (*size) is set to the actual size of the buffer.
+// If clear, the first (*size) bytes requested are set to 0.
+// On failure, returns NULL and errno is set.
+static uint8* pixAlloc(size_t* size, int clear) {
+  size_t need = *size;
+  if (need >= PIX_MMAP_MIN) {
+    //Buffers grandes: mapear diretamente (já vêm a zeros, não é preciso limpar)
+    size_t n = (need + 4095) & ~(size_t)4095;   // múltiplo do tamanho da página
+    if (n < need) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    void* p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    *size = n;
+    return p;
+  }
+  //Procurar no pool o buffer mais pequeno que sirva
+  int best = -1;
+  for (int i = 0; i < poolCount; i++) {
+    if (pool[i].size >= need && need >= pool[i].size - pool[i].size / 4 &&
+        (best < 0 || pool[i].size < pool[best].size)) {
+      best = i;
+    }
+  }
+  uint8* buf;
+  if (best >= 0) {
+    buf = pool[best].buf;
+    *size = pool[best].size;
+    poolRemove(best);
+  } else {
+    //Nenhum serve: alocar um novo, alinhado
+    void* p;
+    size_t n = need > 0 ? need : PIX_ALIGN;
+    int e = posix_memalign(&p, PIX_ALIGN, n);
+    if (e != 0) {
+      errno = e;
+      return NULL;
+    }
+    buf = p;
+    *size = n;
+  }
+  if (clear) memset(buf, 0, need);
+  return buf;
+}
+
+// Give a pixel buffer of the given size back to the pool
+// (or to the system, if it was mapped).
+// Preserves errno.
+static void pixFree(uint8* buf, size_t size) {
+  if (buf == NULL) return;
+  if (size >= PIX_MMAP_MIN) {
+    int e = errno;
+    munmap(buf, size);
+    errno = e;
+    return;
+  }
+  if (size > poolLimit) {
+    free(buf);
+    return;
+  }
+  //Libertar os buffers mais antigos até haver lugar para este
+  while (poolCount == POOL_SLOTS || poolBytes + size > poolLimit) {
+    free(pool[0].buf);
+    poolRemove(0);
+  }
+  pool[poolCount].buf = buf;
+  pool[poolCount].size = size;
+  poolCount++;
+  poolBytes += size;
+}
+
+/// Set the maximum memory (in bytes) kept in the pool of free pixel buffers.
+/// A limit of 0 disables the pool.
+void ImagePoolSetLimit(size_t bytes) { ///
+  poolLimit = bytes;
+  //Libertar o que exceder o novo limite
+  while (poolCount > 0 && poolBytes > poolLimit) {
+    free(pool[0].buf);
+    poolRemove(0);
+  }
+}
+
+/// Free all the buffers kept in the pool of free pixel buffers.
+void ImagePoolDrain(void) { ///
+  while (poolCount > 0) {
+    free(pool[0].buf);
+    poolRemove(0);
+  }
+}
+
+/// Release the resources held by the library (pooled memory).
+/// Images may still be created afterwards; call at program exit.
+void ImageDone(void) { ///
+  ImagePoolDrain();
+  ThreadsDone();
+}
+
+
+/// Parallel execution
+
+// Whole-image operations process bands of rows on the thread pool
+// (see imageThreads.h); operations whose cost varies across the image
+// process small tiles, with work stealing.  Images too small to be worth splitting (fewer
+// pixels than the grain, per thread) are processed on the calling thread.
+// Instrumentation counters are only updated by the calling thread.
+
+/// Set the number of threads used by whole-image operations.
+/// n == 0 selects one per CPU (the default).
+/// Returns the number of threads set.
+int ImageSetThreads(int n) { ///
+  assert (n >= 0);
+  return ThreadsSet(n);
+}
+
+/// Number of threads used by whole-image operations.
+int ImageGetThreads(void) { ///
+  return ThreadsCount();
+}
+
+/// Reset the per-thread instrumentation counters.
+void ImageThreadStatsReset(void) { ///
+  ThreadsStatsReset();
+}
+
+/// Print the per-thread instrumentation counters.
+void ImageThreadStatsPrint(void) { ///
+  ThreadsStatsPrint();
+}
+
+// A band job: rows(arg, lo, hi, task) processes rows [lo, hi) of n.
+typedef struct {
+  void (*rows)(void* arg, int lo, int hi, int task);
+  void* arg;
+  int n;
+} Bands;
+
+static void bandTask(void* arg, int task, int ntasks) {
+  Bands* b = arg;
+  int lo, hi;
+  ThreadsRange(b->n, task, ntasks, &lo, &hi);
+  if (lo < hi) b->rows(b->arg, lo, hi, task);
+}
+
+// Number of bands to split n rows of width pixels in.
+static int bandsFor(int n, int width) {
+  int tasks = ThreadsTasks((size_t)n * (size_t)width);
+  return tasks < n ? tasks : (n > 0 ? n : 1);
+}
+
+// Call rows(arg, lo, hi, task) for bands [lo, hi) covering rows [0, n),
+// with task in [0, ntasks), in parallel.
+static void forBands(int n, int ntasks, void (*rows)(void*, int, int, int), void* arg) {
+  if (n <= 0) return;
+  if (ntasks <= 1) {
+    rows(arg, 0, n, 0);
+    return;
+  }
+  Bands b = { rows, arg, n };
+  ThreadsRun(ntasks, bandTask, &b);
+}
+
+// Call rows(arg, lo, hi, task) for bands covering rows [0, n),
+// each with width pixels, in parallel if worth it.
+static void forRows(int n, int width, void (*rows)(void*, int, int, int), void* arg) {
+  forBands(n, bandsFor(n, width), rows, arg);
+}
+
+
+// Integral image (summed-area table)
+//
+// An image may keep its integral image, built on first use (see satOf) and
+// kept up to date by the functions that change its pixels, which record
+// the top left corner of the changes (see changed): only the entries below
+// and right of it are recomputed, the next time the table is used.  So
+// region sums and locates on an unchanged image share one table, and on
+// an image changed in a small region (near its bottom right) update little.
+// Entry (x, y) of the table, for 0 <= x <= width and 0 <= y <= height, is
+// the sum of the pixels in [0, x)x[0, y) modulo 2^32: the sum of a
+// rectangle (from four entries) is exact if it has at most SAT_AREA_MAX
+// pixels.
+#define SAT_AREA_MAX (UINT32_MAX / 255)
+
+// Largest integral image kept (bytes): larger images do without one.
+#define SAT_SIZE_MAX ((size_t)1 << 30)
+
+// Row y (0 <= y <= height) of the integral image sat of img.
+static inline uint32_t* satRow(Image img, uint32_t* sat, int y) {
+  return sat + (size_t)y * ((size_t)img->width + 1);
+}
+
+// Sum (modulo 2^32) of the pixels of img in rectangle (x,y,w,h), from its
+// integral image sat.
+static inline uint32_t satSum(Image img, uint32_t* sat, int x, int y, int w, int h) {
+  const uint32_t* r0 = satRow(img, sat, y);
+  const uint32_t* r1 = satRow(img, sat, y + h);
+  return r1[x + w] - r1[x] - r0[x + w] + r0[x];
+}
+
+// Arguments of the (partial) computation of an integral image: the entries
+// (x, y) with x > x0 and y > y0, from the others and the pixels.
+typedef struct {
+  Image img;
+  int x0, y0;
+} SatArgs;
+
+// Compute rows (y0+lo, y0+hi] of the integral image, from image rows
+// [y0+lo, y0+hi).  Bands other than the first start as if the row above
+// them were 0 (after the entry of column x0): satFixRows adds it later.
+static void satRows(void* arg, int lo, int hi, int task) {
+  SatArgs* a = arg;
+  Image img = a->img;
+  (void)task;
+  size_t w = (size_t)img->width;
+  size_t x0 = (size_t)a->x0;
+  for (int y = a->y0 + lo; y < a->y0 + hi; y++) {
+    const uint8* p = rowPtr(img, y);
+    const uint32_t* prev = satRow(img, img->sat, y);
+    uint32_t* dst = satRow(img, img->sat, y + 1);
+    uint32_t run = dst[x0] - prev[x0];   // sum of the pixels before column x0
+    if (lo > 0 && y == a->y0 + lo) {
+      for (size_t x = x0; x < w; x++) dst[x+1] = run += p[x];
+    } else {
+      for (size_t x = x0; x < w; x++) dst[x+1] = prev[x+1] + (run += p[x]);
+    }
+  }
+}
+
+// Add to rows (y0+lo+1, y0+hi) of the integral image its row y0+lo, the
+// (complete) last row of the previous band (see satUpdate).
+static void satFixRows(void* arg, int lo, int hi, int task) {
+  SatArgs* a = arg;
+  Image img = a->img;
+  (void)task;
+  if (lo == 0) return;
+  size_t w = (size_t)img->width;
+  const uint32_t* add = satRow(img, img->sat, a->y0 + lo);
+  for (int y = a->y0 + lo + 1; y < a->y0 + hi; y++) {
+    uint32_t* dst = satRow(img, img->sat, y);
+    for (size_t x = (size_t)a->x0 + 1; x <= w; x++) dst[x] += add[x];
+  }
+}
+
+// Compute the entries (x, y) of the integral image of img with x > x0 and
+// y > y0 (the others must be right).
+static void satUpdate(Image img, int x0, int y0) {
+  // Cada banda soma as suas linhas como se a linha acima fosse zero;
+  // depois, por ordem, a última linha de cada banda recebe a da banda
+  // anterior, e as outras linhas de cada banda recebem (em paralelo) a
+  // última da banda anterior
+  int n = img->height - y0;
+  int bands = bandsFor(n, img->width - x0);
+  SatArgs a = { img, x0, y0 };
+  forBands(n, bands, satRows, &a);
+  if (bands > 1) {
+    int lo, hi, prev = 0;
+    for (int t = 0; t < bands; t++) {
+      ThreadsRange(n, t, bands, &lo, &hi);
+      if (lo >= hi) continue;
+      if (prev > 0) {
+        uint32_t* dst = satRow(img, img->sat, y0 + hi);
+        const uint32_t* add = satRow(img, img->sat, y0 + prev);
+        for (size_t x = (size_t)x0 + 1; x <= (size_t)img->width; x++) dst[x] += add[x];
+      }
+      prev = hi;
+    }
+    forBands(n, bands, satFixRows, &a);
+  }
+  PIXMEM += (unsigned long)(img->width - x0) * n;  // count pixel memory accesses
+  img->satX = img->width;
+  img->satY = img->height;
+}
+
+// The integral image of img, built or brought up to date if needed.
+// Returns NULL if img is too large for one, or out of memory (which is not
+// an error: callers do without).
+static uint32_t* satOf(Image img) {
+  if (img->sat == NULL) {
+    size_t w = (size_t)img->width + 1;
+    size_t h = (size_t)img->height + 1;
+    if (h > SAT_SIZE_MAX / sizeof(uint32_t) / w) return NULL;
+    // (a primeira linha e a primeira coluna são zero)
+    img->sat = calloc(w * h, sizeof(uint32_t));
+    if (img->sat == NULL) return NULL;
+    img->satX = 0;
+    img->satY = 0;
+  }
+  if (img->satX < img->width && img->satY < img->height) {
+    satUpdate(img, img->satX, img->satY);
+  }
+  return img->sat;
+}
+
+// Band histograms
+//
+// An image may also keep the histograms of its bands of rows (see histOf),
+// built by ImageFullStats and kept up to date as the integral image: the
+// functions that change pixels mark the bands they touch as stale, and
+// only those are counted again.  Bands have at least HIST_BAND_PIXELS
+// pixels (so the histograms take at most 1/16 of the memory of the image),
+// and at most UINT32_MAX (their counts are 32-bit).
+#define HIST_BAND_PIXELS (1 << 14)
+
+struct histCache {
+  int rows;               // rows per band (the last band may have fewer)
+  int bands;              // number of bands
+  int stale;              // number of stale bands
+  uint8* changed;         // changed[b] is nonzero if band b is stale
+  uint32_t count[][256];  // histogram of each band
+};
+
+// Count the histogram of band b of img into hc->count[b].
+static void histBand(Image img, struct histCache* hc, int b) {
+  uint32_t sub[4 * 256] = { 0 };
+  int lo = b * hc->rows;
+  int hi = hc->rows < img->height - lo ? lo + hc->rows : img->height;
+  for (int y = lo; y < hi; y++) {
+    Kernels.histogram(rowPtr(img, y), (size_t)img->width, sub);
+  }
+  for (int v = 0; v < 256; v++) {
+    hc->count[b][v] = sub[v] + sub[256 + v] + sub[512 + v] + sub[768 + v];
+  }
+  PIXMEM += (unsigned long)img->width * (hi - lo);  // count pixel memory accesses
+}
+
+// The band histograms of img, built or brought up to date if needed.
+// Returns NULL if out of memory (which is not an error: callers do without).
+static struct histCache* histOf(Image img) {
+  struct histCache* hc = img->hist;
+  if (hc == NULL) {
+    // Linhas por banda: pelo menos HIST_BAND_PIXELS pixeis, no máximo UINT32_MAX
+    size_t w = img->width > 0 ? (size_t)img->width : 1;
+    size_t rows = (HIST_BAND_PIXELS + w - 1) / w;
+    if (rows > UINT32_MAX / w) rows = UINT32_MAX / w;
+    if (rows > (size_t)img->height) rows = img->height > 0 ? (size_t)img->height : 1;
+    size_t bands = ((size_t)img->height + rows - 1) / rows;
+    hc = malloc(sizeof(*hc) + bands * (sizeof(hc->count[0]) + 1));
+    if (hc == NULL) return NULL;
+    hc->rows = (int)rows;
+    hc->bands = (int)bands;
+    hc->stale = (int)bands;
+    hc->changed = (uint8*)hc->count[bands];
+    memset(hc->changed, 1, bands);
+    img->hist = hc;
+  }
+  for (int b = 0; hc->stale > 0 && b < hc->bands; b++) {
+    if (!hc->changed[b]) continue;
+    histBand(img, hc, b);
+    hc->changed[b] = 0;
+    hc->stale--;
+  }
+  return hc;
+}
+
+// Add up the histograms of the bands in hc into hist.
+static void histTotal(const struct histCache* hc, uint64_t* hist) {
+  memset(hist, 0, 256 * sizeof(uint64_t));
+  for (int b = 0; b < hc->bands; b++) {
+    for (int v = 0; v < 256; v++) hist[v] += hc->count[b][v];
+  }
+}
+
+// Shared pixel buffers
+//
+// Clones share the pixel buffer of their image (see ImageClone), with a
+// reference count, until one of them is about to change: that one copies
+// the buffer first (copy-on-write), unless it is the last one left.
+
+// Make the pixel buffer of img its own, copying it if it is shared.
+// Returns nonzero on success; on failure, img is left unchanged.
+static int pixOwn(Image img) {
+  if (*img->refs > 1) {
+    size_t size = img->stride * (size_t)img->height;
+    uint8* buf = pixAlloc(&size, 0);
+    if (buf == NULL) {
+      errCause = "Memory allocation failed";
+      return 0;
+    }
+    memcpy(buf, img->pixel, img->stride * (size_t)img->height);
+    PIXMEM += 2 * (unsigned long)img->width * img->height;  // count copy reads and stores
+    (*img->refs)--;
+    img->pixel = buf;
+    img->capacity = size;
+  } else {
+    free(img->refs);   // (the others were destroyed)
+  }
+  img->refs = NULL;
+  return 1;
+}
+
+// Dirty rectangles
+//
+// The functions that change pixels also record the rectangles they change
+// (see ImageDirtyRects), up to IMAGE_DIRTY_MAX of them: past that, a new
+// rectangle is merged with the one whose bounding box grows least.
+
+// Bounding box of rectangles r and s.
+static ImageRect rectUnion(ImageRect r, ImageRect s) {
+  int x0 = r.x < s.x ? r.x : s.x;
+  int y0 = r.y < s.y ? r.y : s.y;
+  int x1 = r.x + r.w > s.x + s.w ? r.x + r.w : s.x + s.w;
+  int y1 = r.y + r.h > s.y + s.h ? r.y + r.h : s.y + s.h;
+  ImageRect u = { x0, y0, x1 - x0, y1 - y0 };
+  return u;
+}
+
+// Add rectangle r (not empty) to the dirty rectangles of img.
+static void dirtyAdd(Image img, ImageRect r) {
+  // O retângulo mais recente primeiro: os ciclos de ImageSetPixel mudam
+  // pixeis seguidos, que o alargam numa linha ou coluna
+  if (img->ndirty > 0) {
+    ImageRect* d = &img->dirty[img->ndirty - 1];
+    ImageRect u = rectUnion(*d, r);
+    if ((uint64_t)u.w * u.h <= (uint64_t)d->w * d->h + (uint64_t)r.w * r.h) {
+      *d = u;   // (a união não tem mais pixeis do que os dois)
+      return;
+    }
+  }
+  if (img->ndirty < IMAGE_DIRTY_MAX) {
+    img->dirty[img->ndirty++] = r;
+    return;
+  }
+  int best = 0;
+  uint64_t growth = UINT64_MAX;
+  for (int i = 0; i < img->ndirty; i++) {
+    ImageRect u = rectUnion(img->dirty[i], r);
+    uint64_t g = (uint64_t)u.w * u.h - (uint64_t)img->dirty[i].w * img->dirty[i].h;
+    if (g < growth) {
+      growth = g;
+      best = i;
+    }
+  }
+  img->dirty[best] = rectUnion(img->dirty[best], r);
+}
+
+// Record that the pixels of img in rectangle (x,y,w,h), which must be
+// inside img, are about to change: in the caches and dirty rectangles.
+// A shared pixel buffer is copied first (see pixOwn).
+// Returns nonzero on success; on failure, img must not be changed.
+static inline int changed(Image img, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return 1;
+  if (img->refs != NULL && !pixOwn(img)) return 0;
+  if (img->sat != NULL) {
+    if (x < img->satX) img->satX = x;
+    if (y < img->satY) img->satY = y;
+  }
+  struct histCache* hc = img->hist;
+  if (hc != NULL) {
+    for (int b = y / hc->rows; b <= (y + (h - 1)) / hc->rows; b++) {
+      hc->stale += !hc->changed[b];
+      hc->changed[b] = 1;
+    }
+  }
+  // (Os ciclos de ImageSetPixel mudam sobretudo pixeis dentro do último
+  // retângulo)
+  if (img->ndirty > 0) {
+    const ImageRect* d = &img->dirty[img->ndirty - 1];
+    if (d->x <= x && x + w <= d->x + d->w && d->y <= y && y + h <= d->y + d->h) return 1;
+  }
+  ImageRect r = { x, y, w, h };
+  dirtyAdd(img, r);
+  return 1;
+}
+
+// Record that all the pixels of img are about to change (as changed).
+static inline int changedAll(Image img) {
+  return changed(img, 0, 0, img->width, img->height);
+}
+
 
 /// Image management functions
 
@@ -188,8 +746,19 @@ Image ImageCreate(int width, int height, uint8 maxval) {
   img->height = height;
   img->maxval = maxval;
 
-  //Alocar memoria para o array de pixeis da imagem (dados dos pixeis)
-  img->pixel = (uint8*)malloc(width * height * sizeof(uint8));
+  //Alocar memoria para o array de pixeis da imagem (dados dos pixeis),
+  //com as linhas alinhadas e de tamanho múltiplo de PIX_ALIGN
+  //(pixAlloc com clear garante que a imagem começa preta, com todos os pixeis a 0)
+  img->stride = strideOf(width);
+  //Verificar se o tamanho do array (stride*height) cabe num size_t
+  if (height > 0 && img->stride > SIZE_MAX / (size_t)height) {
+    errno = ENOMEM;
+    errCause = "Image too large";
+    free(img);
+    return NULL;
+  }
+  img->capacity = img->stride * (size_t)height;
+  img->pixel = pixAlloc(&img->capacity, 1);
   //Verificar se a alocação de memória para o array de pixeis foi bem sucedida
   if (img->pixel == NULL) {
     //Se não foi bem sucedida imprimir a mensagem de erro
@@ -213,14 +782,50 @@ void ImageDestroy(Image* imgp) {
     return;
   }
 
-  //Libertar a memoria alocada para o array de pixeis da imagem
-  free((*imgp)->pixel);
+  //Devolver o array de pixeis da imagem ao pool (para ser reutilizado),
+  //se nenhum clone o partilhar
+  int* refs = (*imgp)->refs;
+  if (refs == NULL || --*refs == 0) {
+    pixFree((*imgp)->pixel, (*imgp)->capacity);
+    free(refs);
+  }
+  free((*imgp)->sat);
+  free((*imgp)->hist);
   //Libertar a memoria alocada para a imagem
   free(*imgp);
   //Definir o valor do ponteiro para a imagem como NULL
   *imgp = NULL;
 }
 
+/// Clone an image.
+Image ImageClone(Image img) { ///
+  assert (img != NULL);
+  //O contador de referências é criado no primeiro clone
+  if (img->refs == NULL) {
+    img->refs = malloc(sizeof(int));
+    if (img->refs == NULL) {
+      errCause = "Memory allocation failed";
+      return NULL;
+    }
+    *img->refs = 1;
+  }
+  Image clone = calloc(1, sizeof(struct image));
+  if (clone == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  //Os pixeis são partilhados (as caches e os retângulos sujos não)
+  clone->width = img->width;
+  clone->height = img->height;
+  clone->maxval = img->maxval;
+  clone->pixel = img->pixel;
+  clone->stride = img->stride;
+  clone->capacity = img->capacity;
+  clone->refs = img->refs;
+  (*img->refs)++;
+  return clone;
+}
+
 
 /// PGM file operations
 
@@ -239,34 +844,129 @@ static int skipComments(FILE* f) {
   return i;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+// Read the pixels of img (a raster scan, without padding) from f.
+// Returns nonzero on success.
+static int readPixels(Image img, FILE* f) {
+  size_t w = img->width;
+  //Ler tudo de uma vez: um fread grande lê diretamente para o array, em
+  //blocos grandes, sem passar pelo buffer de f (linha a linha, cada linha
+  //seria copiada do buffer, e haveria uma leitura por cada bloco do buffer)
+  if (fread(img->pixel, sizeof(uint8), w * (size_t)img->height, f) != w * (size_t)img->height) return 0;
+  //Com padding: afastar as linhas, da última para a primeira
+  //(a linha y passa de y*w para y*stride, que nunca é antes)
+  if (img->stride != w) {
+    for (int y = img->height - 1; y > 0; y--) {
+      memmove(rowPtr(img, y), img->pixel + (size_t)y * w, w);
+    }
+  }
+  return 1;
+}
+
+// Rows written by each writev (see writePixels).
+#define WRITE_ROWS 1024
+
+// Write all the bytes of iov[0..n-1] to descriptor fd.
+// Returns nonzero on success.
+static int writeAll(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    ssize_t k = writev(fd, iov, n);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) return 0;
+    //Saltar o que foi escrito (a escrita pode ser parcial)
+    while (n > 0 && (size_t)k >= iov->iov_len) {
+      k -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8*)iov->iov_base + k;
+      iov->iov_len -= k;
+    }
+  }
+  return 1;
+}
+
+// Write the pixels of img (a raster scan, without padding) to f.
+// Returns nonzero on success.
+static int writePixels(Image img, FILE* f) {
+  size_t w = img->width;
+  if (img->stride == w) {
+    //Sem padding: um fwrite grande escreve diretamente do array
+    return fwrite(img->pixel, sizeof(uint8), w * (size_t)img->height, f) == w * (size_t)img->height;
+  }
+  //Com padding, se f tiver um descritor (não for uma stream em memória):
+  //escrever as linhas diretamente do array, WRITE_ROWS de cada vez
+  //(com writev), em vez de as copiar para o buffer de f
+  int fd = fileno(f);
+  if (fd >= 0 && w > 0) {
+    if (fflush(f) != 0) return 0;
+    struct iovec iov[WRITE_ROWS];
+    for (int y = 0; y < img->height; y += WRITE_ROWS) {
+      int n = img->height - y < WRITE_ROWS ? img->height - y : WRITE_ROWS;
+      for (int i = 0; i < n; i++) {
+        iov[i].iov_base = rowPtr(img, y + i);
+        iov[i].iov_len = w;
+      }
+      if (!writeAll(fd, iov, n)) return 0;
+    }
+    return 1;
+  }
+  for (int y = 0; y < img->height; y++) {
+    if (fwrite(rowPtr(img, y), sizeof(uint8), w, f) != w) return 0;
+  }
+  return 1;
+}
+
+// Parse a PGM header from f, leaving f at the first pixel.
+// Returns nonzero on success (errCause is set on failure).
+static int readHeader(FILE* f, long* w, long* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%ld ", w) == 1 && 0 <= *w && *w <= INT_MAX , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%ld ", h) == 1 && 0 <= *h && *h <= INT_MAX , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+/// Read the size and maxval of a raw PGM file, without loading the pixels.
+/// On success, returns nonzero and sets (*width, *height, *maxval).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLoadInfo(const char* filename, int* width, int* height, int* maxval) { ///
+  long w, h;
+  FILE* f = NULL;
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, &w, &h, maxval);
+  if (f != NULL) fclose(f);
+  if (success) {
+    *width = (int)w;
+    *height = (int)h;
+  }
+  return success;
+}
+
+/// Read a raw PGM image from stream f, which is left after its last pixel
+/// (so that images can be read one after another from the same stream).
 /// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char* filename) { ///
-  int w, h;
+Image ImageRead(FILE* f) { ///
+  assert (f != NULL);
+  long w = 0, h = 0;
   int maxval;
-  char c;
-  FILE* f = NULL;
   Image img = NULL;
 
   int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = ImageCreate((int)w, (int)h, (uint8)maxval)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( readPixels(img, f) , "Reading pixels" );
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -274,26 +974,59 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
   return img;
 }
 
+/// Load a raw PGM file.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char* filename) { ///
+  FILE* f = NULL;
+  Image img = NULL;
+
+  if (check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) {
+    img = ImageRead(f);
+  }
+
+  // Cleanup
+  if (f != NULL) {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Write img to stream f, in raw PGM format.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  check( writePixels(img, f), "Writing pixels failed" ); 
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+  return success;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  ImageWrite(img, f);
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -323,6 +1056,21 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+/// Get a hash of the image (size, maxval and pixels).
+uint64_t ImageHash(Image img, uint64_t seed) { ///
+  assert (img != NULL);
+  XXH64_state st;
+  char header[64];
+  int n = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", img->width, img->height, img->maxval);
+  XXH64_reset(&st, seed);
+  XXH64_update(&st, header, n);
+  for (int y = 0; y < img->height; y++) {
+    XXH64_update(&st, rowPtr(img, y), img->width);
+  }
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return XXH64_digest(&st);
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -339,24 +1087,127 @@ void ImageStats(Image img, uint8* min, uint8* max) { ///
   *min = PixMax;
   *max = 0;
 
-  //Iterar sobre todas as linhas da imagem
-  for (int i = 0; i < ImageHeight(img); i++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < ImageWidth(img); j++) {
-      //Obter o valor de cinzento do pixel na posição (j, i)
-      uint8 pixelValue = ImageGetPixel(img, j, i);
-      //Verificar se o valor de cinzento do pixel é menor que o valor atual do min
-      if (pixelValue < *min) {
-        //Se for menor, o novo valor do min é o valor de cinzento do pixel
-        *min = pixelValue;
-      }
-      //Verificar se o valor de cinzento do pixel é maior que o valor atual do max
-      if (pixelValue > *max) {
-        //Se for maior, o novo valor do max é o valor de cinzento do pixel
-        *max = pixelValue;
+  //Com histogramas das bandas (de ImageFullStats), só contar as bandas
+  //alteradas, e procurar os níveis extremos no histograma total
+  if (img->hist != NULL && histOf(img) != NULL) {
+    uint64_t hist[256];
+    histTotal(img->hist, hist);
+    for (int v = 0; v < 256; v++) {
+      if (hist[v] == 0) continue;
+      if (v < *min) *min = (uint8)v;
+      *max = (uint8)v;
+    }
+    return;
+  }
+
+  //Percorrer cada linha com o kernel minmax
+  //(só os pixeis da linha: o padding não conta para as estatísticas)
+  for (int i = 0; i < img->height; i++) {
+    Kernels.minmax(rowPtr(img, i), img->width, min, max);
+  }
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+}
+
+// Add the 4 sub-histograms sub (see the histogram kernel) to hist,
+// and clear them.
+static void flushHistogram(uint32_t* sub, uint64_t* hist) {
+  for (int v = 0; v < 256; v++) {
+    hist[v] += (uint64_t)sub[v] + sub[256 + v] + sub[512 + v] + sub[768 + v];
+  }
+  memset(sub, 0, 4 * 256 * sizeof(uint32_t));
+}
+
+/// Compute the histogram, minimum, maximum, mean and variance of the
+/// gray levels in image, all in a single pass over the pixels.
+/// On return, *st is filled in.
+void ImageFullStats(Image img, ImageStatistics* st) { ///
+  //Verificar se a imagem e o ponteiro st existem
+  assert (img != NULL);
+  assert (st != NULL);
+
+  //Uma única passagem pelos pixeis: só o histograma, de cada banda de
+  //linhas, guardado na imagem (histOf): depois, só as bandas com pixeis
+  //alterados são contadas de novo
+  memset(st, 0, sizeof(*st));
+  size_t w = (size_t)img->width;
+  struct histCache* hc = histOf(img);
+  if (hc != NULL) {
+    histTotal(hc, st->hist);
+  } else {
+    //Sem memória para os histogramas das bandas: contar tudo.
+    //O kernel conta em 4 sub-histogramas de 32 bits, que somamos ao
+    //histograma (de 64 bits) antes de poderem transbordar
+    uint32_t sub[4 * 256] = { 0 };
+    size_t pending = 0;   // pixeis contados em sub desde a última soma
+    for (int i = 0; i < img->height; i++) {
+      if (pending + w > UINT32_MAX) {
+        flushHistogram(sub, st->hist);
+        pending = 0;
       }
+      Kernels.histogram(rowPtr(img, i), w, sub);
+      pending += w;
+    }
+    flushHistogram(sub, st->hist);
+    PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  }
+
+  //Tudo o resto se calcula a partir do histograma (só 256 niveis)
+  st->count = (uint64_t)w * (size_t)img->height;
+  st->min = PixMax;
+  st->max = 0;
+  uint64_t sum = 0;
+  for (int v = 0; v < 256; v++) {
+    if (st->hist[v] == 0) continue;
+    if (v < st->min) st->min = (uint8)v;
+    st->max = (uint8)v;
+    sum += st->hist[v] * (uint64_t)v;
+  }
+  if (st->count == 0) return;
+  st->mean = (double)sum / (double)st->count;
+  //Variância como média dos quadrados dos desvios (numericamente estável)
+  double ss = 0.0;
+  for (int v = 0; v < 256; v++) {
+    double d = v - st->mean;
+    ss += (double)st->hist[v] * d * d;
+  }
+  st->variance = ss / (double)st->count;
+}
+
+// Sum of the pixels of img in rectangle (x,y,w,h), which must be inside
+// img, without the integral image.
+static uint64_t pixelSum(Image img, int x, int y, int w, int h) {
+  uint64_t sum = 0;
+  for (int i = 0; i < h; i++) {
+    const uint8* p = rowPtr(img, y + i) + x;
+    for (int j = 0; j < w; j++) sum += p[j];
+  }
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+  return sum;
+}
+
+/// Sum of the gray levels in the rectangle (x,y,w,h), which must be inside img.
+/// The first sum builds the integral image of img, which is kept until img
+/// changes, so that later sums take constant time.
+uint64_t ImageRegionSum(Image img, int x, int y, int w, int h) { ///
+  //Verificar se a imagem existe e se o retângulo está dentro dela
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  if (w <= 0 || h <= 0) return 0;
+
+  //Com a imagem integral, somar em faixas de linhas com no máximo
+  //SAT_AREA_MAX pixeis (em que as somas da tabela são exatas)
+  uint32_t* sat = (size_t)w <= SAT_AREA_MAX ? satOf(img) : NULL;
+  uint64_t sum = 0;
+  if (sat != NULL) {
+    int rows = (int)(SAT_AREA_MAX / (size_t)w);
+    for (int i = 0; i < h; i += rows) {
+      sum += satSum(img, sat, x, y + i, w, rows < h - i ? rows : h - i);
     }
+    return sum;
   }
+  //Sem imagem integral (imagem demasiado grande, ou sem memória para ela):
+  //somar os pixeis do retângulo
+  return pixelSum(img, x, y, w, h);
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -369,18 +1220,25 @@ int ImageValidPos(Image img, int x, int y) { ///
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   //Verificar se a imagem existe
   assert (img != NULL);
-  //Verificar se o retângulo esta dentro da imagem
-  for (int i = x; i < x + w; i++) {
-    for (int j = y; j < y + h; j++) {
-      //Verificar se o pixel na posição (i, j) existe
-      if (!ImageValidPos(img, i, j)) {
-        //Se nao existir, entao o retângulo nao esta dentro da imagem
-        return 0;
-      }
-    }
-  }
-  //Se existir, entao o retângulo esta dentro da imagem
-  return 1;
+  //Um retângulo vazio (w <= 0 ou h <= 0) não tem pixeis fora da imagem
+  if (w <= 0 || h <= 0) return 1;
+  //Verificar os cantos do retângulo, sem calcular x + w nem y + h
+  //(que podem exceder INT_MAX): como w > 0, img->width - w não transborda
+  return (0 <= x && x <= img->width - w) && (0 <= y && y <= img->height - h);
+}
+
+/// Copy the dirty rectangles of img into rects, and return their number.
+int ImageDirtyRects(Image img, ImageRect* rects) { ///
+  assert (img != NULL);
+  assert (rects != NULL);
+  memcpy(rects, img->dirty, img->ndirty * sizeof(ImageRect));
+  return img->ndirty;
+}
+
+/// Forget the dirty rectangles of img.
+void ImageMarkClean(Image img) { ///
+  assert (img != NULL);
+  img->ndirty = 0;
 }
 
 /// Pixel get & set operations
@@ -392,12 +1250,14 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
+// The returned index must satisfy (0 <= index < img->stride*img->height)
+// (It is a size_t: images may have more than INT_MAX pixels.)
+static inline size_t G(Image img, int x, int y) {
  //Calcular o índice do pixel nas coordenadas (x,y)
- int index = y * img->width + x;
+ //(cada linha ocupa img->stride bytes)
+ size_t index = (size_t)y * img->stride + (size_t)x;
  //Verificar se o índice do pixel esta dentro da img
- assert (0 <= index && index < img->width*img->height);
+ assert (index < img->stride * (size_t)img->height);
  return index;
 }
 
@@ -414,6 +1274,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
+  if (!changed(img, x, y, 1, 1)) return;
   img->pixel[G(img, x, y)] = level;
 } 
 
@@ -422,9 +1283,40 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the image shares its pixels with clones (see ImageClone).
+/// They never fail, but for the copy of shared pixels: then they set
+/// errCause and leave the image unchanged.
+
+
+// Arguments of the point operations on bands of rows.
+typedef struct {
+  Image img;
+  uint8 thr;          // threshold level
+  const uint8* lut;   // lookup table
+} PointArgs;
+
+// Rows [lo, hi) of an image, including the padding.
+#define BAND_PIXELS(img, lo) ((img)->pixel + (size_t)(lo) * (img)->stride)
+#define BAND_SIZE(img, lo, hi) ((size_t)((hi) - (lo)) * (img)->stride)
+
+static void negativeRows(void* arg, int lo, int hi, int task) {
+  Image img = ((PointArgs*)arg)->img;
+  (void)task;
+  Kernels.negate(BAND_PIXELS(img, lo), BAND_SIZE(img, lo, hi), (uint8)img->maxval);
+}
+
+static void thresholdRows(void* arg, int lo, int hi, int task) {
+  PointArgs* a = arg;
+  (void)task;
+  Kernels.threshold(BAND_PIXELS(a->img, lo), BAND_SIZE(a->img, lo, hi), a->thr, (uint8)a->img->maxval);
+}
 
+static void lookupRows(void* arg, int lo, int hi, int task) {
+  PointArgs* a = arg;
+  (void)task;
+  Kernels.lookup(BAND_PIXELS(a->img, lo), BAND_SIZE(a->img, lo, hi), a->lut);
+}
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -433,16 +1325,14 @@ void ImageNegative(Image img) {
   //Verificar se a imagem existe
   assert(img != NULL);
 
-  //Iterar sobre todas as linhas da imagem
-  for (int y = 0; y < ImageHeight(img); y++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int x = 0; x < ImageWidth(img); x++) {
-      //Obter o valor de cinzento do pixel na posição (x, y)
-      uint8 currentLevel = ImageGetPixel(img, x, y);
-      //Definir o valor de cinzento do pixel na posição (x, y) com o valor obtido subtraido ao maxval da imagem
-      ImageSetPixel(img, x, y, ImageMaxval(img) - currentLevel);
-    }
-  }
+  //Subtrair cada pixel ao maxval da imagem, em todo o array de uma vez
+  //(incluindo o padding: assim o array está alinhado e tem um tamanho
+  //múltiplo de PIX_ALIGN, e o kernel não precisa de tratar restos),
+  //ou em bandas de linhas, em paralelo, se a imagem for grande
+  if (!changedAll(img)) return;
+  PointArgs a = { img, 0, NULL };
+  forRows(img->height, img->width, negativeRows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // count reads and stores
 }
 
 /// Apply threshold to image.
@@ -451,23 +1341,13 @@ void ImageNegative(Image img) {
 void ImageThreshold(Image img, uint8 thr) {
   //Verificar se a imagem existe
   assert (img != NULL);   
-  //Iterar sobre todas as linhas da imagem
-  for (int y = 0; y < ImageHeight(img); y++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int x = 0; x < ImageWidth(img); x++) {
-      //Obter o nivel de cinzento do pixel
-      uint8 currentLevel = ImageGetPixel(img, x, y);//obter o valor do pixel em (x,y)
-
-      //Verificar se o nivel de cinzento do pixel e menor que o threshold
-      if (currentLevel < thr) {
-        //Se for menor que o threshold, o pixel ficará preto
-          ImageSetPixel(img, x, y, 0);
-      } else {
-        //Se for maior ou igual ao threshold, o pixel ficará branco
-          ImageSetPixel(img, x, y, ImageMaxval(img));
-      }
-    }
-  }
+
+  //Os pixeis com nivel < thr ficam pretos, os restantes ficam brancos (maxval)
+  //(todo o array de uma vez, incluindo o padding, como em ImageNegative)
+  if (!changedAll(img)) return;
+  PointArgs a = { img, thr, NULL };
+  forRows(img->height, img->width, thresholdRows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // count reads and stores
 }
 
 /// Brighten image by a factor.
@@ -480,24 +1360,22 @@ void ImageBrighten(Image img, double fator) {
   //Verificar se o fator é maior ou igual a 0
   assert(fator >= 0.0);
 
-  //Iterar sobre todas as linhas da imagem
-  for (int y = 0; y < ImageHeight(img); y++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int x = 0; x < ImageWidth(img); x++) {
-      //Obter o valor de cinzento do pixel na posição (x, y)
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      //Calcular o novo valor de cinzento do pixel (multiplicandpo o valor obtido de pixelValue pelo fator de brilho - somamos 0.5 para arredondar o valor)
-      uint8 newPixelValue = (uint8)(pixelValue * fator + 0.5);   
-      if (newPixelValue > ImageMaxval(img)) {
-        //Se o novo valor de cinzento do pixel for maior que o maxval da imgOriginal, entao o novo valor do pixel é o seu maxval
-        ImageSetPixel(img, x, y, ImageMaxval(img));
-      } else {
-        //Caso contrário, o novo valor do pixel é o newPixelValue
-        ImageSetPixel(img, x, y, newPixelValue);
-      }
-    }
+  //Só há 256 niveis de cinzento possíveis, por isso calculamos o novo valor
+  //de cada nivel uma única vez numa tabela (lookup table) e depois
+  //substituimos cada pixel pelo valor correspondente da tabela
+  uint8 lut[256];
+  for (int level = 0; level < 256; level++) {
+    //Calcular o novo valor de cinzento (somamos 0.5 para arredondar o valor)
+    //(em double, para saturar antes de converter para uint8, senão os valores acima de 255 davam a volta)
+    double newPixelValue = level * fator + 0.5;
+    //Se o novo valor for maior que o maxval da imagem, fica o maxval
+    lut[level] = newPixelValue > img->maxval ? (uint8)img->maxval : (uint8)newPixelValue;
   }
+
+  if (!changedAll(img)) return;
+  PointArgs a = { img, 0, lut };
+  forRows(img->height, img->width, lookupRows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // count reads and stores
 }
 
 
@@ -514,9 +1392,30 @@ void ImageBrighten(Image img, double fator) {
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Side of the square blocks processed at a time by ImageRotate
+#define ROT_TILE 64
+
+// Arguments of the parallel ImageRotate.
+typedef struct {
+  Image src, dst;
+} RotateArgs;
+
+// Rotate the pixels of a tile of the source image.
+static void rotateTile(void* arg, const ThreadsTile* t) {
+  RotateArgs* a = arg;
+  int w = a->src->width;
+  //A coluna j da img passa a ser a linha w - 1 - j da imagem rodada
+  for (int i = t->y0; i < t->y1; i++) {
+    const uint8* src = rowPtr(a->src, i);
+    for (int j = t->x0; j < t->x1; j++) {
+      a->dst->pixel[G(a->dst, i, w - 1 - j)] = src[j];
+    }
+  }
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counter-clockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -533,20 +1432,37 @@ Image ImageRotate(Image img) {
     return NULL;
   }
 
-  //Iterar sobre todas as linhas da imagem
-  for (int i = 0; i < ImageHeight(img); ++i) {
-    //Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < ImageWidth(img); ++j) {
-      //Obter o valor de cinzento do pixel na img original na posição (j, i)
-      uint8 pixelValue = ImageGetPixel(img, i, j);
-      //Definir o valor de cinzento do pixel na rotatedImage na posição (j, ImageHeight(img) - 1 - i) com o valor obtido da img
-      ImageSetPixel(rotatedImage, j, ImageHeight(img) - 1 - i, pixelValue);
-    }
-  }
+  int w = img->width;
+  int h = img->height;
+  //Percorrer a imagem por blocos (tiles) de ROT_TILE x ROT_TILE pixeis,
+  //para que as linhas lidas e as colunas escritas de cada bloco caibam na cache
+  //(em imagens grandes, os blocos são distribuídos pelas threads)
+  RotateArgs a = { img, rotatedImage };
+  ThreadsRunTiles(w, h, ROT_TILE, ROT_TILE, rotateTile, &a);
+  PIXMEM += 2 * (unsigned long)w * h;  // count reads and stores
   //Retornar a imagem rodada
   return rotatedImage;
 }
 
+// Arguments of the row copies (mirror, crop, paste) on bands of rows:
+// rows [lo, hi) of dst receive the pixels of src from (x, y + lo) on,
+// and rows [lo, hi) of blend targets, from (x, y + lo).
+typedef struct {
+  Image dst;
+  Image src;
+  int x, y;
+  double alpha;       // blend factor
+  const uint8* lut2;  // blend table, or NULL
+} CopyArgs;
+
+static void mirrorRows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  (void)task;
+  for (int i = lo; i < hi; i++) {
+    Kernels.reverse(rowPtr(a->dst, i), rowPtr(a->src, i), a->src->width);
+  }
+}
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -565,20 +1481,181 @@ Image ImageMirror(Image img) {
     return NULL;
   }
   
-  //Iterar sobre todas as linhas da imagem
-  for (int i = 0; i < ImageHeight(img); i++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < ImageWidth(img); j++) {
-      //Obter o valor de cinzento do pixel na img original na posição (j, i)
-      uint8 pixelValue = ImageGetPixel(img, j, i);
-      //Definir o valor de cinzento do pixel na mirrorImg na posição (ImageWidth(img) - 1 - j, i) com o valor obtido da img
-      ImageSetPixel(mirrorImg, ImageWidth(img) - 1 - j, i, pixelValue);   
-    }
-  }
+  //Cada linha da mirrorImg é a linha correspondente da img invertida
+  CopyArgs a = { mirrorImg, img, 0, 0, 0.0, NULL };
+  forRows(img->height, img->width, mirrorRows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // count reads and stores
   //Retornar a imagem espelhada
   return mirrorImg;
 }
 
+// Rotate by 180 degrees: row i of src, reversed, is row h-1-i of dst.
+static void rotate180Rows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  (void)task;
+  int h = a->src->height;
+  for (int i = lo; i < hi; i++) {
+    Kernels.reverse(rowPtr(a->dst, h - 1 - i), rowPtr(a->src, i), a->src->width);
+  }
+}
+
+static Image rotate180(Image img) {
+  Image res = ImageCreate(img->width, img->height, img->maxval);
+  if (res == NULL) return NULL;
+  CopyArgs a = { res, img, 0, 0, 0.0, NULL };
+  forRows(img->height, img->width, rotate180Rows, &a);
+  PIXMEM += 2 * (unsigned long)img->width * img->height;  // count reads and stores
+  return res;
+}
+
+// Source coordinates of ImageRotateAngle, in fixed point (ROT_BITS
+// fraction bits): output pixel (x, y) samples the source at
+// (u0 + x*du + y*eu, v0 + x*dv + y*ev), in pixel units (pixel i of a row
+// is at i).  Each tile row steps these from its first pixel.
+#define ROT_BITS 24
+#define ROT_ONE ((int64_t)1 << ROT_BITS)
+
+// Arguments of the parallel ImageRotateAngle.
+typedef struct {
+  Image src, dst;
+  uint8 fill;
+  int64_t u0, du, eu;
+  int64_t v0, dv, ev;
+} RotateAngleArgs;
+
+// Rotate a tile of the destination image: gather the 2x2 neighbours and
+// the fractions of each pixel of a row, then interpolate them all at once.
+static void rotateAngleTile(void* arg, const ThreadsTile* t) {
+  RotateAngleArgs* a = arg;
+  Image src = a->src;
+  int64_t w = src->width;
+  int64_t h = src->height;
+  // Amostras dentro da imagem: [-0.5, w-0.5) x [-0.5, h-0.5)
+  int64_t umax = w * ROT_ONE - ROT_ONE / 2;
+  int64_t vmax = h * ROT_ONE - ROT_ONE / 2;
+  uint8 p00[ROT_TILE], p01[ROT_TILE], p10[ROT_TILE], p11[ROT_TILE];
+  uint8 fx[ROT_TILE], fy[ROT_TILE];
+  // Amostras com os 4 vizinhos dentro da imagem: [0, w-1) x [0, h-1)
+  int64_t uin = (w - 1) * ROT_ONE;
+  int64_t vin = (h - 1) * ROT_ONE;
+  size_t stride = src->stride;
+  int n = t->x1 - t->x0;
+  for (int y = t->y0; y < t->y1; y++) {
+    int64_t u = a->u0 + t->x0 * a->du + y * a->eu;
+    int64_t v = a->v0 + t->x0 * a->dv + y * a->ev;
+    for (int k = 0; k < n; k++, u += a->du, v += a->dv) {
+      if (u >= 0 && u < uin && v >= 0 && v < vin) {
+        const uint8* q = src->pixel + (size_t)(v >> ROT_BITS) * stride + (size_t)(u >> ROT_BITS);
+        fx[k] = (uint8)(u >> (ROT_BITS - 8));
+        fy[k] = (uint8)(v >> (ROT_BITS - 8));
+        p00[k] = q[0];
+        p01[k] = q[1];
+        p10[k] = q[stride];
+        p11[k] = q[stride + 1];
+        continue;
+      }
+      if (u < -ROT_ONE / 2 || u >= umax || v < -ROT_ONE / 2 || v >= vmax) {
+        p00[k] = p01[k] = p10[k] = p11[k] = a->fill;
+        fx[k] = fy[k] = 0;
+        continue;
+      }
+      // Perto das bordas: parte inteira (arredondada para baixo) e 8 bits
+      // da fração; antes do centro do primeiro pixel, e depois do último,
+      // repete-se o pixel da borda
+      int64_t i = ((u + ROT_ONE) >> ROT_BITS) - 1;
+      int64_t j = ((v + ROT_ONE) >> ROT_BITS) - 1;
+      fx[k] = i < 0 ? 0 : (uint8)(u >> (ROT_BITS - 8));
+      fy[k] = j < 0 ? 0 : (uint8)(v >> (ROT_BITS - 8));
+      if (i < 0) i = 0;
+      if (j < 0) j = 0;
+      int64_t i1 = i + 1 < w ? i + 1 : i;
+      const uint8* r0 = rowPtr(src, (int)j);
+      const uint8* r1 = j + 1 < h ? rowPtr(src, (int)j + 1) : r0;
+      p00[k] = r0[i];
+      p01[k] = r0[i1];
+      p10[k] = r1[i];
+      p11[k] = r1[i1];
+    }
+    Kernels.bilerpRow(rowPtr(a->dst, y) + t->x0, p00, p01, p10, p11, fx, fy, n);
+  }
+}
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a rotated version of the image (bilinear interpolation).
+/// The rotation is degrees counter-clockwise, around the center, and the
+/// result has the size of the bounding box of the rotated image, where
+/// the pixels not covered by it are set to fill.
+/// Multiples of 90 degrees are exact (the same as ImageRotate).
+/// Requires: fill <= ImageMaxval(img).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, uint8 fill) { ///
+  assert(img != NULL);
+  assert(isfinite(degrees));
+  assert(fill <= img->maxval);
+
+  // Ângulo em [0, 360): múltiplos de 90 graus são só cópias de pixeis
+  double r = fmod(degrees, 360.0);
+  if (r < 0.0) r += 360.0;
+  if (r >= 360.0) r = 0.0;   // (ângulos negativos ínfimos)
+  if (fmod(r, 90.0) == 0.0) {
+    switch ((int)(r / 90.0)) {
+    case 0: return ImageCrop(img, 0, 0, img->width, img->height);
+    case 1: return ImageRotate(img);
+    case 2: return rotate180(img);
+    default: {
+      Image tmp = ImageRotate(img);
+      if (tmp == NULL) return NULL;
+      Image res = rotate180(tmp);
+      ImageDestroy(&tmp);
+      return res;
+    }
+    }
+  }
+
+  double t = r * (M_PI / 180.0);
+  double c = cos(t);
+  double s = sin(t);
+  int w = img->width;
+  int h = img->height;
+  // Caixa envolvente da imagem rodada
+  double rw = floor(w * fabs(c) + h * fabs(s) + 0.5);
+  double rh = floor(w * fabs(s) + h * fabs(c) + 0.5);
+  if (rw > INT_MAX || rh > INT_MAX) {
+    errno = ENOMEM;
+    errCause = "Image too large";
+    return NULL;
+  }
+  Image res = ImageCreate((int)rw, (int)rh, img->maxval);
+  if (res == NULL || res->width == 0 || res->height == 0) return res;
+
+  // O centro do pixel (x, y) de res, relativo ao centro de res, roda para
+  // (dx*c - dy*s, dx*s + dy*c) relativo ao centro de img
+  double dx = 0.5 - rw / 2.0;
+  double dy = 0.5 - rh / 2.0;
+  RotateAngleArgs a = { img, res, fill, 0, 0, 0, 0, 0, 0 };
+  a.u0 = llround(ROT_ONE * (w / 2.0 - 0.5 + dx * c - dy * s));
+  a.v0 = llround(ROT_ONE * (h / 2.0 - 0.5 + dx * s + dy * c));
+  a.du = llround(ROT_ONE * c);
+  a.eu = -llround(ROT_ONE * s);
+  a.dv = llround(ROT_ONE * s);
+  a.ev = llround(ROT_ONE * c);
+  ThreadsRunTiles(res->width, res->height, ROT_TILE, ROT_TILE, rotateAngleTile, &a);
+  PIXMEM += 5 * (unsigned long)res->width * res->height;  // count 4 reads and 1 store
+  return res;
+}
+
+static void cropRows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  (void)task;
+  for (int i = lo; i < hi; i++) {
+    memcpy(rowPtr(a->dst, i), rowPtr(a->src, a->y + i) + a->x, a->dst->width);
+  }
+}
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -604,26 +1681,268 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {
     return NULL;
   }
 
-  //Iterar sobre todas as linhas da cropImg
-  for (int i = 0; i < h; i++) {
-    //Iterar sobre cada pixel dessa cropImg
-    for (int j = 0; j < w; j++) {
-      //Obter o valor de cinzento do pixel na img original na posição (x + j, y + i)
-      uint8 pixelValue = ImageGetPixel(img, x + j, y + i);
-      //Definir o valor de cinzento do pixel na imagem recortada na posição (j, i) com o valor obtido da img original
-      ImageSetPixel(cropImg, j, i, pixelValue);    
-    }
-  }
+  //Copiar cada linha do retângulo da img original para a cropImg
+  CopyArgs a = { cropImg, img, x, y, 0.0, NULL };
+  forRows(h, w, cropRows, &a);
+  PIXMEM += 2 * (unsigned long)w * h;  // count reads and stores
   //Retornar a imagem recortada
   return cropImg;
 }
 
+// Resampling
+//
+// All modes use integer arithmetic only, so results do not depend on the
+// kernels selected.  Output pixel x covers [x*W/w, (x+1)*W/w) in the
+// source (of width W): its center is at (2x+1)*W/(2w).
+
+// Arguments of the resize on bands of output rows.
+typedef struct {
+  Image dst, src;
+  int mode;
+  size_t* xi;             // per output column: source column (first, for area)
+  uint32_t* xf;           // bilinear: fraction (Q8); area: last source column
+  uint16_t* rows;         // bilinear: 2 interpolated rows per band
+  uint64_t* sums;         // area: 2 rows of sums per band
+} ResizeArgs;
+
+// Source coordinate (Q8) of the center of output pixel x of n, for a
+// source of size m, clamped to [0, m-1]: ((2x+1)*m/(2n) - 1/2) * 256.
+// ((2x+1)*m < 2^63: no overflow.)
+static int64_t resizeCenter(int x, int n, int m) {
+  uint64_t pos = (2 * (uint64_t)x + 1) * (uint64_t)m;
+  uint64_t den = 2 * (uint64_t)n;
+  int64_t c = (int64_t)(pos / den * 256 + pos % den * 256 / den) - 128;
+  if (c < 0) c = 0;
+  if (c > (int64_t)(m - 1) * 256) c = (int64_t)(m - 1) * 256;
+  return c;
+}
+
+// Interpolate source row y horizontally into out (Q8).
+static void bilinearRow(uint16_t* out, const ResizeArgs* a, int y) {
+  const uint8* p = rowPtr(a->src, y);
+  int sw = a->src->width;
+  for (int x = 0; x < a->dst->width; x++) {
+    size_t i = a->xi[x];
+    uint32_t f = a->xf[x];
+    size_t j = i + 1 < (size_t)sw ? i + 1 : i;
+    out[x] = (uint16_t)(p[i] * (256 - f) + p[j] * f);
+  }
+}
+
+// Area: out[x] = sum of the pixels of source row y under output column x,
+// each weighted by the length of its overlap (in units of 1/(w) pixel).
+static void areaRow(uint64_t* out, const ResizeArgs* a, int y) {
+  const uint8* p = rowPtr(a->src, y);
+  uint64_t sw = (uint64_t)a->src->width;
+  uint64_t w = (uint64_t)a->dst->width;
+  for (uint64_t x = 0; x < w; x++) {
+    uint64_t lo = x * sw;          // [lo, hi): output column x, scaled by w
+    uint64_t hi = lo + sw;
+    uint64_t sum = 0;
+    for (size_t i = a->xi[x]; i <= a->xf[x]; i++) {
+      uint64_t s0 = i * w > lo ? i * w : lo;
+      uint64_t s1 = (i + 1) * w < hi ? (i + 1) * w : hi;
+      sum += (s1 - s0) * p[i];
+    }
+    out[x] = sum;
+  }
+}
+
+static void resizeRows(void* arg, int lo, int hi, int task) {
+  ResizeArgs* a = arg;
+  Image dst = a->dst;
+  Image src = a->src;
+  int w = dst->width;
+  int sh = src->height;
+  switch (a->mode) {
+  case IMAGE_RESIZE_NEAREST:
+    for (int y = lo; y < hi; y++) {
+      int sy = (int)((2 * (uint64_t)y + 1) * (uint64_t)sh / (2 * (uint64_t)dst->height));
+      const uint8* p = rowPtr(src, sy);
+      uint8* q = rowPtr(dst, y);
+      for (int x = 0; x < w; x++) q[x] = p[a->xi[x]];
+    }
+    break;
+  case IMAGE_RESIZE_BILINEAR: {
+    // As linhas interpoladas na horizontal são reaproveitadas enquanto
+    // as linhas de origem não mudam (ao ampliar)
+    uint16_t* r0 = a->rows + (size_t)task * 2 * w;
+    uint16_t* r1 = r0 + w;
+    int y0 = -1, y1 = -1;       // source rows in r0, r1
+    for (int y = lo; y < hi; y++) {
+      int64_t c = resizeCenter(y, dst->height, sh);
+      int sy = (int)(c >> 8);
+      uint32_t f = (uint32_t)(c & 255);
+      int sy1 = sy + 1 < sh ? sy + 1 : sy;
+      if (y0 != sy) {
+        if (y1 == sy) {
+          uint16_t* t = r0; r0 = r1; r1 = t;
+          y0 = sy; y1 = -1;
+        } else {
+          bilinearRow(r0, a, sy);
+          y0 = sy;
+        }
+      }
+      if (y1 != sy1) {
+        bilinearRow(r1, a, sy1);
+        y1 = sy1;
+      }
+      Kernels.lerpRow(rowPtr(dst, y), r0, r1, w, f);
+    }
+    break;
+  }
+  default: {  // IMAGE_RESIZE_AREA
+    uint64_t* acc = a->sums + (size_t)task * 2 * w;
+    uint64_t* row = acc + w;
+    uint64_t sh64 = (uint64_t)sh;
+    uint64_t h = (uint64_t)dst->height;
+    uint64_t area = sh64 * (uint64_t)src->width;   // total weight of a pixel
+    // (a soma pesada é no máximo 255*area, e area não excede o número de
+    // bytes da memória: cabe em 64 bits)
+    for (uint64_t y = (uint64_t)lo; y < (uint64_t)hi; y++) {
+      uint64_t ylo = y * sh64;
+      uint64_t yhi = ylo + sh64;
+      memset(acc, 0, (size_t)w * sizeof(uint64_t));
+      for (uint64_t j = ylo / h; j * h < yhi; j++) {
+        uint64_t s0 = j * h > ylo ? j * h : ylo;
+        uint64_t s1 = (j + 1) * h < yhi ? (j + 1) * h : yhi;
+        areaRow(row, a, (int)j);
+        for (int x = 0; x < w; x++) acc[x] += (s1 - s0) * row[x];
+      }
+      uint8* q = rowPtr(dst, (int)y);
+      for (int x = 0; x < w; x++) q[x] = (uint8)((acc[x] + area / 2) / area);
+    }
+    break;
+  }
+  }
+}
+
+/// Resize an image to w x h pixels.
+/// mode selects the resampling method (see image8bit.h).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int mode) { ///
+  assert(img != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(mode == IMAGE_RESIZE_NEAREST || mode == IMAGE_RESIZE_BILINEAR
+         || mode == IMAGE_RESIZE_AREA);
+  int sw = img->width;
+  int sh = img->height;
+  assert((sw > 0 && sh > 0) || w == 0 || h == 0);
+
+  Image res = ImageCreate(w, h, (uint8)img->maxval);
+  if (res == NULL || w == 0 || h == 0) return res;
+
+  // Tabelas por coluna de saída
+  int bands = bandsFor(h, w);
+  ResizeArgs a = { res, img, mode, NULL, NULL, NULL, NULL };
+  a.xi = malloc((size_t)w * sizeof(size_t));
+  a.xf = malloc((size_t)w * sizeof(uint32_t));
+  if (mode == IMAGE_RESIZE_BILINEAR) a.rows = malloc((size_t)bands * 2 * w * sizeof(uint16_t));
+  if (mode == IMAGE_RESIZE_AREA) a.sums = malloc((size_t)bands * 2 * w * sizeof(uint64_t));
+  if (a.xi == NULL || a.xf == NULL
+      || (mode == IMAGE_RESIZE_BILINEAR && a.rows == NULL)
+      || (mode == IMAGE_RESIZE_AREA && a.sums == NULL)) {
+    errCause = "Memory allocation failed";
+    ImageDestroy(&res);
+  } else {
+    for (int x = 0; x < w; x++) {
+      uint64_t x64 = (uint64_t)x;
+      if (mode == IMAGE_RESIZE_NEAREST) {
+        a.xi[x] = (size_t)((2 * x64 + 1) * (uint64_t)sw / (2 * (uint64_t)w));
+      } else if (mode == IMAGE_RESIZE_BILINEAR) {
+        int64_t c = resizeCenter(x, w, sw);
+        a.xi[x] = (size_t)(c >> 8);
+        a.xf[x] = (uint32_t)(c & 255);
+      } else {
+        // Colunas de origem que intersetam [x*sw/w, (x+1)*sw/w)
+        a.xi[x] = (size_t)(x64 * (uint64_t)sw / (uint64_t)w);
+        a.xf[x] = (uint32_t)(((x64 + 1) * (uint64_t)sw - 1) / (uint64_t)w);
+      }
+    }
+    forRows(h, w, resizeRows, &a);
+    PIXMEM += (unsigned long)w * h;   // count stores (reads depend on the mode)
+  }
+  free(a.xi);
+  free(a.xf);
+  free(a.rows);
+  free(a.sums);
+  return res;
+}
+
+static void halveRows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  Image dst = a->dst;
+  Image src = a->src;
+  (void)task;
+  int sw = src->width;
+  int pairs = sw / 2;              // whole 2x2 blocks per row
+  for (int y = lo; y < hi; y++) {
+    const uint8* r0 = rowPtr(src, 2 * y);
+    // Linha ímpar no fim: o bloco só tem uma linha
+    int last = 2 * y + 1 == src->height;
+    const uint8* r1 = last ? r0 : rowPtr(src, 2 * y + 1);
+    uint8* q = rowPtr(dst, y);
+    Kernels.halveRow(q, r0, r1, pairs);
+    if (sw % 2 != 0) {             // coluna ímpar no fim
+      q[pairs] = (uint8)((r0[sw - 1] + r1[sw - 1] + 1) >> 1);
+    }
+  }
+}
+
+// Downsample img by 2 in each direction (2x2 box filter; an odd last row
+// or column is averaged with itself).
+static Image halve(Image img) {
+  int w = (img->width + 1) / 2;
+  int h = (img->height + 1) / 2;
+  Image res = ImageCreate(w, h, (uint8)img->maxval);
+  if (res == NULL) return NULL;
+  CopyArgs a = { res, img, 0, 0, 0.0, NULL };
+  forRows(h, img->width, halveRows, &a);
+  PIXMEM += (unsigned long)img->width * img->height + (unsigned long)w * h;
+  return res;
+}
+
+/// Build an image pyramid: levels[0] is a copy of img, and each following
+/// level is levels[i-1] downsampled by 2.
+/// Returns the number of levels built.
+int ImageBuildPyramid(Image img, Image* levels, int maxLevels) { ///
+  assert(img != NULL);
+  assert(levels != NULL);
+  assert(maxLevels >= 1);
+  levels[0] = ImageCrop(img, 0, 0, img->width, img->height);
+  if (levels[0] == NULL) return 0;
+  int n = 1;
+  while (n < maxLevels && (levels[n-1]->width > 1 || levels[n-1]->height > 1)) {
+    levels[n] = halve(levels[n-1]);
+    if (levels[n] == NULL) {
+      // Desfazer tudo, preservando errno/errCause
+      while (n > 0) ImageDestroy(&levels[--n]);
+      return 0;
+    }
+    n++;
+  }
+  return n;
+}
+
 
 /// Operations on two images
 
+static void pasteRows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  (void)task;
+  for (int j = lo; j < hi; j++) {
+    memcpy(rowPtr(a->dst, a->y + j) + a->x, rowPtr(a->src, j), a->src->width);
+  }
+}
+
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (as in the
+/// pixel transformations, for clones).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) {
   //Verificar se a img1 e a img2 existem
@@ -633,21 +1952,47 @@ void ImagePaste(Image img1, int x, int y, Image img2) {
   //Verificar se a img2 cabe dentro da img1 na posiçao (x,y)
   assert(ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2)));
 
-  //Iterar sobre todas as linhas da img2
-  for (int j = 0; j < ImageHeight(img2); j++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int i = 0; i < ImageWidth(img2); i++) {
-      //Obter o valor de cinzento do pixel na img2 na posição (i, j)
-      uint8 pixelValue = ImageGetPixel(img2, i, j);
-      //Definir o valor de cinzento do pixel na img1 na posição (x + i, y + j) com o valor obtido
-      ImageSetPixel(img1, x + i, y + j, pixelValue);
+  //Copiar cada linha da img2 para a img1, a partir da posição (x, y + j)
+  if (!changed(img1, x, y, img2->width, img2->height)) return;
+  CopyArgs a = { img1, img2, x, y, 0.0, NULL };
+  forRows(img2->height, img2->width, pasteRows, &a);
+  PIXMEM += 2 * (unsigned long)img2->width * img2->height;  // count reads and stores
+}
+
+// Blended level of pixels p1 (weight 1-alpha) and p2 (weight alpha),
+// rounded and saturated to [0, maxval].
+static inline uint8 blendLevel(int p1, int p2, double alpha, int maxval) {
+  //(em double, para saturar antes de converter para uint8)
+  double v = p1 * (1 - alpha) + p2 * alpha + 0.5;
+  if (v < 0.0) return 0;
+  if (v > maxval) return (uint8)maxval;
+  return (uint8)v;
+}
+
+// Minimum number of pixels for ImageBlend to use a 256x256 lookup table
+#define BLEND_LUT_MIN (256 * 256)
+
+static void blendRows(void* arg, int lo, int hi, int task) {
+  CopyArgs* a = arg;
+  (void)task;
+  int w = a->src->width;
+  for (int j = lo; j < hi; j++) {
+    uint8* p1 = rowPtr(a->dst, a->y + j) + a->x;
+    const uint8* p2 = rowPtr(a->src, j);
+    if (a->lut2 != NULL) {
+      Kernels.lookup2(p1, p2, w, a->lut2);
+    } else {
+      for (int i = 0; i < w; i++) {
+        p1[i] = blendLevel(p1[i], p2[i], a->alpha, a->dst->maxval);
+      }
     }
   }
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (as in the
+/// pixel transformations, for clones).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -658,29 +2003,50 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
     //Verificar se a img2 cabe dentro da img1 na posiçao (x,y)
     assert(ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2)));
 
-    //Iterar sobre todas as linhas da img2
-    for (int j = 0; j < ImageHeight(img2); j++) {
-        //Iterar sobre cada pixel dessa linha
-        for (int i = 0; i < ImageWidth(img2); i++) {
-            //Obter o valor de cinzento do pixel na img1 na posição (x + i, y + j)
-            uint8 pixelValue1 = ImageGetPixel(img1, x + i, y + j);
-            //Obter o valor de cinzento do pixel na img2 na posição (i, j)
-            uint8 pixelValue2 = ImageGetPixel(img2, i, j);
-            //Calcular o novo valor de cinzento do pixel na img1 na posição (x + i, y + j)
-            uint8 newPixelValue = (uint8)(pixelValue1 * (1 - alpha) + pixelValue2 * alpha + 0.5);
-            //Verificar se o novo valor de cinzento do pixel na img1 na posição (x + i, y + j) é maior que o maxval da img1
-            if (newPixelValue > ImageMaxval(img1)) {
-                //Se for maior, o novo valor de cinzento do pixel na img1 na posição (x + i, y + j) é o maxval da img1
-                ImageSetPixel(img1, x + i, y + j, ImageMaxval(img1));
-            } else {
-                //Se for menor, o novo valor de cinzento do pixel na img1 na posição (x + i, y + j) é o newPixelValue
-                ImageSetPixel(img1, x + i, y + j, newPixelValue);
+    int w = img2->width;
+    int h = img2->height;
+    size_t n = (size_t)w * h;
+    PIXMEM += 3 * (unsigned long)n;  // count 2 reads and 1 store per pixel
+
+    //Para imagens grandes, o resultado só depende do par de niveis (p1, p2),
+    //por isso calculamos uma tabela com os 256x256 resultados possíveis.
+    //Para imagens pequenas (ou se não houver memória para a tabela, o que
+    //não é erro, só fica mais lento) calculamos cada pixel diretamente
+    uint8* lut2 = NULL;
+    if (n >= BLEND_LUT_MIN && (lut2 = malloc(256 * 256)) != NULL) {
+        for (int p1 = 0; p1 < 256; p1++) {
+            for (int p2 = 0; p2 < 256; p2++) {
+                lut2[p1 << 8 | p2] = blendLevel(p1, p2, alpha, img1->maxval);
             }
         }
     }
+    if (!changed(img1, x, y, w, h)) {
+      free(lut2);
+      return;
+    }
+    CopyArgs a = { img1, img2, x, y, alpha, lut2 };
+    forRows(h, w, blendRows, &a);
+    free(lut2);
 }
 
 
+// Compare img2 to the subimage of img1 at (x, y), which must fit inside img1.
+// Adds to (*cmp) the pixel comparisons made, up to the first difference.
+static int matchAt(Image img1, int x, int y, Image img2, unsigned long* cmp) {
+  int w = img2->width;
+  //Comparar linha a linha, o kernel diz onde está a primeira diferença
+  for (int i = 0; i < img2->height; i++) {
+    size_t k = Kernels.mismatch(rowPtr(img1, y + i) + x, rowPtr(img2, i), w);
+    if (k < (size_t)w) {
+      //Encontrámos uma diferença na comparação k+1 desta linha
+      *cmp += k + 1;
+      return 0;
+    }
+    *cmp += w;
+  }
+  return 1;
+}
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -691,23 +2057,59 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   //Verificar se a img2 cabe dentro da img1 na posiçao (x,y)
   assert (ImageValidPos(img1, x, y));
 
-  //Iterar sobre todas as linhas da img2
-  for (int i = 0; i < ImageHeight(img2); i++) {
-    //Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < ImageWidth(img2); j++) {
-    
-      //Incrementar o contador de comparações
-      COUNT += 1;
-      
-      //Verificar se o pixel na posição (x + j, y + i) da img1 é diferente do pixel na posição (j, i) da img2
-      if (ImageGetPixel(img1, x + j, y + i) != ImageGetPixel(img2, j, i)) {
-        //Se forem diferentes, entao nao encontramos a img2 dentro da img1
-        return 0;
+  unsigned long cmp = 0;
+  int match = matchAt(img1, x, y, img2, &cmp);
+  COUNT += cmp;
+  PIXMEM += 2 * cmp;
+  return match;
+}
+
+// Tiles of candidate positions searched by each task of ImageLocateSubImage
+#define LOCATE_TILE_W 64
+#define LOCATE_TILE_H 16
+
+// Templates of at least LOCATE_SAT_MIN pixels are searched with the
+// integral image of img1: only the positions where the sum of the subimage
+// equals the sum of the template (modulo 2^32) are compared.
+#define LOCATE_SAT_MIN 64
+
+// Could img2 (with sum2, the sum of its pixels modulo 2^32) be at (x, y) in
+// img1, given the integral image sat of img1 (or NULL, if none)?
+static inline int sumsAgree(Image img1, uint32_t* sat, int x, int y, Image img2, uint32_t sum2) {
+  return sat == NULL || satSum(img1, sat, x, y, img2->width, img2->height) == sum2;
+}
+
+// Arguments of the parallel search of ImageLocateSubImage.
+typedef struct {
+  Image img1, img2;
+  long long cols;               // candidate positions per row
+  uint32_t* sat;                // integral image of img1 (or NULL)
+  uint32_t sum;                 // sum of the pixels of img2 (modulo 2^32)
+  _Atomic long long best;       // earliest match found (y*cols + x), or LLONG_MAX
+  _Atomic unsigned long cmp;    // pixel comparisons made
+} LocateArgs;
+
+// Search the candidate positions of a tile, in raster order, until a match
+// or a position after the best match found so far (by any thread).
+static void locateTile(void* arg, const ThreadsTile* t) {
+  LocateArgs* a = arg;
+  unsigned long cmp = 0;
+  for (int i = t->y0; i < t->y1; i++) {
+    long long row = (long long)i * a->cols;
+    if (row + t->x0 > atomic_load_explicit(&a->best, memory_order_relaxed)) break;
+    for (int j = t->x0; j < t->x1; j++) {
+      if (sumsAgree(a->img1, a->sat, j, i, a->img2, a->sum)
+          && matchAt(a->img1, j, i, a->img2, &cmp)) {
+        //Guardar a posição, se for anterior à melhor encontrada até agora
+        long long pos = row + j;
+        long long best = atomic_load(&a->best);
+        while (pos < best && !atomic_compare_exchange_weak(&a->best, &best, pos)) { }
+        i = t->y1;   // as seguintes deste bloco são todas posteriores
+        break;
       }
     }
   }
-  //Se forem iguais, entao encontramos a img2 dentro da img1
-  return 1;
+  atomic_fetch_add(&a->cmp, cmp);
 }
 
 /// Locate a subimage inside another image.
@@ -724,27 +2126,341 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
   int img1Height = ImageHeight(img1);
   int img2Width = ImageWidth(img2);
   int img2Height = ImageHeight(img2);
+  if (img2Width > img1Width || img2Height > img1Height) return 0;
+
+  //Posições possíveis do canto superior esquerdo da img2
+  int cols = img1Width - img2Width + 1;
+  int rows = img1Height - img2Height + 1;
+
+  //Com templates grandes, as posições onde a soma dos pixeis não é a da
+  //img2 são excluídas sem comparar pixeis (com a imagem integral da img1)
+  uint32_t* sat = NULL;
+  uint32_t sum = 0;
+  if ((size_t)img2Width * img2Height >= LOCATE_SAT_MIN && (sat = satOf(img1)) != NULL) {
+    sum = (uint32_t)pixelSum(img2, 0, 0, img2Width, img2Height);
+  }
+
+  //Com muitas posições, procurar em paralelo: o custo de cada posição é
+  //muito variável (a comparação pára na primeira diferença), por isso
+  //dividimos as posições em blocos pequenos, distribuídos com work stealing.
+  //Fica a primeira ocorrência (em raster order), como na procura sequencial
+  if (ThreadsTasks((size_t)cols * rows) > 1) {
+    LocateArgs a = { img1, img2, cols, sat, sum, LLONG_MAX, 0 };
+    ThreadsRunTiles(cols, rows, LOCATE_TILE_W, LOCATE_TILE_H, locateTile, &a);
+    COUNT += a.cmp;
+    PIXMEM += 2 * a.cmp;
+    if (a.best == LLONG_MAX) return 0;
+    *px = (int)(a.best % cols);
+    *py = (int)(a.best / cols);
+    return 1;
+  }
 
-  //Iterar sobre todas as linhas da img1
-  for (int i = 0; i < img1Height - img2Height; i++) {
+  unsigned long cmp = 0;
+  int found = 0;
+  //Iterar sobre todas as linhas da img1 (incluindo a última posição onde a img2 ainda cabe)
+  for (int i = 0; i < rows && !found; i++) {
     //Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < img1Width - img2Width; j++) {
-      //Chamar a função ImageMatchSubImage para verificar se a img2 existe dentro da img1 na posição (j, i)
-      if (ImageMatchSubImage(img1, j, i, img2)) {
-        //Se existir, então definir os valores de px e py com os valores obtidos e retornar 1
+    for (int j = 0; j < cols; j++) {
+      //Verificar se a img2 existe dentro da img1 na posição (j, i)
+      if (sumsAgree(img1, sat, j, i, img2, sum) && matchAt(img1, j, i, img2, &cmp)) {
+        //Se existir, então definir os valores de px e py com os valores obtidos
         *px = j;
         *py = i;
-        return 1;
+        found = 1;
+        break;
+      }
+    }
+  }
+  COUNT += cmp;
+  PIXMEM += 2 * cmp;
+  //Retornar 1 se encontrou, 0 se não
+  return found;
+}
+
+// Coarse-to-fine search (ImageLocateSubImagePyramid).
+// Both images are downsampled until the template side would drop below
+// LOCATE_MIN_SIDE (at most LOCATE_LEVELS_MAX times).  The LOCATE_COARSE
+// best positions of the smallest level are refined with sums of absolute
+// differences, keeping LOCATE_REFINE of them, while the template has at
+// most LOCATE_SAD_MAX pixels; then the full resolution positions they
+// cover are compared exactly (which stops at the first difference, and
+// so costs less than a SAD on large templates).
+#define LOCATE_MIN_SIDE 2
+#define LOCATE_LEVELS_MAX 8
+#define LOCATE_COARSE 128
+#define LOCATE_REFINE 4
+#define LOCATE_SAD_MAX 256
+
+// A candidate position and its sum of absolute differences.
+typedef struct {
+  uint64_t sad;
+  int x, y;
+} LocateCand;
+
+// Sum of absolute differences between img2 and the subimage of img1 at
+// (x, y), which must fit inside img1.  Stops (returning a partial sum) as
+// soon as the sum exceeds limit.  Adds to (*cmp) the pixels compared.
+static uint64_t sadAt(Image img1, int x, int y, Image img2, uint64_t limit,
+                      unsigned long* cmp) {
+  int w = img2->width;
+  uint64_t sum = 0;
+  for (int i = 0; i < img2->height && sum <= limit; i++) {
+    sum += Kernels.sadRow(rowPtr(img1, y + i) + x, rowPtr(img2, i), w);
+    *cmp += w;
+  }
+  return sum;
+}
+
+// Insert (x, y) in the list c of the (at most) k best candidates, sorted
+// by increasing sad (ties in raster order), unless it is already there.
+static void candInsert(LocateCand* c, int* n, int k, uint64_t sad, int x, int y) {
+  if (*n == k && sad >= c[k-1].sad) return;
+  for (int i = 0; i < *n; i++) {
+    if (c[i].x == x && c[i].y == y) return;
+  }
+  int i = *n < k ? (*n)++ : k - 1;
+  for (; i > 0; i--) {
+    LocateCand* p = &c[i-1];
+    if (p->sad < sad || (p->sad == sad && (p->y < y || (p->y == y && p->x < x)))) break;
+    c[i] = *p;
+  }
+  c[i] = (LocateCand){ sad, x, y };
+}
+
+// Search img2 in img1 (one level of the pyramids) around the n candidates
+// of the level above: candidate (x, y) becomes (2x, 2y) or (2x+1, 2y+1)
+// here, but the images were downsampled with differently aligned blocks,
+// so the neighbours are searched too.  Keeps the k best in next.
+// Returns their number.
+static int refineLevel(Image img1, Image img2, const LocateCand* prev, int n,
+                       LocateCand* next, int k, unsigned long* cmp) {
+  int m = 0;
+  for (int c = 0; c < n; c++) {
+    for (int i = 2 * prev[c].y - 1; i <= 2 * prev[c].y + 2; i++) {
+      for (int j = 2 * prev[c].x - 1; j <= 2 * prev[c].x + 2; j++) {
+        if (i < 0 || j < 0 || img2->height > img1->height - i
+            || img2->width > img1->width - j) continue;
+        uint64_t limit = m == k ? next[k-1].sad : UINT64_MAX;
+        candInsert(next, &m, k, sadAt(img1, j, i, img2, limit, cmp), j, i);
       }
     }
   }
-  //Se não existir, então retornar 0
-  return 0;
+  return m;
+}
+
+/// Locate a subimage inside another image, coarse to fine.
+/// Same as ImageLocateSubImage, except that, when img2 occurs at several
+/// positions, any one of them may be returned (not necessarily the first).
+int ImageLocateSubImagePyramid(Image img1, int* px, int* py, Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+
+  // Número de níveis: o modelo fica com pelo menos LOCATE_MIN_SIDE de lado
+  int levels = 0;
+  for (int tw = img2->width, th = img2->height;
+       levels < LOCATE_LEVELS_MAX && (tw + 1) / 2 >= LOCATE_MIN_SIDE
+       && (th + 1) / 2 >= LOCATE_MIN_SIDE; levels++) {
+    tw = (tw + 1) / 2;
+    th = (th + 1) / 2;
+  }
+  if (levels == 0) return ImageLocateSubImage(img1, px, py, img2);
+
+  // Pirâmides das duas imagens (o nível 0 são as próprias imagens).
+  // Sem memória para elas não é erro: fazemos a procura completa
+  Image p1[LOCATE_LEVELS_MAX + 1] = { img1 };
+  Image p2[LOCATE_LEVELS_MAX + 1] = { img2 };
+  int built = 1;
+  while (built <= levels && (p1[built] = halve(p1[built-1])) != NULL
+         && (p2[built] = halve(p2[built-1])) != NULL) {
+    built++;
+  }
+
+  long long best = LLONG_MAX;
+  long long cols = (long long)img1->width - img2->width + 1;
+  if (built > levels) {
+    unsigned long cmp = 0;
+    LocateCand cand[2][LOCATE_COARSE];
+    int n = 0;
+    int cur = 0;
+
+    // No nível mais pequeno, todas as posições: ficam as melhores
+    Image a = p1[levels];
+    Image b = p2[levels];
+    for (int i = 0; i + b->height <= a->height; i++) {
+      for (int j = 0; j + b->width <= a->width; j++) {
+        uint64_t limit = n == LOCATE_COARSE ? cand[0][n-1].sad : UINT64_MAX;
+        candInsert(cand[0], &n, LOCATE_COARSE, sadAt(a, j, i, b, limit, &cmp), j, i);
+      }
+    }
+
+    // Refinar nível a nível, enquanto o modelo for pequeno
+    int l = levels;
+    while (l > 1 && (size_t)p2[l-1]->width * p2[l-1]->height <= LOCATE_SAD_MAX) {
+      l--;
+      n = refineLevel(p1[l], p2[l], cand[cur], n, cand[!cur], LOCATE_REFINE, &cmp);
+      cur = !cur;
+    }
+
+    // Na resolução original, comparação exata de todas as posições que
+    // correspondem a cada candidato (ou aos vizinhos) no nível l:
+    // fica a primeira ocorrência (em raster order) entre elas
+    long long rows = (long long)img1->height - img2->height + 1;
+    for (int c = 0; c < n; c++) {
+      LocateCand* p = &cand[cur][c];
+      long long y0 = ((long long)p->y - 1) << l;
+      long long x0 = ((long long)p->x - 1) << l;
+      long long y1 = ((long long)p->y + 2) << l;
+      long long x1 = ((long long)p->x + 2) << l;
+      if (y0 < 0) y0 = 0;
+      if (x0 < 0) x0 = 0;
+      if (y1 > rows) y1 = rows;
+      if (x1 > cols) x1 = cols;
+      for (long long i = y0; i < y1 && i * cols + x0 < best; i++) {
+        for (long long j = x0; j < x1 && i * cols + j < best; j++) {
+          if (matchAt(img1, (int)j, (int)i, img2, &cmp)) best = i * cols + j;
+        }
+      }
+    }
+    COUNT += cmp;
+    PIXMEM += 2 * cmp;
+  }
+  for (int l = 1; l <= levels; l++) {
+    ImageDestroy(&p1[l]);
+    ImageDestroy(&p2[l]);
+  }
+
+  if (best != LLONG_MAX) {
+    *px = (int)(best % cols);
+    *py = (int)(best / cols);
+    return 1;
+  }
+  // Nenhum candidato serve (imagens sem estrutura, como ruído, podem
+  // enganar os níveis reduzidos), ou não houve memória para as
+  // pirâmides: procura completa, para o resultado ser exato
+  return ImageLocateSubImage(img1, px, py, img2);
 }
 
 
 /// Filtering
 
+// Maximum number of rows in the blur window for the kernels, whose 32-bit
+// column sums would overflow with more (only in images taller than that).
+#define BLUR_ROWS_MAX (UINT32_MAX / 255)
+
+// ImageBlur for windows taller than BLUR_ROWS_MAX rows: the same algorithm
+// (and the same rounding) as with the kernels, but with 64-bit column sums.
+// pixels is a copy of the original image.
+// Returns 0 if out of memory.
+static int blurWide(Image img, const uint8* pixels, int dx, int dy) {
+  int w = img->width;
+  int h = img->height;
+  uint64_t *colsum = calloc(w, sizeof(uint64_t));
+  uint64_t *prefix = malloc(((size_t)w + 1) * sizeof(uint64_t));
+  if (colsum == NULL || prefix == NULL) {
+    free(colsum);
+    free(prefix);
+    return 0;
+  }
+
+  int endY = dy >= h ? h - 1 : dy;
+  for (int k = 0; k <= endY; k++) {
+    const uint8* row = pixels + (size_t)k * img->stride;
+    for (int x = 0; x < w; x++) colsum[x] += row[x];
+  }
+  PIXMEM += (unsigned long)(endY + 1) * w;
+
+  for (int i = 0; i < h; i++) {
+    int startY = i < dy ? 0 : i - dy;
+    endY = dy >= h - i ? h - 1 : i + dy;
+    uint64_t rows = (uint64_t)(endY - startY + 1);
+    prefix[0] = 0;
+    for (int x = 0; x < w; x++) prefix[x+1] = prefix[x] + colsum[x];
+    uint8* dst = rowPtr(img, i);
+    for (int x = 0; x < w; x++) {
+      int lo = x < dx ? 0 : x - dx;
+      int hi = dx >= w - x ? w - 1 : x + dx;
+      uint64_t count = (uint64_t)(hi - lo + 1) * rows;
+      uint64_t sum = prefix[hi+1] - prefix[lo];
+      dst[x] = (uint8)((sum + count * 0.5) / count);
+    }
+    PIXMEM += (unsigned long)w;
+    if (dy < h - 1 - i) {
+      const uint8* row = pixels + (size_t)(i + dy + 1) * img->stride;
+      for (int x = 0; x < w; x++) colsum[x] += row[x];
+      PIXMEM += (unsigned long)w;
+    }
+    if (i >= dy) {
+      const uint8* row = pixels + (size_t)(i - dy) * img->stride;
+      for (int x = 0; x < w; x++) colsum[x] -= row[x];
+      PIXMEM += (unsigned long)w;
+    }
+  }
+  free(colsum);
+  free(prefix);
+  return 1;
+}
+
+// Arguments of the blur on bands of rows.
+typedef struct {
+  Image img;
+  const uint8* pixels;    // copy of the original image
+  int dx, dy;
+  uint32_t* colsum;       // vertical sums, img->width per band
+  uint64_t* prefix;       // kernel scratch, img->width + 1 per band
+  unsigned long* pixmem;  // pixel accesses, per band
+} BlurArgs;
+
+static void blurCopyRows(void* arg, int lo, int hi, int task) {
+  BlurArgs* a = arg;
+  (void)task;
+  memcpy((uint8*)a->pixels + (size_t)lo * a->img->stride, BAND_PIXELS(a->img, lo), BAND_SIZE(a->img, lo, hi));
+}
+
+// Blur rows [lo, hi): the window starts at row lo (its vertical sums are
+// computed from scratch) and slides down from there.
+static void blurRows(void* arg, int lo, int hi, int task) {
+  BlurArgs* a = arg;
+  Image img = a->img;
+  int w = img->width;
+  int h = img->height;
+  int dy = a->dy;
+  size_t stride = img->stride;
+  uint32_t* colsum = a->colsum + (size_t)task * w;
+  uint64_t* prefix = a->prefix + (size_t)task * (w + 1);
+  unsigned long pixmem = 0;
+
+  // Somar as linhas da janela da linha lo
+  // (as comparações são feitas sem calcular i + dy, que pode exceder INT_MAX)
+  memset(colsum, 0, w * sizeof(uint32_t));
+  int startY = lo < dy ? 0 : lo - dy;
+  int endY = dy >= h - lo ? h - 1 : lo + dy;
+  for (int k = startY; k <= endY; k++) {
+    Kernels.addRow(colsum, a->pixels + (size_t)k * stride, w);
+  }
+  pixmem += (unsigned long)(endY - startY + 1) * w;
+
+  for (int i = lo; i < hi; i++) {
+    // Calcular os limites verticais da janela [y-dy, y+dy]
+    startY = i < dy ? 0 : i - dy;
+    endY = dy >= h - i ? h - 1 : i + dy;
+    // Calcular a média de cada pixel desta linha
+    Kernels.boxRow(rowPtr(img, i), colsum, prefix, w, a->dx, endY - startY + 1);
+    pixmem += (unsigned long)w;
+    if (i + 1 == hi) break;
+    // Deslizar a janela para a linha seguinte
+    if (dy < h - 1 - i) {
+      Kernels.addRow(colsum, a->pixels + (size_t)(i + dy + 1) * stride, w);
+      pixmem += (unsigned long)w;
+    }
+    if (i >= dy) {
+      Kernels.subRow(colsum, a->pixels + (size_t)(i - dy) * stride, w);
+      pixmem += (unsigned long)w;
+    }
+  }
+  a->pixmem[task] = pixmem;
+}
+
 /// Blur an image by applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
@@ -752,49 +2468,791 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
 void ImageBlur(Image img, int dx, int dy) {
   // Verificar se a imagem existe
   assert(img != NULL);
+  // Verificar se o tamanho da janela é válido
+  assert(dx >= 0 && dy >= 0);
 
   // Obter a largura e a altura da imagem para não ter que chamar as funções ImageWidth e ImageHeight nos for loops
   int imgWidth = ImageWidth(img);
   int imgHeight = ImageHeight(img);
+  if (imgWidth == 0 || imgHeight == 0) return;
+  if (!changedAll(img)) return;
+
+  // O filtro é separável: a soma do retângulo [x-dx, x+dx]x[y-dy, y+dy] é a soma,
+  // nas colunas [x-dx, x+dx], das somas verticais de cada coluna nas linhas [y-dy, y+dy].
+  // Guardamos as somas verticais (colsum) e, ao passar para a linha seguinte,
+  // somamos a linha que entra na janela e subtraimos a que sai.
+  // Assim o custo por pixel não depende do tamanho da janela.
+  // Em imagens grandes, cada banda de linhas é processada em paralelo,
+  // com as suas próprias somas verticais.
+  size_t n = img->stride * (size_t)imgHeight;
+  size_t size = n;
+  uint8_t *pixels = pixAlloc(&size, 0);                 // cópia da imagem original
+  if (pixels == NULL) {
+    errCause = "Memory allocation failed";
+    return;
+  }
+  BlurArgs a = { img, pixels, dx, dy, NULL, NULL, NULL };
+  forRows(imgHeight, imgWidth, blurCopyRows, &a);
+  PIXMEM += 2 * (unsigned long)imgWidth * imgHeight;  // count copy reads and stores
+
+  // Janelas com mais de BLUR_ROWS_MAX linhas (só em imagens enormes):
+  // as somas verticais não cabem nos 32 bits dos kernels
+  size_t maxRows = 2 * (size_t)dy + 1 < (size_t)imgHeight ? 2 * (size_t)dy + 1 : (size_t)imgHeight;
+  if (maxRows > BLUR_ROWS_MAX) {
+    if (!blurWide(img, pixels, dx, dy)) errCause = "Memory allocation failed";
+    pixFree(pixels, size);
+    return;
+  }
+
+  // Memória auxiliar de cada banda
+  int bands = bandsFor(imgHeight, imgWidth);
+  a.colsum = malloc((size_t)bands * imgWidth * sizeof(uint32_t));          // somas verticais
+  a.prefix = malloc((size_t)bands * (imgWidth + 1) * sizeof(uint64_t));   // auxiliar do kernel
+  a.pixmem = calloc(bands, sizeof(unsigned long));
+  if (a.colsum == NULL || a.prefix == NULL || a.pixmem == NULL) {
+    errCause = "Memory allocation failed";
+  } else {
+    forBands(imgHeight, bands, blurRows, &a);
+    for (int t = 0; t < bands; t++) PIXMEM += a.pixmem[t];
+  }
+
+  // Libertar a memória alocada
+  pixFree(pixels, size);
+  free(a.colsum);
+  free(a.prefix);
+  free(a.pixmem);
+}
+
+// Rectangle r grown by dx columns and dy rows on each side, clipped to img.
+static ImageRect rectGrow(Image img, ImageRect r, int dx, int dy) {
+  long long x0 = (long long)r.x - dx, x1 = (long long)r.x + r.w + dx;
+  long long y0 = (long long)r.y - dy, y1 = (long long)r.y + r.h + dy;
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > img->width) x1 = img->width;
+  if (y1 > img->height) y1 = img->height;
+  ImageRect g = { (int)x0, (int)y0, (int)(x1 - x0), (int)(y1 - y0) };
+  return g;
+}
 
-  // Criar um array 2D para guardar os pixeis da imagem original
-  uint8_t *pixels = (uint8_t *)calloc(imgHeight * imgWidth, sizeof(uint8_t));
-  for (int i = 0; i < imgHeight; i++) {
-    for (int j = 0; j < imgWidth; j++) {
-      pixels[G(img, i, j)] = ImageGetPixel(img, j, i);
-    }
-  }
-
-  // Iterar sobre todas as linhas da imagem
-  for (int i = 0; i < imgHeight; i++) {
-    // Iterar sobre cada pixel dessa linha
-    for (int j = 0; j < imgWidth; j++) {
-      // Variável para guardar a soma dos pixeis
-      int sum = 0;
-      // Variável para guardar o número de pixeis
-      int count = 0;
-
-      // Calcular os limites do retângulo [y-dy, y+dy] e [x-dx, x+dx]
-      int startY = i - dy < 0 ? 0 : i - dy;
-      int endY = i + dy >= imgHeight ? imgHeight - 1 : i + dy;
-      int startX = j - dx < 0 ? 0 : j - dx;
-      int endX = j + dx >= imgWidth ? imgWidth - 1 : j + dx;
-
-      // Iterar sobre os pixeis dentro do retângulo [y-dy, y+dy] e [x-dx, x+dx]
-      for (int k = startY; k <= endY; k++) {
-        for (int l = startX; l <= endX; l++) {
-          // Somar o valor do pixel na posição (l, k) à variável sum e incrementar a variável count
-          sum += pixels[G(img, k, l)];
-          count++;
+/// Incremental blur.
+/// Updates blurred (ImageBlur of img when img was last clean) to the blur
+/// of img as it is now, recomputing only the pixels near the dirty
+/// rectangles of img.
+void ImageBlurUpdate(Image img, Image blurred, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(blurred != NULL);
+  assert(blurred->width == img->width && blurred->height == img->height);
+  assert(dx >= 0 && dy >= 0);
+  int w = img->width;
+  int h = img->height;
+
+  // As médias alteradas são as que estão até (dx, dy) de um retângulo
+  // alterado (out), e dependem dos pixeis até (dx, dy) delas (in):
+  // desfocamos uma cópia de cada região in e copiamos dela a região out.
+  // Se as regiões in somarem a imagem inteira, é mais simples desfocar tudo
+  ImageRect out[IMAGE_DIRTY_MAX], in[IMAGE_DIRTY_MAX];
+  uint64_t area = 0;
+  for (int k = 0; k < img->ndirty; k++) {
+    out[k] = rectGrow(img, img->dirty[k], dx, dy);
+    in[k] = rectGrow(img, out[k], dx, dy);
+    area += (uint64_t)in[k].w * in[k].h;
+  }
+  if (area >= (uint64_t)w * h) {
+    ImagePaste(blurred, 0, 0, img);
+    ImageBlur(blurred, dx, dy);
+    return;
+  }
+  for (int k = 0; k < img->ndirty; k++) {
+    Image tmp = ImageCrop(img, in[k].x, in[k].y, in[k].w, in[k].h);
+    if (tmp == NULL) return;   // (errCause já indica a falha)
+    ImageBlur(tmp, dx, dy);
+    ImageRect r = out[k];
+    if (!changed(blurred, r.x, r.y, r.w, r.h)) {
+      ImageDestroy(&tmp);
+      return;
+    }
+    for (int i = 0; i < r.h; i++) {
+      memcpy(rowPtr(blurred, r.y + i) + r.x, rowPtr(tmp, r.y - in[k].y + i) + (r.x - in[k].x), r.w);
+    }
+    PIXMEM += 2 * (unsigned long)r.w * r.h;  // count reads and stores
+    ImageDestroy(&tmp);
+  }
+}
+
+// Separable convolution
+//
+// Taps are fixed point, multiples of 1/CONV_ONE.  The horizontal pass sums
+// q*pixel in 32 bits (at most 255*CONV_SUM_MAX < 2^31; the documented limit
+// on the taps, CONV_TAPS_MAX, leaves room for rounding); the vertical pass
+// sums q*(horizontal sum) in 64 bits, and its result has 2*CONV_BITS
+// fraction bits, rounded away by the packRow kernel.
+// The convolution runs on strips of whole columns, from top to bottom, so
+// that the horizontal sums of the rows in the window (a ring of nky rows)
+// are kept for the columns of a strip only, whatever the width of the image.
+
+#define CONV_BITS 12
+#define CONV_ONE (1 << CONV_BITS)
+#define CONV_TAPS_MAX 1024.0             // maximum sum of |taps| of a kernel
+#define CONV_SUM_MAX (INT32_MAX / 255)   // maximum sum of |quantized taps|
+
+// Minimum width of the strips.
+#define CONV_STRIP_MIN 64
+
+// Quantize the n taps of k into q, and return their sum.
+// The center tap absorbs the rounding errors, so that the sum of q is the
+// rounded sum of k (a normalized kernel stays normalized).
+static int32_t convQuantize(int32_t* q, const double* k, int n) {
+  double sum = 0.0;
+  double abs = 0.0;
+  for (int i = 0; i < n; i++) abs += fabs(k[i]);
+  assert(abs <= CONV_TAPS_MAX);
+  int64_t qsum = 0;
+  for (int i = 0; i < n; i++) {
+    q[i] = (int32_t)lround(k[i] * CONV_ONE);
+    sum += k[i];
+    qsum += q[i];
+  }
+  int64_t total = llround(sum * CONV_ONE);
+  q[n / 2] += (int32_t)(total - qsum);
+  int64_t abssum = 0;
+  for (int i = 0; i < n; i++) abssum += q[i] < 0 ? -(int64_t)q[i] : q[i];
+  assert(abssum <= CONV_SUM_MAX);
+  return (int32_t)total;
+}
+
+// round(v*num/den), halves away from zero, saturated to +-2^62
+// (the product may not fit in 64 bits).
+static int64_t scaleRound(int64_t v, int64_t num, int64_t den) {
+  __int128 p = (__int128)v * num;
+  if (den < 0) {
+    p = -p;
+    den = -den;
+  }
+  __int128 r = p >= 0 ? (p + den / 2) / den : -((-p + den / 2) / den);
+  const int64_t lim = INT64_C(1) << 62;
+  return r > lim ? lim : r < -lim ? -lim : (int64_t)r;
+}
+
+// Arguments of the convolution on bands of columns.
+typedef struct {
+  Image img;
+  const uint8* pixels;    // the original image (a copy, if several strips)
+  const int32_t* qx;      // quantized horizontal taps
+  const int32_t* qy;      // quantized vertical taps
+  int nkx, nky;
+  int32_t sx, sy;         // sums of the taps
+  int slots;              // rows in each ring
+  int strip;              // width of the strips
+  int32_t* ring;          // horizontal sums of the last rows, slots*strip per task
+  int64_t* acc;           // vertical sums, strip per task
+  unsigned long* pixmem;  // pixel accesses, per task
+} ConvArgs;
+
+// Horizontal pass of columns [x0, x1) of row src (width pixels) into
+// dst[0..x1-x0).
+static void convHorizontal(int32_t* dst, const uint8* src, int w, int x0, int x1,
+                           const ConvArgs* a) {
+  const int32_t* q = a->qx;
+  int n = a->nkx;
+  int c = n / 2;
+  // Interior [first, last): every tap falls inside the row
+  long long first = c > x0 ? c : x0;
+  long long last = (long long)w - (n - 1 - c);
+  if (last > x1) last = x1;
+  if (first < last) {
+    Kernels.convRow(dst + (first - x0), src + (first - c), (size_t)(last - first), q, n);
+  } else {
+    first = last = x1;
+  }
+  // Borders: only the taps inside, rescaled to the sum of all taps
+  for (long long x = x0; x < x1; x++) {
+    if (x == first) x = last;
+    if (x >= x1) break;
+    long long j0 = x < c ? c - x : 0;
+    long long j1 = (long long)w - x + c < n ? (long long)w - x + c : n;
+    int64_t sum = 0;
+    int64_t in = 0;
+    for (long long j = j0; j < j1; j++) {
+      sum += (int64_t)q[j] * src[x - c + j];
+      in += q[j];
+    }
+    if (in != a->sx && in != 0 && a->sx != 0) sum = scaleRound(sum, a->sx, in);
+    dst[x - x0] = sum > INT32_MAX ? INT32_MAX : sum < -INT32_MAX ? -INT32_MAX : (int32_t)sum;
+  }
+}
+
+// Convolve columns [lo, hi), in strips of a->strip columns, each from top
+// to bottom: each row is the sum of the horizontal sums of the rows in its
+// window, which are kept in a ring (each computed once).
+static void convStrips(void* arg, int lo, int hi, int task) {
+  ConvArgs* a = arg;
+  Image img = a->img;
+  int w = img->width;
+  int h = img->height;
+  int n = a->nky;
+  int c = n / 2;
+  int below = n - 1 - c;                      // taps below the center
+  int32_t* ring = a->ring + (size_t)task * a->slots * a->strip;
+  int64_t* acc = a->acc + (size_t)task * a->strip;
+  unsigned long pixmem = 0;
+
+  for (int x0 = lo; x0 < hi; x0 += a->strip) {
+    int x1 = hi - x0 < a->strip ? hi : x0 + a->strip;
+    size_t sw = (size_t)(x1 - x0);
+    // (as comparações são feitas sem calcular i + below, que pode exceder INT_MAX)
+    int next = 0;                             // próxima linha a filtrar na horizontal
+    for (int i = 0; i < h; i++) {
+      // Janela vertical [y0, y1], cortada pelos limites da imagem
+      int y0 = i < c ? 0 : i - c;
+      int y1 = below >= h - i ? h - 1 : i + below;
+      for (; next <= y1; next++) {
+        convHorizontal(ring + (size_t)(next % a->slots) * sw,
+                       a->pixels + (size_t)next * img->stride, w, x0, x1, a);
+        pixmem += (unsigned long)sw * (unsigned long)(a->nkx < w ? a->nkx : w);
+      }
+      // Somar as linhas da janela, pesadas pelos coeficientes verticais
+      memset(acc, 0, sw * sizeof(int64_t));
+      int64_t in = 0;
+      for (int y = y0; y <= y1; y++) {
+        int32_t q = a->qy[y - i + c];
+        in += q;
+        if (q != 0) Kernels.macRow(acc, ring + (size_t)(y % a->slots) * sw, sw, q);
+      }
+      if (in != a->sy && in != 0 && a->sy != 0) {
+        for (size_t x = 0; x < sw; x++) acc[x] = scaleRound(acc[x], a->sy, in);
+      }
+      Kernels.packRow(rowPtr(img, i) + x0, acc, sw, (uint8)img->maxval);
+      pixmem += (unsigned long)sw;
+    }
+  }
+  a->pixmem[task] = pixmem;
+}
+
+/// Convolve an image with a separable kernel: kx (nkx taps) along rows,
+/// then ky (nky taps) along columns.
+/// Border pixels use only the taps inside the image, rescaled.
+/// The image is changed in-place.
+void ImageConvolveSeparable(Image img, const double* kx, int nkx,
+                            const double* ky, int nky) { ///
+  assert(img != NULL);
+  assert(kx != NULL && nkx >= 1);
+  assert(ky != NULL && nky >= 1);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return;
+  if (!changedAll(img)) return;
+
+  // Cada linha é filtrada na horizontal uma só vez; as somas horizontais
+  // das últimas nky linhas ficam num anel, e cada linha do resultado é a
+  // soma pesada das linhas da sua janela.
+  // Com uma só faixa (da largura da imagem), a imagem pode ser alterada no
+  // lugar: a linha i só é escrita depois de filtradas na horizontal todas
+  // as linhas até i+nky/2.  Com várias faixas, cada uma lê colunas das
+  // vizinhas: filtra-se uma cópia.
+  ConvArgs a = { img, img->pixel, NULL, NULL, nkx, nky, 0, 0, 0, 0, NULL, NULL, NULL };
+  int32_t* qx = malloc((size_t)nkx * sizeof(int32_t));
+  int32_t* qy = malloc((size_t)nky * sizeof(int32_t));
+  int strips = bandsFor(w, h);
+  a.slots = nky < h ? nky : h;
+  // Strips narrow enough that the rings of all the tasks stay within about
+  // the size of the image (however many threads, however tall the kernel)
+  size_t strip = (size_t)w * h / ((size_t)strips * a.slots * sizeof(int32_t));
+  if (strip < CONV_STRIP_MIN) strip = CONV_STRIP_MIN;
+  if (strip > (size_t)w) strip = w;
+  a.strip = (int)strip;
+  int copy = strips > 1 || strip < (size_t)w;
+  a.ring = malloc((size_t)strips * a.slots * strip * sizeof(int32_t));
+  a.acc = malloc((size_t)strips * strip * sizeof(int64_t));
+  a.pixmem = calloc(strips, sizeof(unsigned long));
+  uint8* pixels = NULL;
+  size_t size = img->stride * (size_t)h;
+  if (copy) pixels = pixAlloc(&size, 0);
+  if (qx == NULL || qy == NULL || a.ring == NULL || a.acc == NULL
+      || a.pixmem == NULL || (copy && pixels == NULL)) {
+    errCause = "Memory allocation failed";
+  } else {
+    a.sx = convQuantize(qx, kx, nkx);
+    a.sy = convQuantize(qy, ky, nky);
+    a.qx = qx;
+    a.qy = qy;
+    if (pixels != NULL) {
+      // (a mesma cópia que em ImageBlur)
+      BlurArgs b = { img, pixels, 0, 0, NULL, NULL, NULL };
+      forRows(h, w, blurCopyRows, &b);
+      PIXMEM += 2 * (unsigned long)w * h;
+      a.pixels = pixels;
+    }
+    forBands(w, strips, convStrips, &a);
+    for (int t = 0; t < strips; t++) PIXMEM += a.pixmem[t];
+  }
+
+  if (pixels != NULL) pixFree(pixels, size);
+  free(qx);
+  free(qy);
+  free(a.ring);
+  free(a.acc);
+  free(a.pixmem);
+}
+
+/// Blur an image with a Gaussian filter of standard deviation sigma,
+/// truncated at 3*sigma.
+/// The image is changed in-place.
+void ImageGaussianBlur(Image img, double sigma) { ///
+  assert(img != NULL);
+  assert(sigma >= 0.0);
+  // Raio 3*sigma, mas não mais do que a imagem (os coeficientes mais
+  // afastados nunca cairiam dentro dela)
+  int maxr = img->width > img->height ? img->width : img->height;
+  if (maxr > (INT_MAX - 1) / 2) maxr = (INT_MAX - 1) / 2;
+  double r = ceil(3.0 * sigma);
+  int radius = r < maxr ? (int)r : maxr;
+  int n = 2 * radius + 1;
+  double* k = malloc((size_t)n * sizeof(double));
+  if (k == NULL) {
+    errCause = "Memory allocation failed";
+    return;
+  }
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) {
+    double d = i - radius;
+    k[i] = radius == 0 ? 1.0 : exp(-d * d / (2.0 * sigma * sigma));
+    sum += k[i];
+  }
+  for (int i = 0; i < n; i++) k[i] /= sum;
+  ImageConvolveSeparable(img, k, n, k, n);
+  free(k);
+}
+
+// Median filter (Perreault & Hébert, "Median Filtering in Constant Time")
+//
+// Each column keeps the histogram of its pixels in the rows of the window,
+// updated as the window slides down (one pixel in, one out).  Along a row,
+// the histogram of the window is the sum of the column histograms in it,
+// updated as the window slides right (one column in, one out).
+// Histograms have two levels: 16 coarse bins (for levels 16k..16k+15) and
+// 256 fine bins.  The coarse bins of the window are updated at every pixel;
+// the median falls in one coarse bin, and only the 16 fine bins of that one
+// are brought up to date, when needed.  Neighbouring medians usually fall
+// in the same coarse bin, so the cost per pixel does not depend on the
+// size of the window.
+// The filter runs on strips of whole columns, from top to bottom: a strip
+// keeps the histograms of its columns and of dx columns on each side, so
+// that its scratch does not grow with the width of the image.
+
+#define MED_FINE 256
+#define MED_COARSE 16
+
+// Minimum width of the strips.
+#define MED_STRIP_MIN 64
+
+// The fine column histograms are stored by segment: the 16 fine bins of
+// segment k of every column, then those of segment k+1, ... so that
+// sliding a segment along a row reads consecutive memory.
+#define MED_SEG(fine, w, k, x) ((fine) + ((size_t)(k) * (size_t)(w) + (size_t)(x)) * 16)
+
+// Arguments of the median on bands of columns.
+typedef struct {
+  Image img;
+  const uint8* pixels;    // copy of the original image
+  int dx, dy;
+  int strip;              // width of the strips
+  size_t span;            // columns of the histograms of a strip, at most
+  uint32_t* fine;         // fine column histograms, span*MED_FINE per task
+  uint32_t* coarse;       // coarse column histograms, span*MED_COARSE per task
+  unsigned long* pixmem;  // pixel accesses, per task
+} MedianArgs;
+
+// Add (sign 1) or subtract (sign -1) a row of pixels to the column histograms.
+static void medianColumns(uint32_t* fine, uint32_t* coarse, const uint8* row, int w, int sign) {
+  for (int x = 0; x < w; x++) {
+    MED_SEG(fine, w, row[x] >> 4, x)[row[x] & 15] += sign;
+    coarse[(size_t)x * MED_COARSE + (row[x] >> 4)] += sign;
+  }
+}
+
+// seg[0..15] += (or -=) the 16 fine bins of a column, at c.
+static inline void medianSegmentAdd(uint64_t* restrict seg, const uint32_t* restrict c) {
+  for (int v = 0; v < 16; v++) seg[v] += c[v];
+}
+
+static inline void medianSegmentSub(uint64_t* restrict seg, const uint32_t* restrict c) {
+  for (int v = 0; v < 16; v++) seg[v] -= c[v];
+}
+
+// Median of the windows of row dst, in columns [from, to), from the
+// column histograms cf (fine) and cc (coarse) of w columns, each of rows
+// pixels (windows are clipped to those w columns).  The median is the
+// lower one: the level of rank (count+1)/2 in the window, counting from 1.
+static void medianRow(uint8* dst, const uint32_t* cf, const uint32_t* cc,
+                      int w, int from, int to, int dx, uint64_t rows) {
+  uint64_t fine[MED_FINE];
+  uint64_t coarse[MED_COARSE];
+  int valid[MED_COARSE];   // window position for which each fine segment is up to date
+  memset(fine, 0, sizeof(fine));
+  memset(coarse, 0, sizeof(coarse));
+
+  // Janela do pixel from: colunas [max(0, from-dx), min(from+dx, w-1)]
+  int first = from < dx ? 0 : from - dx;
+  int last = dx >= w - 1 - from ? w - 1 : from + dx;
+  for (int c = first; c <= last; c++) {
+    for (int k = 0; k < MED_COARSE; k++) medianSegmentAdd(fine + 16 * k, MED_SEG(cf, w, k, c));
+    for (int k = 0; k < MED_COARSE; k++) coarse[k] += cc[(size_t)c * MED_COARSE + k];
+  }
+  for (int k = 0; k < MED_COARSE; k++) valid[k] = from;
+
+  for (int x = from; x < to; x++) {
+    // (as comparações são feitas sem calcular x + dx, que pode exceder INT_MAX)
+    if (x > from) {
+      // Deslizar a janela: entra a coluna x+dx, sai a coluna x-dx-1
+      if (dx <= w - 1 - x) {
+        const uint32_t* col = cc + (size_t)(x + dx) * MED_COARSE;
+        for (int k = 0; k < MED_COARSE; k++) coarse[k] += col[k];
+      }
+      if (x > dx) {
+        const uint32_t* col = cc + (size_t)(x - dx - 1) * MED_COARSE;
+        for (int k = 0; k < MED_COARSE; k++) coarse[k] -= col[k];
+      }
+    }
+    int lo = x < dx ? 0 : x - dx;
+    int hi = dx >= w - 1 - x ? w - 1 : x + dx;
+    uint64_t target = ((uint64_t)(hi - lo + 1) * rows + 1) / 2;
+
+    // Procurar o segmento (grosso) da mediana
+    uint64_t cum = 0;
+    int k = 0;
+    while (cum + coarse[k] < target) cum += coarse[k++];
+
+    // Atualizar os 16 valores finos desse segmento, se desatualizados:
+    // deslizando desde a posição em que foram atualizados,
+    // ou somando de novo as colunas da janela, se for mais rápido
+    uint64_t* seg = fine + 16 * k;
+    int behind = x - valid[k];
+    if (behind > 0) {
+      if (behind > (hi - lo + 1) / 2) {
+        memset(seg, 0, 16 * sizeof(uint64_t));
+        for (int c = lo; c <= hi; c++)
+          medianSegmentAdd(seg, MED_SEG(cf, w, k, c));
+      } else {
+        for (int p = valid[k] + 1; p <= x; p++) {
+          if (dx <= w - 1 - p) medianSegmentAdd(seg, MED_SEG(cf, w, k, p + dx));
+          if (p > dx) medianSegmentSub(seg, MED_SEG(cf, w, k, p - dx - 1));
+        }
+      }
+      valid[k] = x;
+    }
+
+    // Procurar a mediana dentro do segmento
+    int v = 0;
+    while (cum + seg[v] < target) cum += seg[v++];
+    dst[x] = (uint8)(16 * k + v);
+  }
+}
+
+// Median of columns [lo, hi), in strips of a->strip columns, each from
+// top to bottom.  The histograms of a strip cover its columns and dx more
+// on each side (clipped to the image), where its windows are.
+static void medianStrips(void* arg, int lo, int hi, int task) {
+  MedianArgs* a = arg;
+  Image img = a->img;
+  int w = img->width;
+  int h = img->height;
+  int dx = a->dx;
+  int dy = a->dy;
+  size_t stride = img->stride;
+  uint32_t* fine = a->fine + (size_t)task * a->span * MED_FINE;
+  uint32_t* coarse = a->coarse + (size_t)task * a->span * MED_COARSE;
+  unsigned long pixmem = 0;
+
+  for (int x0 = lo; x0 < hi; x0 += a->strip) {
+    int x1 = hi - x0 < a->strip ? hi : x0 + a->strip;
+    // Colunas dos histogramas: [c0, c1)
+    // (as comparações são feitas sem calcular x + dx, que pode exceder INT_MAX)
+    int c0 = x0 < dx ? 0 : x0 - dx;
+    int c1 = dx >= w - x1 ? w : x1 + dx;
+    int n = c1 - c0;
+    const uint8* pixels = a->pixels + c0;
+
+    // Histogramas das colunas da janela da linha 0
+    memset(fine, 0, (size_t)n * MED_FINE * sizeof(uint32_t));
+    memset(coarse, 0, (size_t)n * MED_COARSE * sizeof(uint32_t));
+    int endY = dy >= h ? h - 1 : dy;
+    for (int k = 0; k <= endY; k++) {
+      medianColumns(fine, coarse, pixels + (size_t)k * stride, n, 1);
+    }
+    pixmem += (unsigned long)(endY + 1) * n;
+
+    for (int i = 0; i < h; i++) {
+      int startY = i < dy ? 0 : i - dy;
+      endY = dy >= h - i ? h - 1 : i + dy;
+      medianRow(rowPtr(img, i) + c0, fine, coarse, n, x0 - c0, x1 - c0, dx,
+                (uint64_t)(endY - startY + 1));
+      pixmem += (unsigned long)(x1 - x0);
+      if (i + 1 == h) break;
+      // Deslizar a janela para a linha seguinte
+      if (dy < h - 1 - i) {
+        medianColumns(fine, coarse, pixels + (size_t)(i + dy + 1) * stride, n, 1);
+        pixmem += (unsigned long)n;
+      }
+      if (i >= dy) {
+        medianColumns(fine, coarse, pixels + (size_t)(i - dy) * stride, n, -1);
+        pixmem += (unsigned long)n;
+      }
+    }
+  }
+  a->pixmem[task] = pixmem;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+void ImageMedian(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return;
+  if (!changedAll(img)) return;
+
+  size_t size = img->stride * (size_t)h;
+  uint8* pixels = pixAlloc(&size, 0);                   // cópia da imagem original
+  if (pixels == NULL) {
+    errCause = "Memory allocation failed";
+    return;
+  }
+  BlurArgs b = { img, pixels, dx, dy, NULL, NULL, NULL };
+  forRows(h, w, blurCopyRows, &b);
+  PIXMEM += 2 * (unsigned long)w * h;  // count copy reads and stores
+
+  // Strips narrow enough that the histograms of all the tasks stay within
+  // about the size of the image (however many threads)
+  int strips = bandsFor(w, h);
+  size_t colBytes = (MED_FINE + MED_COARSE) * sizeof(uint32_t);
+  size_t strip = (size_t)w * h / ((size_t)strips * colBytes);
+  if (strip < MED_STRIP_MIN) strip = MED_STRIP_MIN;
+  if (strip > (size_t)w) strip = w;
+  size_t span = strip + 2 * (size_t)dx;
+  if (span > (size_t)w) span = w;
+  MedianArgs a = { img, pixels, dx, dy, (int)strip, span, NULL, NULL, NULL };
+  a.fine = malloc((size_t)strips * span * MED_FINE * sizeof(uint32_t));
+  a.coarse = malloc((size_t)strips * span * MED_COARSE * sizeof(uint32_t));
+  a.pixmem = calloc(strips, sizeof(unsigned long));
+  if (a.fine == NULL || a.coarse == NULL || a.pixmem == NULL) {
+    errCause = "Memory allocation failed";
+  } else {
+    forBands(w, strips, medianStrips, &a);
+    for (int t = 0; t < strips; t++) PIXMEM += a.pixmem[t];
+  }
+
+  pixFree(pixels, size);
+  free(a.fine);
+  free(a.coarse);
+  free(a.pixmem);
+}
+
+/// Morphology
+
+// Erosion (dilation) is the minimum (maximum) over the window, which is
+// separable: rows first, then columns.  Each pass uses the van Herk /
+// Gil-Werman algorithm, with about 3 comparisons per pixel for any size:
+// the line, padded with d identity elements (255 for min, 0 for max) at
+// each end, is split in blocks of k = 2d+1; g(t) is the minimum from the
+// start of the block of t up to t, and h(t) from t to the end of its block.
+// The window [t, t+2d] spans at most two blocks, so its minimum is
+// min(h(t), g(t+2d)).
+// The column pass runs on strips of whole columns, a row segment at a time
+// (min/max of two segments is a SIMD kernel), so it needs no transposition,
+// and its scratch is 2*(2d+1) segments, whatever the height of the image.
+
+// Minimum width of the strips of the column pass.
+#define MORPH_STRIP_MIN 32
+
+// Arguments of the morphological passes on bands of rows or of columns.
+typedef struct {
+  Image img;
+  uint8* tmp;             // result of the row pass (img->stride per row)
+  int dx, dy;             // radii, clipped to the image
+  int max;                // dilation (1) or erosion (0)
+  int strip;              // width of the strips of the column pass
+  uint8* scratch;         // per task: 3*(width+2*dx) bytes (rows)
+                          // or 2*(2*dy+1)*strip bytes (columns)
+  size_t scratchSize;     // bytes of scratch per task
+} MorphArgs;
+
+static inline uint8 morphOp(uint8 a, uint8 b, int max) {
+  return max ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+// Row pass over rows [lo, hi): img -> tmp.
+static void morphRows(void* arg, int lo, int hi, int task) {
+  MorphArgs* a = arg;
+  Image img = a->img;
+  int w = img->width;
+  int max = a->max;
+  uint8 id = max ? 0 : PixMax;
+  size_t d = (size_t)a->dx;
+  size_t k = 2 * d + 1;
+  size_t len = (size_t)w + 2 * d;           // padded row
+  uint8* v = a->scratch + (size_t)task * a->scratchSize;   // padded row
+  uint8* g = v + len;
+  uint8* h = g + len;
+  memset(v, id, d);
+  memset(v + d + w, id, d);
+  for (int y = lo; y < hi; y++) {
+    const uint8* p = rowPtr(img, y);
+    uint8* out = a->tmp + (size_t)y * img->stride;
+    if (d == 0) {
+      memcpy(out, p, w);
+      continue;
+    }
+    // Linha com d elementos neutros de cada lado: v[t] = p[t-d]
+    // g: mínimo desde o início do bloco; h: mínimo até ao fim do bloco
+    memcpy(v + d, p, w);
+    for (size_t b = 0; b < len; b += k) {
+      size_t e = b + k < len ? b + k : len;
+      uint8 m = id;
+      for (size_t t = b; t < e; t++) g[t] = m = morphOp(m, v[t], max);
+      m = id;
+      for (size_t t = e; t-- > b; ) h[t] = m = morphOp(m, v[t], max);
+    }
+    // Janela [x, x+2d] (em coordenadas com margem)
+    if (max) Kernels.maxRow(out, h, g + 2 * d, w);
+    else Kernels.minRow(out, h, g + 2 * d, w);
+  }
+}
+
+// Column pass over columns [lo, hi): tmp -> img, in strips of a->strip
+// columns, each from top to bottom.
+// t is a row index in the padded column (row t-d).
+static void morphColumns(void* arg, int lo, int hi, int task) {
+  MorphArgs* a = arg;
+  Image img = a->img;
+  int max = a->max;
+  long long d = a->dy;
+  long long k = 2 * d + 1;
+  long long h = img->height;
+  void (*op)(uint8_t*, const uint8_t*, const uint8_t*, size_t) = max ? Kernels.maxRow : Kernels.minRow;
+  uint8 id = max ? 0 : PixMax;
+
+  for (int x = lo; x < hi; x += a->strip) {
+    size_t w = (size_t)(hi - x < a->strip ? hi - x : a->strip);
+    uint8* H = a->scratch + (size_t)task * a->scratchSize;   // h() of one block
+    uint8* G = H + (size_t)k * w;                             // g() of the next block
+    const uint8* tmp = a->tmp + x;
+    for (long long r = 0; r < h; ) {
+      // Linhas de saída r..stop-1 usam h() do bloco [r, end) e g() do seguinte
+      long long end = r + k;
+      long long stop = end < h ? end : h;
+      // h(t), para t de end-1 até r
+      for (long long t = end - 1; t >= r; t--) {
+        uint8* dst = H + (size_t)(t - r) * w;
+        const uint8* src = t >= d && t - d < h ? tmp + (size_t)(t - d) * img->stride : NULL;
+        if (t == end - 1) {
+          if (src != NULL) memcpy(dst, src, w);
+          else memset(dst, id, w);
+        } else if (src != NULL) {
+          op(dst, dst + w, src, w);
+        } else {
+          memcpy(dst, dst + w, w);
+        }
+      }
+      // g(t), para t de end até stop-1+2d
+      for (long long t = end; t <= stop - 1 + 2 * d; t++) {
+        uint8* dst = G + (size_t)(t - end) * w;
+        const uint8* src = t >= d && t - d < h ? tmp + (size_t)(t - d) * img->stride : NULL;
+        if (t == end) {
+          if (src != NULL) memcpy(dst, src, w);
+          else memset(dst, id, w);
+        } else if (src != NULL) {
+          op(dst, dst - w, src, w);
+        } else {
+          memcpy(dst, dst - w, w);
         }
       }
-      // Calcular a média do valor dos pixeis dentro do retângulo
-      uint8_t pixelValue = (uint8_t)((sum + count * 0.5) / count);
-      // Definir o valor do pixel na imagem blurImg na posição (j, i) com o valor obtido
-      ImageSetPixel(img, j, i, pixelValue);
+      // Janela [y, y+2d]: se começa no início do bloco, é o bloco todo
+      for (long long y = r; y < stop; y++) {
+        const uint8* hy = H + (size_t)(y - r) * w;
+        if (y == r) memcpy(rowPtr(img, (int)y) + x, hy, w);
+        else op(rowPtr(img, (int)y) + x, hy, G + (size_t)(y + 2 * d - end) * w, w);
+      }
+      r = stop;
     }
   }
+}
+
+// Erosion (max == 0) or dilation (max == 1) with a (2dx+1)x(2dy+1) window.
+static void morph(Image img, int dx, int dy, int max) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return;
+  // Janelas maiores do que a imagem equivalem a janelas do tamanho dela
+  if (dx > w - 1) dx = w - 1;
+  if (dy > h - 1) dy = h - 1;
+  if (dx == 0 && dy == 0) return;
+  if (!changedAll(img)) return;
+
+  size_t size = img->stride * (size_t)h;
+  uint8* tmp = pixAlloc(&size, 0);
+  int bands = bandsFor(h, w);         // of rows
+  int strips = bandsFor(w, h);        // of columns
+  int tasks = bands > strips ? bands : strips;
+  // Strips narrow enough that the scratch of all the tasks stays within
+  // about the size of the image (however many threads, however tall dy)
+  size_t k = 2 * (size_t)dy + 1;
+  size_t strip = (size_t)w * h / ((size_t)strips * 2 * k);
+  if (strip < MORPH_STRIP_MIN) strip = MORPH_STRIP_MIN;
+  if (strip > (size_t)w) strip = w;
+  MorphArgs a = { img, tmp, dx, dy, max, (int)strip, NULL, 0 };
+  size_t rowScratch = 3 * ((size_t)w + 2 * (size_t)dx);
+  size_t colScratch = 2 * k * strip;
+  a.scratchSize = rowScratch > colScratch ? rowScratch : colScratch;
+  a.scratch = malloc((size_t)tasks * a.scratchSize);
+  if (tmp == NULL || a.scratch == NULL) {
+    errCause = "Memory allocation failed";
+  } else {
+    forBands(h, bands, morphRows, &a);
+    forBands(w, strips, morphColumns, &a);
+    PIXMEM += 4 * (unsigned long)w * h;   // each pass reads and writes each pixel
+  }
+  if (tmp != NULL) pixFree(tmp, size);
+  free(a.scratch);
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+void ImageErode(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 0);
+}
 
-  // Libertar a memória alocada para o array de pixeis da imagem original
-  free(pixels);
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (clipped to the image).
+/// The image is changed in-place.
+void ImageDilate(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 1);
+}
+
+/// Open an image (erode, then dilate) with a (2dx+1)x(2dy+1) rectangle.
+/// The image is changed in-place.
+void ImageOpen(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 0);
+  morph(img, dx, dy, 1);
+}
+
+/// Close an image (dilate, then erode) with a (2dx+1)x(2dy+1) rectangle.
+/// The image is changed in-place.
+void ImageClose(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  morph(img, dx, dy, 1);
+  morph(img, dx, dy, 0);
 }
@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -36,9 +38,48 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and select the
+/// pixel kernels best suited to the running CPU.
 void ImageInit(void) ;
 
+/// CPU dispatch information.
+/// Returns a description of the instruction set levels supported by the CPU
+/// and of the kernels selected (in ImageInit) for each operation.
+/// The level may be forced with environment variable IMAGE8BIT_SIMD
+/// (scalar, sse4.2, avx2 or avx512).
+const char* ImageCpuInfo(void) ;
+
+/// Pixel buffer pool.
+/// The pixel buffers of destroyed images are kept for reuse by new images
+/// of similar size, up to a limit (256 MiB by default).
+/// ImagePoolSetLimit sets that limit, in bytes (0 disables the pool).
+/// ImagePoolDrain frees every buffer kept in the pool.
+void ImagePoolSetLimit(size_t bytes) ;
+void ImagePoolDrain(void) ;
+
+/// Release the resources held by the library (pooled memory, threads).
+/// Call at program exit, after destroying the images.
+void ImageDone(void) ;
+
+/// Threads.
+/// Whole-image operations (negative, threshold, brighten, blend, mirror,
+/// rotation, crop, paste, blur, convolution, median, morphology) split
+/// large images in bands of rows, processed in parallel by a pool of threads.
+/// ImageSetThreads sets the number of threads used (including the caller);
+/// n == 0 selects one per CPU, the default (unless set by environment
+/// variable IMAGE8BIT_THREADS).  Returns the number set.
+int ImageSetThreads(int n) ;
+int ImageGetThreads(void) ;
+
+/// Per-thread instrumentation.
+/// Operations whose cost varies across the image (locate, rotate) split it
+/// in small tiles, which idle threads steal from busy ones.
+/// ImageThreadStatsPrint prints, for each thread, the tasks and tiles it
+/// ran, the tiles it stole and its busy time, since the last
+/// ImageThreadStatsReset.  Balanced threads have similar busy times.
+void ImageThreadStatsReset(void) ;
+void ImageThreadStatsPrint(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,8 +99,26 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Clone an image.
+/// The clone shares the pixels of img until either one is about to change
+/// (copy-on-write): cloning copies no pixels, and the first change copies
+/// them once.  Any number of clones may share the same pixels; each one is
+/// an image of its own, destroyed with ImageDestroy (in any order).
+/// The clone starts clean (see ImageDirtyRects).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errCause is set.
+Image ImageClone(Image img) ;
+
 /// PGM file operations
 
+/// Read a raw PGM image from stream f, which is left after its last pixel
+/// (so that images can be read one after another from the same stream).
+/// On success, a new image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRead(FILE* f) ;
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -67,6 +126,16 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Read the size and maxval of a raw PGM file, without loading the pixels.
+/// On success, returns nonzero and sets (*width, *height, *maxval).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLoadInfo(const char* filename, int* width, int* height, int* maxval) ;
+
+/// Write img to stream f, in raw PGM format.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -86,6 +155,10 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get a hash of the image (size, maxval and pixels): XXH64 of its PGM
+/// file (as ImageSave writes it), with the given seed.
+uint64_t ImageHash(Image img, uint64_t seed) ;
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -93,12 +166,60 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Full statistics of an image (see ImageFullStats).
+typedef struct {
+  uint64_t count;       // number of pixels
+  uint8 min;            // minimum gray level (PixMax if no pixels)
+  uint8 max;            // maximum gray level (0 if no pixels)
+  double mean;          // mean gray level (0 if no pixels)
+  double variance;      // variance of the gray levels (population variance)
+  uint64_t hist[256];   // hist[v] = number of pixels with gray level v
+} ImageStatistics;
+
+/// Compute the histogram, minimum, maximum, mean and variance of the
+/// gray levels in image, all in a single pass over the pixels.
+/// The histograms of bands of rows of the image are kept (until it is
+/// destroyed), so later calls only count again the bands where pixels
+/// changed, and ImageStats uses them too.
+/// On return, *st is filled in.
+void ImageFullStats(Image img, ImageStatistics* st) ;
+
+/// Sum of the gray levels in the rectangle (x,y,w,h), which must be inside img.
+/// The first sum builds an integral image of img, which is kept (until any
+/// function changes the pixels of img, or img is destroyed) and shared with
+/// ImageLocateSubImage: later sums take constant time.
+uint64_t ImageRegionSum(Image img, int x, int y, int w, int h) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
 /// Check if rectangular area (x,y,w,h) is completely inside img.
 int ImageValidRect(Image img, int x, int y, int w, int h) ;
 
+/// Dirty rectangles
+
+/// Every function that changes the pixels of an image records the
+/// rectangles it changed (the whole image, for point operations and
+/// filters), from the time the image is created or loaded until it is
+/// marked clean.  Nearby rectangles are merged, and at most
+/// IMAGE_DIRTY_MAX are kept (merging the closest ones), so they cover
+/// every changed pixel, and maybe a few others.
+/// Results derived from an image can then be updated incrementally (see
+/// ImageBlurUpdate).
+#define IMAGE_DIRTY_MAX 16
+
+/// A rectangle (x,y,w,h) of an image.
+typedef struct {
+  int x, y, w, h;
+} ImageRect;
+
+/// Copy the dirty rectangles of img into rects (room for IMAGE_DIRTY_MAX)
+/// and return their number.
+int ImageDirtyRects(Image img, ImageRect* rects) ;
+
+/// Forget the dirty rectangles of img.
+void ImageMarkClean(Image img) ;
+
 /// Pixel get & set operations
 
 /// These are the primitive operations to access and modify a single pixel
@@ -116,8 +237,10 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the image shares its pixels with clones (see ImageClone).
+/// They never fail, but for the copy of shared pixels: then they set
+/// errCause and leave the image unchanged.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -147,7 +270,7 @@ void ImageBrighten(Image img, double factor) ;
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counter-clockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -164,6 +287,21 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Rotate an image by an arbitrary angle.
+/// Returns a rotated version of the image.
+/// The rotation is degrees counter-clockwise, around the center of the
+/// image, with bilinear interpolation.  The result has the size of the
+/// bounding box of the rotated image; its pixels not covered by the
+/// rotated image are set to fill.
+/// Multiples of 90 degrees are exact (90 is the same as ImageRotate).
+/// Requires: fill <= ImageMaxval(img).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, uint8 fill) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,17 +316,57 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resampling modes of ImageResize.
+enum {
+  IMAGE_RESIZE_NEAREST,   // the source pixel nearest to each pixel center
+  IMAGE_RESIZE_BILINEAR,  // interpolation of the 4 nearest source pixels
+  IMAGE_RESIZE_AREA,      // mean of the source area under each pixel
+};
+
+/// Resize an image to w x h pixels.
+/// Pixel (x, y) of the result covers the rectangle of the source
+/// [x*W/w, (x+1)*W/w) x [y*H/h, (y+1)*H/h), where W x H are the source
+/// dimensions.  Its level is (according to mode):
+///   IMAGE_RESIZE_NEAREST: the level of the source pixel under its center;
+///   IMAGE_RESIZE_BILINEAR: the bilinear interpolation (with 1/256 steps)
+///     of the 4 source pixels nearest to its center, clamped at the borders;
+///   IMAGE_RESIZE_AREA: the mean of the source pixels under the rectangle,
+///     weighted by their area in it (the best for reducing).
+/// Computations are exact, in integers, and rounded to the nearest level.
+/// Requires: w, h >= 0; img must have pixels, unless w or h is 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int mode) ;
+
+/// Build an image pyramid.
+/// levels[0] becomes a copy of img and each levels[i] (i > 0) becomes
+/// levels[i-1] reduced by 2 in each direction (to (width+1)/2 x
+/// (height+1)/2), each pixel the rounded mean of a 2x2 block (an odd last
+/// row or column forms blocks of 2 pixels, or 1).
+/// Stops at maxLevels levels, or after a 1x1 level.
+/// Requires: levels has room for maxLevels images; maxLevels >= 1.
+/// 
+/// On success, returns the number of levels (the caller is responsible for
+/// destroying them!).
+/// On failure, returns 0 (no levels are left) and errno/errCause are set.
+int ImageBuildPyramid(Image img, Image* levels, int maxLevels) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (as in the
+/// pixel transformations, for clones).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (as in the
+/// pixel transformations, for clones).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -203,8 +381,23 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// For templates of 64 pixels or more, only the positions where the sum of
+/// the pixels equals that of img2 are compared, using the integral image of
+/// img1 (see ImageRegionSum): repeated searches in img1 build it once.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate a subimage inside another image, coarse to fine.
+/// Same as ImageLocateSubImage, except that, when img2 occurs at several
+/// positions, any one of them may be returned (not necessarily the first).
+/// Both images are downsampled a few times (see ImageBuildPyramid), the
+/// smallest level is searched with sums of absolute differences, and the
+/// best candidates are refined level by level, down to an exact comparison
+/// at full resolution.  For large templates (say 64x64 or more) this makes
+/// orders of magnitude fewer pixel comparisons than ImageLocateSubImage.
+/// (If no candidate matches, falls back to the full search, so the result
+/// is always exact; images without structure, like noise, may need it.)
+int ImageLocateSubImagePyramid(Image img1, int* px, int* py, Image img2) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -213,4 +406,69 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Incremental blur.
+/// blurred must be ImageBlur(dx, dy) of a copy of img made when img was
+/// last clean (see ImageDirtyRects); it is updated to the blur of img as it
+/// is now, recomputing only the pixels within (dx, dy) of the dirty
+/// rectangles of img.
+/// Requires: blurred has the size of img.
+/// img is not marked clean (other results derived from it may still need
+/// its dirty rectangles).
+void ImageBlurUpdate(Image img, Image blurred, int dx, int dy) ;
+
+/// Convolve an image with a separable kernel: kx (nkx taps) along rows,
+/// then ky (nky taps) along columns.
+/// The center of a kernel of n taps is tap n/2, so the pixel at (x, y)
+/// becomes the sum of kx[i]*ky[j]*pixel(x+i-nkx/2, y+j-nky/2).
+/// Taps are rounded to multiples of 1/4096 (fixed point; the center tap
+/// takes the rounding error of their sum) and sums are computed exactly,
+/// in integers.
+/// Borders are treated as in ImageBlur: only taps that fall inside the
+/// image count, and (if the sum of the taps of a kernel is not 0) their
+/// sum is scaled by (sum of all taps)/(sum of the taps inside), so that,
+/// for instance, a normalized kernel still averages.
+/// Results are rounded and saturated to [0, maxval].
+/// Requires: nkx, nky >= 1, and the sum of the absolute values of the
+/// taps of each kernel at most 1024.
+/// The image is changed in-place.
+void ImageConvolveSeparable(Image img, const double* kx, int nkx,
+                            const double* ky, int nky) ;
+
+/// Blur an image with a Gaussian filter of standard deviation sigma
+/// (in pixels), truncated at 3*sigma.
+/// Requires: sigma >= 0.  The image is changed in-place.
+void ImageGaussianBlur(Image img, double sigma) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], clipped to the image (as in ImageBlur).
+/// When the rectangle has an even number of pixels, the lower of the two
+/// middle levels is taken.
+/// The cost per pixel does not grow with dx and dy.
+/// The image is changed in-place.
+void ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Grayscale morphology with a (2dx+1)x(2dy+1) rectangle as structuring
+/// element, clipped to the image (as in ImageBlur).
+/// The cost per pixel does not grow with dx and dy.
+/// The image is changed in-place.
+
+/// Erode: each pixel is substituted by the minimum of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy].
+void ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate: each pixel is substituted by the maximum of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy].
+void ImageDilate(Image img, int dx, int dy) ;
+
+/// Open: erode, then dilate (removes bright details smaller than the
+/// rectangle).
+void ImageOpen(Image img, int dx, int dy) ;
+
+/// Close: dilate, then erode (fills dark details smaller than the
+/// rectangle).
+void ImageClose(Image img, int dx, int dy) ;
+
 #endif
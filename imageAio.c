@@ -0,0 +1,490 @@
+/// imageAio - Asynchronous reads and writes of whole files.
+///
+/// See imageAio.h.
+
+#include "imageAio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Maximum size of a single transfer (longer ones are split).
+#define CHUNK ((size_t)1 << 30)
+
+// Maximum number of threads of the thread pool.
+#define THREADS_MAX 64
+
+// A request: a read or a write of a whole file.
+struct aioreq {
+  int write;              // a write (else a read)
+  int fd;                 // the file
+  char* path;             // its path (a copy)
+  char* data;             // the contents of the file
+  size_t size;            // their size
+  size_t off;             // bytes transferred so far
+  int err;                // errno of the failure, or 0
+  int done;               // complete (no longer in flight)
+  struct aioreq* next;    // in the list of requests of the engine
+  struct aioreq* queued;  // in the queue of the thread pool
+};
+
+struct aio {
+  int depth;              // maximum requests in flight
+  int inflight;           // requests in flight
+  int err;                // errno of the first failed write
+  AioReq reqs;            // requests not destroyed yet
+  pthread_mutex_t lock;   // (held by the public functions, and the workers)
+  pthread_cond_t cond;    // signaled when a request completes
+
+  // io_uring (if ring >= 0)
+  int ring;
+  void* sqmap;
+  size_t sqlen;
+  void* cqmap;
+  size_t cqlen;
+  struct io_uring_sqe* sqes;
+  size_t sqeslen;
+  unsigned* sqtail;
+  unsigned* sqmask;
+  unsigned* sqarray;
+  unsigned* cqhead;
+  unsigned* cqtail;
+  unsigned* cqmask;
+  struct io_uring_cqe* cqes;
+
+  // Thread pool (if ring < 0)
+  pthread_t threads[THREADS_MAX];
+  int nthreads;
+  AioReq queue;           // requests to start (first)
+  AioReq last;            // (last)
+  int stop;               // the workers must exit
+};
+
+// Complete request r (a->lock held): close its file, and destroy it if it
+// is a write (reads are destroyed by AioTake).
+static void complete(Aio a, AioReq r) {
+  if (close(r->fd) != 0 && r->err == 0 && r->write) r->err = errno;
+  r->fd = -1;
+  r->done = 1;
+  a->inflight--;
+  if (r->write) {
+    if (r->err != 0 && a->err == 0) a->err = r->err;
+    for (AioReq* q = &a->reqs; *q != NULL; q = &(*q)->next) {
+      if (*q == r) {
+        *q = r->next;
+        break;
+      }
+    }
+    free(r->data);
+    free(r->path);
+    free(r);
+  }
+  pthread_cond_broadcast(&a->cond);
+}
+
+
+/// Thread pool
+
+// Transfer request r with blocking calls.  Returns errno, or 0.
+static int transfer(AioReq r) {
+  while (r->off < r->size) {
+    size_t n = r->size - r->off;
+    if (n > CHUNK) n = CHUNK;
+    ssize_t k = r->write ? pwrite(r->fd, r->data + r->off, n, r->off)
+                         : pread(r->fd, r->data + r->off, n, r->off);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) return errno;
+    if (k == 0) {
+      if (r->write) return ENOSPC;
+      r->size = r->off;
+      break;
+    }
+    r->off += k;
+  }
+  return 0;
+}
+
+// Worker thread of the pool: transfer the requests queued in arg.
+static void* worker(void* arg) {
+  Aio a = arg;
+  pthread_mutex_lock(&a->lock);
+  for (;;) {
+    while (a->queue == NULL && !a->stop) pthread_cond_wait(&a->cond, &a->lock);
+    AioReq r = a->queue;
+    if (r == NULL) break;
+    a->queue = r->queued;
+    pthread_mutex_unlock(&a->lock);
+    int err = transfer(r);
+    pthread_mutex_lock(&a->lock);
+    r->err = err;
+    complete(a, r);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return NULL;
+}
+
+// Start the threads of the pool of a (up to depth of them).
+// Returns the number started.
+static int poolStart(Aio a) {
+  int n = a->depth < THREADS_MAX ? a->depth : THREADS_MAX;
+  for (; a->nthreads < n; a->nthreads++) {
+    if (pthread_create(&a->threads[a->nthreads], NULL, worker, a) != 0) break;
+  }
+  return a->nthreads;
+}
+
+
+/// io_uring
+
+static int ringEnter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+// Unmap and close the ring of a.
+static void ringFree(Aio a) {
+  if (a->sqes != NULL && a->sqes != MAP_FAILED) munmap(a->sqes, a->sqeslen);
+  if (a->cqmap != NULL && a->cqmap != MAP_FAILED && a->cqmap != a->sqmap) munmap(a->cqmap, a->cqlen);
+  if (a->sqmap != NULL && a->sqmap != MAP_FAILED) munmap(a->sqmap, a->sqlen);
+  if (a->ring >= 0) close(a->ring);
+  a->ring = -1;
+  a->sqmap = a->cqmap = NULL;
+  a->sqes = NULL;
+}
+
+// Set up the ring of a.  Returns 0 if io_uring is not available.
+static int ringSetup(Aio a) {
+  struct io_uring_params par;
+  memset(&par, 0, sizeof(par));
+  a->ring = (int)syscall(__NR_io_uring_setup, a->depth, &par);
+  if (a->ring < 0) return 0;
+  // (IORING_OP_READ and IORING_OP_WRITE came with this feature, in 5.6)
+  if (!(par.features & IORING_FEAT_RW_CUR_POS)) {
+    ringFree(a);
+    return 0;
+  }
+  a->sqlen = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+  a->cqlen = par.cq_off.cqes + par.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (par.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single) {
+    if (a->cqlen > a->sqlen) a->sqlen = a->cqlen;
+    a->cqlen = a->sqlen;
+  }
+  a->sqmap = mmap(NULL, a->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  a->ring, IORING_OFF_SQ_RING);
+  if (a->sqmap == MAP_FAILED) {
+    ringFree(a);
+    return 0;
+  }
+  a->cqmap = single ? a->sqmap
+           : mmap(NULL, a->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  a->ring, IORING_OFF_CQ_RING);
+  a->sqeslen = par.sq_entries * sizeof(struct io_uring_sqe);
+  a->sqes = a->cqmap == MAP_FAILED ? MAP_FAILED
+          : mmap(NULL, a->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 a->ring, IORING_OFF_SQES);
+  if (a->sqes == MAP_FAILED) {
+    ringFree(a);
+    return 0;
+  }
+  char* sq = a->sqmap;
+  char* cq = a->cqmap;
+  a->sqtail = (unsigned*)(sq + par.sq_off.tail);
+  a->sqmask = (unsigned*)(sq + par.sq_off.ring_mask);
+  a->sqarray = (unsigned*)(sq + par.sq_off.array);
+  a->cqhead = (unsigned*)(cq + par.cq_off.head);
+  a->cqtail = (unsigned*)(cq + par.cq_off.tail);
+  a->cqmask = (unsigned*)(cq + par.cq_off.ring_mask);
+  a->cqes = (struct io_uring_cqe*)(cq + par.cq_off.cqes);
+  return 1;
+}
+
+// Submit the next transfer of request r to the ring.
+// (There is always room: each request in flight has at most one entry.)
+static void ringSubmit(Aio a, AioReq r) {
+  unsigned tail = *a->sqtail;
+  unsigned k = tail & *a->sqmask;
+  struct io_uring_sqe* sqe = &a->sqes[k];
+  size_t n = r->size - r->off;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = r->fd;
+  sqe->addr = (unsigned long)(r->data + r->off);
+  sqe->len = (unsigned)(n < CHUNK ? n : CHUNK);
+  sqe->off = r->off;
+  sqe->user_data = (unsigned long)r;
+  a->sqarray[k] = k;
+  __atomic_store_n(a->sqtail, tail + 1, __ATOMIC_RELEASE);
+  while (ringEnter(a->ring, 1, 0, 0) < 0) {
+    if (errno == EINTR) continue;
+    // (Nothing was submitted: take the entry back)
+    __atomic_store_n(a->sqtail, tail, __ATOMIC_RELEASE);
+    r->err = errno;
+    complete(a, r);
+    return;
+  }
+}
+
+// The ring of a failed with errno err: fail the requests in flight with
+// err, drop the ring, and go on with the thread pool.
+static void ringFail(Aio a, int err) {
+  for (AioReq r = a->reqs; r != NULL; ) {
+    if (!r->done) {
+      r->err = err;
+      complete(a, r);
+      r = a->reqs;   // (r may be gone)
+    } else {
+      r = r->next;
+    }
+  }
+  ringFree(a);
+  poolStart(a);
+}
+
+// Wait for the ring to complete at least one transfer, and handle all
+// those complete: short transfers are resubmitted for the rest.
+static void ringReap(Aio a) {
+  unsigned head = *a->cqhead;
+  while (head == __atomic_load_n(a->cqtail, __ATOMIC_ACQUIRE)) {
+    if (ringEnter(a->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      ringFail(a, errno);
+      return;
+    }
+  }
+  do {
+    struct io_uring_cqe cqe = a->cqes[head & *a->cqmask];
+    __atomic_store_n(a->cqhead, ++head, __ATOMIC_RELEASE);
+    AioReq r = (AioReq)(unsigned long)cqe.user_data;
+    if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+      ringSubmit(a, r);
+      continue;
+    }
+    if (cqe.res < 0) {
+      r->err = -cqe.res;
+    } else if (cqe.res == 0) {
+      // (A file that became shorter, or a device that is full)
+      if (r->write) r->err = ENOSPC;
+      else r->size = r->off;
+    } else {
+      r->off += cqe.res;
+    }
+    if (r->err == 0 && r->off < r->size) ringSubmit(a, r);
+    else complete(a, r);
+  } while (head != __atomic_load_n(a->cqtail, __ATOMIC_ACQUIRE));
+}
+
+
+/// Requests
+
+// Wait for some request in flight to complete (a->lock held).
+static void progress(Aio a) {
+  if (a->ring >= 0) ringReap(a);
+  else pthread_cond_wait(&a->cond, &a->lock);
+}
+
+// Wait for the writes to path in flight (a->lock held).
+static void waitWrites(Aio a, const char* path) {
+  for (AioReq r = a->reqs; r != NULL; ) {
+    if (r->write && strcmp(r->path, path) == 0) {
+      progress(a);
+      r = a->reqs;   // (r may be gone)
+    } else {
+      r = r->next;
+    }
+  }
+}
+
+// Start request r, waiting for room (a->lock held).
+static void start(Aio a, AioReq r) {
+  while (a->inflight >= a->depth) progress(a);
+  a->inflight++;
+  r->next = a->reqs;
+  a->reqs = r;
+  if (r->size == 0) {
+    complete(a, r);
+  } else if (a->ring >= 0) {
+    ringSubmit(a, r);
+  } else if (a->nthreads == 0) {
+    // (No threads to transfer it: see ringFail)
+    r->err = EAGAIN;
+    complete(a, r);
+  } else {
+    r->queued = NULL;
+    if (a->queue == NULL) a->queue = r;
+    else a->last->queued = r;
+    a->last = r;
+    pthread_cond_broadcast(&a->cond);
+  }
+}
+
+// New request on the file fd at path, with size bytes of data (NULL:
+// allocate them).  Returns NULL on failure (and closes fd).
+static AioReq request(int write, int fd, const char* path, char* data, size_t size) {
+  AioReq r = calloc(1, sizeof(*r));
+  if (r != NULL) r->path = strdup(path);
+  if (r != NULL && data == NULL) data = malloc(size > 0 ? size : 1);
+  if (r == NULL || r->path == NULL || data == NULL) {
+    if (r != NULL) free(r->path);
+    free(r);
+    free(data);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  r->write = write;
+  r->fd = fd;
+  r->data = data;
+  r->size = size;
+  return r;
+}
+
+/// Create an engine.
+Aio AioCreate(int depth) { ///
+  if (depth < 1 || depth > AIO_DEPTH_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+  Aio a = calloc(1, sizeof(*a));
+  if (a == NULL) return NULL;
+  a->depth = depth;
+  a->ring = -1;
+  pthread_mutex_init(&a->lock, NULL);
+  pthread_cond_init(&a->cond, NULL);
+  const char* engine = getenv("IMAGETOOL_AIO");
+  if (engine != NULL && strcmp(engine, "threads") == 0) {
+    // (No io_uring)
+  } else if (ringSetup(a)) {
+    return a;
+  }
+  if (poolStart(a) == 0) {
+    AioDestroy(&a);
+    errno = EAGAIN;
+  }
+  return a;
+}
+
+/// Destroy the engine pointed to by (*ap).
+void AioDestroy(Aio* ap) { ///
+  Aio a = *ap;
+  if (a == NULL) return;
+  int e = errno;
+  pthread_mutex_lock(&a->lock);
+  while (a->inflight > 0) progress(a);
+  a->stop = 1;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+  for (int k = 0; k < a->nthreads; k++) pthread_join(a->threads[k], NULL);
+  while (a->reqs != NULL) {
+    AioReq r = a->reqs;
+    a->reqs = r->next;
+    free(r->data);
+    free(r->path);
+    free(r);
+  }
+  ringFree(a);
+  pthread_cond_destroy(&a->cond);
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+  *ap = NULL;
+  errno = e;
+}
+
+/// Name of the engine.
+const char* AioEngine(Aio a) { ///
+  return a->ring >= 0 ? "io_uring" : "threads";
+}
+
+/// Start reading a whole file.
+AioReq AioRead(Aio a, const char* path) { ///
+  pthread_mutex_lock(&a->lock);
+  waitWrites(a, path);
+  pthread_mutex_unlock(&a->lock);
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  int e = fstat(fd, &st) != 0 ? errno : S_ISREG(st.st_mode) ? 0 : ESPIPE;
+  if (e != 0) {
+    close(fd);
+    errno = e;
+    return NULL;
+  }
+  AioReq r = request(0, fd, path, NULL, st.st_size);
+  if (r == NULL) return NULL;
+  pthread_mutex_lock(&a->lock);
+  start(a, r);
+  pthread_mutex_unlock(&a->lock);
+  return r;
+}
+
+/// Wait for a read, and take its data.
+char* AioTake(Aio a, AioReq req, size_t* size) { ///
+  pthread_mutex_lock(&a->lock);
+  while (!req->done) progress(a);
+  for (AioReq* q = &a->reqs; *q != NULL; q = &(*q)->next) {
+    if (*q == req) {
+      *q = req->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+  char* data = req->data;
+  *size = req->size;
+  if (req->err != 0) {
+    free(data);
+    data = NULL;
+    errno = req->err;
+  }
+  free(req->path);
+  free(req);
+  return data;
+}
+
+/// Start writing a whole file.
+int AioWrite(Aio a, const char* path, char* data, size_t size) { ///
+  pthread_mutex_lock(&a->lock);
+  waitWrites(a, path);
+  pthread_mutex_unlock(&a->lock);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    int e = errno;
+    free(data);
+    errno = e;
+    return 0;
+  }
+  AioReq r = request(1, fd, path, data, size);
+  if (r == NULL) return 0;
+  pthread_mutex_lock(&a->lock);
+  start(a, r);
+  pthread_mutex_unlock(&a->lock);
+  return 1;
+}
+
+/// errno of the first failed write.
+int AioError(Aio a) { ///
+  pthread_mutex_lock(&a->lock);
+  int err = a->err;
+  pthread_mutex_unlock(&a->lock);
+  return err;
+}
+
+/// Wait for the writes in flight.
+int AioSync(Aio a) { ///
+  pthread_mutex_lock(&a->lock);
+  for (AioReq r = a->reqs; r != NULL; ) {
+    if (r->write) {
+      progress(a);
+      r = a->reqs;
+    } else {
+      r = r->next;
+    }
+  }
+  int err = a->err;
+  pthread_mutex_unlock(&a->lock);
+  return err;
+}
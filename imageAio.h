@@ -0,0 +1,63 @@
+/// imageAio - Asynchronous reads and writes of whole files.
+///
+/// This module is part of imageTool (see imageBatch.h).
+/// Files are read into memory, and written from memory, by an engine that
+/// keeps up to a given number of requests in flight, while the caller goes
+/// on computing.  The engine is io_uring (set up with raw system calls),
+/// or, if the kernel does not provide it (or with IMAGETOOL_AIO=threads in
+/// the environment), a pool of threads doing blocking reads and writes.
+///
+/// Files are opened (and their sizes found) at once, when the requests
+/// are made: only the transfers are asynchronous.  Requests on the same
+/// path are ordered: they wait for the writes to that path in flight.
+
+#ifndef IMAGEAIO_H
+#define IMAGEAIO_H
+
+#include <stddef.h>
+
+/// Maximum number of requests in flight.
+#define AIO_DEPTH_MAX 4096
+
+/// Type Aio is a pointer to I/O engines.
+typedef struct aio *Aio;
+
+/// Type AioReq is a pointer to read requests.
+typedef struct aioreq *AioReq;
+
+/// Create an engine with at most depth (1 <= depth <= AIO_DEPTH_MAX)
+/// requests in flight: further requests wait for room.
+/// Returns NULL on failure, with errno set.
+Aio AioCreate(int depth) ;
+
+/// Destroy the engine pointed to by (*ap), and set (*ap) to NULL.
+/// The requests in flight are waited for first (and the data of reads not
+/// taken are dropped).
+void AioDestroy(Aio* ap) ;
+
+/// Name of the engine: "io_uring" or "threads".
+const char* AioEngine(Aio a) ;
+
+/// Start reading the whole of (regular) file path.
+/// Returns the request (see AioTake), or NULL on failure, with errno set.
+AioReq AioRead(Aio a, const char* path) ;
+
+/// Wait for read request req, and take its data.
+/// Returns the contents of the file (allocated with malloc: the caller
+/// frees them) with their size in (*size), or NULL on failure, with errno
+/// set.  The request is destroyed either way.
+char* AioTake(Aio a, AioReq req, size_t* size) ;
+
+/// Start writing the size bytes of data to file path (created or
+/// truncated).  The data, allocated with malloc, are taken by the engine.
+/// Returns 0 if the file could not be opened (with errno set).  Failures
+/// of the transfer are reported later, by AioError and AioSync.
+int AioWrite(Aio a, const char* path, char* data, size_t size) ;
+
+/// errno of the first write that failed so far, or 0.
+int AioError(Aio a) ;
+
+/// Wait for the writes in flight.  Returns AioError.
+int AioSync(Aio a) ;
+
+#endif
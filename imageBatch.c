@@ -0,0 +1,99 @@
+/// imageBatch - imageTool plans run on batches of input files.
+///
+/// See imageBatch.h.
+
+#include "imageBatch.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image8bit.h"
+#include "imageAio.h"
+
+// Start reading file name (relative to the directory of io) with a.
+// Returns NULL if it is not read ahead (the run then loads it).
+static AioReq startLoad(Aio a, const PipelineIO* io, const char* name) {
+  char path[4096];
+  if (a == NULL || strcmp(name, "-") == 0) return NULL;
+  int n = name[0] == '/' || io->dir == NULL
+        ? snprintf(path, sizeof(path), "%s", name)
+        : snprintf(path, sizeof(path), "%s/%s", io->dir, name);
+  if (n < 0 || (size_t)n >= sizeof(path)) return NULL;
+  int e = errno;
+  AioReq req = AioRead(a, path);
+  errno = e;
+  return req;
+}
+
+// Image of the file read by req (NULL if there is none, or if it failed:
+// the run then loads the file again, and fails as usual).
+static Image takeImage(Aio a, AioReq req) {
+  size_t size;
+  if (req == NULL) return NULL;
+  int e = errno;
+  char* data = AioTake(a, req, &size);
+  FILE* m = data != NULL ? fmemopen(data, size, "r") : NULL;
+  Image img = m != NULL ? ImageRead(m) : NULL;
+  if (m != NULL) fclose(m);
+  free(data);
+  errno = e;
+  return img;
+}
+
+/// Run pipeline p on each group of input files.
+int BatchRun(Pipeline p, int nfiles, char* const* files, int depth,
+             const PipelineIO* io, unsigned long* runs) { ///
+  int m = PipelineInputs(p);
+  *runs = 0;
+  if (m == 0 || nfiles == 0 || nfiles % m != 0) return PIPE_EOPERANDS;
+  // (The loads of a run and of the next ones, and the saves)
+  Aio a = NULL;
+  if (depth > 0 && (a = AioCreate(m + 2 * depth)) == NULL) return PIPE_EIMAGE8BIT;
+  AioReq* req = calloc(nfiles, sizeof(AioReq));
+  if (req == NULL) {
+    AioDestroy(&a);
+    return PIPE_EIMAGE8BIT;
+  }
+  if (a != NULL && io->log != NULL) {
+    fprintf(io->log, "Batch of %d runs, %d files read ahead (%s)\n", nfiles / m, depth, AioEngine(a));
+  }
+
+  PipelineIO bio = *io;
+  bio.aio = a;
+  int err = PIPE_OK;
+  int e = 0;
+  int next = 0;   // next file to start reading
+  for (int g = 0; g < nfiles && err == PIPE_OK; g += m) {
+    // Start reading the files of this run and of the next ones
+    for (; next < nfiles && next < g + m + depth; next++) req[next] = startLoad(a, io, files[next]);
+    Image images[m];
+    for (int k = 0; k < m; k++) {
+      images[k] = takeImage(a, req[g + k]);
+      req[g + k] = NULL;
+    }
+    errno = 0;
+    err = PipelineRunImages(p, files + g, images, &bio);
+    e = errno;
+    if (err == PIPE_OK && a != NULL && (e = AioError(a)) != 0) err = PIPE_EIMAGE8BIT;
+    if (err == PIPE_OK) (*runs)++;
+  }
+
+  // Drop the files read ahead for runs that did not happen
+  for (int k = 0; k < next; k++) {
+    size_t size;
+    if (req[k] != NULL) free(AioTake(a, req[k], &size));
+  }
+  if (a != NULL) {
+    int we = AioSync(a);
+    if (we != 0 && err == PIPE_OK) {
+      e = we;
+      err = PIPE_EIMAGE8BIT;
+    }
+    AioDestroy(&a);
+  }
+  free(req);
+  errno = e;
+  return err;
+}
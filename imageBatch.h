@@ -0,0 +1,38 @@
+/// imageBatch - imageTool plans run on batches of input files.
+///
+/// This module is part of imageTool (see imageTool.c).
+/// A saved plan runs once per group of input files (as many as it loads),
+/// in order.  The files are read ahead asynchronously (see imageAio.h):
+/// while a run computes, the files of the next runs are being read, and
+/// the files saved by the earlier runs are being written, so that the
+/// computation does not wait for the disk.  Only the main thread uses the
+/// image8bit module: the engine moves bytes, and the main thread parses
+/// the images of each run just before it starts.
+///
+/// The files read ahead take memory on top of the budget of the plan (a
+/// file each), as do the files being written.  A file that a run saves
+/// should not be an input of the next runs: it may be read ahead before.
+
+#ifndef IMAGEBATCH_H
+#define IMAGEBATCH_H
+
+#include "imagePipeline.h"
+
+/// Default number of files read ahead.
+#define BATCH_DEPTH 8
+
+/// Maximum number of files read ahead.
+#define BATCH_DEPTH_MAX 1024
+
+/// Run pipeline p on each group of PipelineInputs(p) of the nfiles files,
+/// in order, with the streams of io, keeping up to depth files of the next
+/// runs (and depth files saved) in flight.  With depth 0, files are read
+/// and written at once, by the runs.
+/// Returns PIPE_OK, or the error code of the first run that fails
+/// (PIPE_EOPERANDS if the files do not make whole groups, and
+/// PIPE_EIMAGE8BIT with errno set if a file saved could not be written),
+/// with the number of runs completed in (*runs).
+int BatchRun(Pipeline p, int nfiles, char* const* files, int depth,
+             const PipelineIO* io, unsigned long* runs) ;
+
+#endif
@@ -0,0 +1,530 @@
+// imageBench - A benchmark driver for the image8bit module.
+//
+// This program times every public operation of the image8bit module
+// on synthetic images of several sizes, so that different builds
+// (compiler flags, implementations) can be compared and performance
+// regressions caught.  It needs no input files and no network access.
+//
+// Each case is run a few times unmeasured (warm-up) and then repeated;
+// the minimum, median and 90th percentile of the wall-clock times are
+// reported, together with the throughput in megapixels per second.
+// With several thread counts (-j), each case is run with each of them,
+// and the speedup over the first one is reported too.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Time image8bit operations on synthetic images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s S1,S2,...    Image sizes (SxS pixels)  [256,1024,4096,16384]\n"
+    "  -p P1,P2,...    Image patterns: noise, gradient  [noise,gradient]\n"
+    "  -o OP1,OP2,...  Operations to time  [all]\n"
+    "  -r REPS         Measured repetitions per case  [7]\n"
+    "  -w WARMUP       Unmeasured warm-up runs per case  [1]\n"
+    "  -b SECONDS      Time budget per case; stops repeating when exceeded  [2]\n"
+    "  -j T1,T2,...    Numbers of threads (0: one per CPU)  [0]\n"
+    "  -l              List operations and exit\n"
+    "\n"
+    ;
+
+// Wall-clock time in seconds.
+// (cpu_time() from instrumentation is per-process CPU time,
+// which is not what we want to report for a benchmark.)
+static double wall_time(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Small, fast and reproducible pseudo-random generator (xorshift32).
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t rng(void) {
+  uint32_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rng_state = x;
+}
+
+// Synthetic image patterns
+
+// Uniform random noise.  Worst case for anything that exploits redundancy.
+static void fillNoise(Image img) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y, (uint8)(rng() >> 24));
+}
+
+// Smooth diagonal gradient (wraps around every 256 levels).
+static void fillGradient(Image img) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y, (uint8)((x + y) / 2));
+}
+
+static const struct {
+  const char* name;
+  void (*fill)(Image img);
+} patterns[] = {
+  { "noise", fillNoise },
+  { "gradient", fillGradient },
+};
+#define NPATTERNS (int)(sizeof(patterns) / sizeof(patterns[0]))
+
+// Benchmark cases
+
+// State shared by the setup, run and cleanup functions of a case.
+typedef struct {
+  Image src;      // source image (never modified)
+  Image small;    // small subimage of src, cut from its center
+  Image work;     // working copy of src, for in-place operations
+  Image out;      // result of operations that create images
+  const char* tmpname;  // temporary file for load/save
+  FILE* file;     // tmpname, opened for read/write
+  char* mem;      // src in PGM format, in memory
+  size_t memsize; // size of mem
+  int size;       // src is size x size
+  long sink;      // accumulates results, so that work is not optimized out
+} Bench;
+
+// Copy src into a fresh working image
+static void setupCopy(Bench* b) {
+  b->work = ImageCrop(b->src, 0, 0, b->size, b->size);
+  if (b->work == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+}
+
+static void setupSave(Bench* b) {
+  if (ImageSave(b->src, b->tmpname) == 0)
+    error(2, errno, "%s: %s", b->tmpname, ImageErrMsg());
+}
+
+// Save src to tmpname and open it for reading
+static void setupRead(Bench* b) {
+  setupSave(b);
+  b->file = fopen(b->tmpname, "rb");
+  if (b->file == NULL) error(2, errno, "%s", b->tmpname);
+}
+
+static void setupWrite(Bench* b) {
+  b->file = fopen(b->tmpname, "wb");
+  if (b->file == NULL) error(2, errno, "%s", b->tmpname);
+}
+
+// A copy of src one pixel narrower, so that its rows are padded in memory
+static void setupPadded(Bench* b) {
+  b->work = ImageCrop(b->src, 0, 0, b->size - 1, b->size);
+  if (b->work == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+}
+
+static void setupReadPadded(Bench* b) {
+  setupPadded(b);
+  if (ImageSave(b->work, b->tmpname) == 0)
+    error(2, errno, "%s: %s", b->tmpname, ImageErrMsg());
+  b->file = fopen(b->tmpname, "rb");
+  if (b->file == NULL) error(2, errno, "%s", b->tmpname);
+}
+
+static void setupWritePadded(Bench* b) {
+  setupPadded(b);
+  setupWrite(b);
+}
+
+// src in PGM format in memory (as imageTool batches read files ahead)
+static void setupMemory(Bench* b) {
+  FILE* f = open_memstream(&b->mem, &b->memsize);
+  if (f == NULL || ImageWrite(b->src, f) == 0 || fclose(f) != 0)
+    error(2, errno, "Writing to memory: %s", ImageErrMsg());
+}
+
+static void cleanup(Bench* b) {
+  ImageDestroy(&b->work);
+  ImageDestroy(&b->out);
+  if (b->file != NULL) fclose(b->file);
+  b->file = NULL;
+  free(b->mem);
+  b->mem = NULL;
+}
+
+static void checkOut(Bench* b) {
+  if (b->out == NULL) error(2, errno, "Operation failed: %s", ImageErrMsg());
+}
+
+static void runCreate(Bench* b) {
+  b->out = ImageCreate(b->size, b->size, PixMax);
+  checkOut(b);
+}
+
+static void runLoad(Bench* b) {
+  b->out = ImageLoad(b->tmpname);
+  checkOut(b);
+}
+
+static void runSave(Bench* b) {
+  if (ImageSave(b->src, b->tmpname) == 0)
+    error(2, errno, "%s: %s", b->tmpname, ImageErrMsg());
+}
+
+static void runLoadInfo(Bench* b) {
+  int w, h, maxval;
+  if (ImageLoadInfo(b->tmpname, &w, &h, &maxval) == 0)
+    error(2, errno, "%s: %s", b->tmpname, ImageErrMsg());
+  b->sink += w + h + maxval;
+}
+
+static void runRead(Bench* b) {
+  b->out = ImageRead(b->file);
+  checkOut(b);
+}
+
+static void runReadMemory(Bench* b) {
+  FILE* f = fmemopen(b->mem, b->memsize, "r");
+  if (f == NULL) error(2, errno, "Reading from memory");
+  b->out = ImageRead(f);
+  fclose(f);
+  checkOut(b);
+}
+
+// Write img to the open file, including the flush
+static void writeFile(Bench* b, Image img) {
+  if (ImageWrite(img, b->file) == 0 || fflush(b->file) != 0)
+    error(2, errno, "%s: %s", b->tmpname, ImageErrMsg());
+}
+
+static void runWrite(Bench* b) { writeFile(b, b->src); }
+
+static void runWritePadded(Bench* b) { writeFile(b, b->work); }
+
+static void runStats(Bench* b) {
+  uint8 min, max;
+  ImageStats(b->src, &min, &max);
+  b->sink += min + max;
+}
+
+static void runHash(Bench* b) { b->sink += (long)ImageHash(b->src, 0); }
+
+static void runFullStats(Bench* b) {
+  ImageStatistics st;
+  ImageFullStats(b->src, &st);
+  b->sink += st.min + st.max + st.hist[128];
+}
+
+// Sums of all the small tiles of a fresh image (which builds its integral image)
+static void runRegionSum(Bench* b) {
+  int s = ImageWidth(b->small);
+  for (int y = 0; y + s <= b->size; y += s)
+    for (int x = 0; x + s <= b->size; x += s)
+      b->sink += ImageRegionSum(b->work, x, y, s, s);
+}
+
+static void runValidRect(Bench* b) {
+  b->sink += ImageValidRect(b->src, 0, 0, b->size, b->size);
+}
+
+static void runGetPixel(Bench* b) {
+  for (int y = 0; y < b->size; y++)
+    for (int x = 0; x < b->size; x++)
+      b->sink += ImageGetPixel(b->src, x, y);
+}
+
+static void runSetPixel(Bench* b) {
+  for (int y = 0; y < b->size; y++)
+    for (int x = 0; x < b->size; x++)
+      ImageSetPixel(b->work, x, y, (uint8)x);
+}
+
+static void runNegative(Bench* b) { ImageNegative(b->work); }
+
+// Clone, then negate the clone (which copies the shared pixels first)
+static void runCloneNegative(Bench* b) {
+  b->out = ImageClone(b->src);
+  checkOut(b);
+  ImageNegative(b->out);
+}
+
+static void runThreshold(Bench* b) { ImageThreshold(b->work, 128); }
+
+static void runBrighten(Bench* b) { ImageBrighten(b->work, 1.3); }
+
+static void runRotate(Bench* b) { b->out = ImageRotate(b->src); checkOut(b); }
+
+static void runDeskew(Bench* b) { b->out = ImageRotateAngle(b->src, 3.0, 0); checkOut(b); }
+
+static void runMirror(Bench* b) { b->out = ImageMirror(b->src); checkOut(b); }
+
+static void runCrop(Bench* b) {
+  b->out = ImageCrop(b->src, b->size/4, b->size/4, b->size/2, b->size/2);
+  checkOut(b);
+}
+
+static void runResize(Bench* b) {
+  b->out = ImageResize(b->src, b->size / 3 + 1, b->size / 3 + 1, IMAGE_RESIZE_BILINEAR);
+  checkOut(b);
+}
+
+static void runResizeArea(Bench* b) {
+  b->out = ImageResize(b->src, b->size / 3 + 1, b->size / 3 + 1, IMAGE_RESIZE_AREA);
+  checkOut(b);
+}
+
+static void runPyramid(Bench* b) {
+  Image levels[40];
+  int n = ImageBuildPyramid(b->src, levels, 40);
+  if (n == 0) error(2, errno, "pyramid: %s", ImageErrMsg());
+  for (int i = 0; i < n; i++) ImageDestroy(&levels[i]);
+}
+
+static void runPaste(Bench* b) {
+  int s = ImageWidth(b->small);
+  for (int y = 0; y + s <= b->size; y += s)
+    for (int x = 0; x + s <= b->size; x += s)
+      ImagePaste(b->work, x, y, b->small);
+}
+
+static void runBlend(Bench* b) {
+  int s = ImageWidth(b->small);
+  for (int y = 0; y + s <= b->size; y += s)
+    for (int x = 0; x + s <= b->size; x += s)
+      ImageBlend(b->work, x, y, b->small, 0.33);
+}
+
+static void runMatch(Bench* b) {
+  int s = ImageWidth(b->small);
+  for (int y = 0; y + s <= b->size; y += s)
+    for (int x = 0; x + s <= b->size; x += s)
+      b->sink += ImageMatchSubImage(b->src, x, y, b->small);
+}
+
+static void runLocate(Bench* b) {
+  int x, y;
+  b->sink += ImageLocateSubImage(b->src, &x, &y, b->small);
+}
+
+static void runLocatePyramid(Bench* b) {
+  int x, y;
+  b->sink += ImageLocateSubImagePyramid(b->src, &x, &y, b->small);
+}
+
+static void runBlur(Bench* b) { ImageBlur(b->work, 7, 7); }
+
+// A clean working image and its blur
+static void setupBlurred(Bench* b) {
+  setupCopy(b);
+  b->out = ImageCrop(b->src, 0, 0, b->size, b->size);
+  checkOut(b);
+  ImageBlur(b->out, 7, 7);
+  ImageMarkClean(b->work);
+}
+
+// Paste the small image in the middle, then update the blur
+static void runBlurUpdate(Bench* b) {
+  int s = ImageWidth(b->small);
+  ImagePaste(b->work, (b->size - s) / 2, (b->size - s) / 2, b->small);
+  ImageBlurUpdate(b->work, b->out, 7, 7);
+}
+
+static void runMedian(Bench* b) { ImageMedian(b->work, 7, 7); }
+
+static void runErode(Bench* b) { ImageErode(b->work, 7, 7); }
+
+static void runDilate(Bench* b) { ImageDilate(b->work, 7, 7); }
+
+static void runOpen(Bench* b) { ImageOpen(b->work, 7, 7); }
+
+static void runClose(Bench* b) { ImageClose(b->work, 7, 7); }
+
+static void runGauss(Bench* b) { ImageGaussianBlur(b->work, 2.0); }
+
+// A general (asymmetric, with negative taps) separable kernel: a sharpening
+static void runConvolve(Bench* b) {
+  static const double kx[] = { -0.25, -0.5, 2.75, -0.5, -0.25, -0.25 };
+  static const double ky[] = { -0.5, 2.0, -0.5 };
+  ImageConvolveSeparable(b->work, kx, 6, ky, 3);
+}
+
+static const struct {
+  const char* name;
+  void (*setup)(Bench* b);  // not timed (may be NULL)
+  void (*run)(Bench* b);    // timed
+} ops[] = {
+  { "create",    NULL,      runCreate },
+  { "load",      setupSave, runLoad },
+  { "save",      NULL,      runSave },
+  { "loadinfo",  setupSave, runLoadInfo },
+  { "read",      setupRead, runRead },
+  { "readpad",   setupReadPadded, runRead },
+  { "readmem",   setupMemory, runReadMemory },
+  { "write",     setupWrite, runWrite },
+  { "writepad",  setupWritePadded, runWritePadded },
+  { "hash",      NULL,      runHash },
+  { "stats",     NULL,      runStats },
+  { "fullstats", NULL,      runFullStats },
+  { "regionsum", setupCopy, runRegionSum },
+  { "validrect", NULL,      runValidRect },
+  { "getpixel",  NULL,      runGetPixel },
+  { "setpixel",  setupCopy, runSetPixel },
+  { "neg",       setupCopy, runNegative },
+  { "cloneneg",  NULL,      runCloneNegative },
+  { "thr",       setupCopy, runThreshold },
+  { "bri",       setupCopy, runBrighten },
+  { "rotate",    NULL,      runRotate },
+  { "deskew",    NULL,      runDeskew },
+  { "mirror",    NULL,      runMirror },
+  { "crop",      NULL,      runCrop },
+  { "resize",    NULL,      runResize },
+  { "area",      NULL,      runResizeArea },
+  { "pyramid",   NULL,      runPyramid },
+  { "paste",     setupCopy, runPaste },
+  { "blend",     setupCopy, runBlend },
+  { "match",     NULL,      runMatch },
+  { "locate",    NULL,      runLocate },
+  { "plocate",   NULL,      runLocatePyramid },
+  { "blur",      setupCopy, runBlur },
+  { "blurupd",   setupBlurred, runBlurUpdate },
+  { "median",    setupCopy, runMedian },
+  { "gauss",     setupCopy, runGauss },
+  { "conv",      setupCopy, runConvolve },
+  { "erode",     setupCopy, runErode },
+  { "dilate",    setupCopy, runDilate },
+  { "open",      setupCopy, runOpen },
+  { "close",     setupCopy, runClose },
+};
+#define NOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// Check if name is in comma-separated list (NULL list means everything).
+static int inList(const char* list, const char* name) {
+  if (list == NULL) return 1;
+  size_t len = strlen(name);
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return 1;
+  }
+  return 0;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Value at percentile p (0..100) of sorted array t[0..n-1].
+static double percentile(const double* t, int n, double p) {
+  int i = (int)(p / 100.0 * (n - 1) + 0.5);
+  return t[i];
+}
+
+int main(int ac, char* av[]) {
+  const char* sizes = "256,1024,4096,16384";
+  const char* patList = NULL;
+  const char* opList = NULL;
+  int reps = 7;
+  int warmup = 1;
+  double budget = 2.0;
+  const char* threadList = "0";
+
+  int opt;
+  while ((opt = getopt(ac, av, "s:p:o:r:w:b:j:lh")) != -1) {
+    switch (opt) {
+    case 's': sizes = optarg; break;
+    case 'p': patList = optarg; break;
+    case 'o': opList = optarg; break;
+    case 'r': reps = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'b': budget = atof(optarg); break;
+    case 'j': threadList = optarg; break;
+    case 'l':
+      for (int i = 0; i < NOPS; i++) puts(ops[i].name);
+      return 0;
+    default:
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (reps < 1 || warmup < 0) error(1, 0, "Invalid repetitions");
+
+  ImageInit();
+
+  char tmpname[] = "/tmp/imageBenchXXXXXX";
+  int fd = mkstemp(tmpname);
+  if (fd < 0) error(2, errno, "%s", tmpname);
+  close(fd);
+
+  double* t = malloc(reps * sizeof(double));
+  assert(t != NULL);
+
+  printf("#%-9s %-8s %6s %4s %5s %12s %12s %12s %10s %8s\n",
+         "op", "pattern", "size", "thr", "reps", "min(s)", "median(s)", "p90(s)",
+         "MPix/s", "speedup");
+
+  for (const char* s = sizes; s != NULL; s = strchr(s, ',')) {
+    if (*s == ',') s++;
+    int size = atoi(s);
+    if (size < 16) error(1, 0, "Invalid size: %d", size);
+
+    for (int p = 0; p < NPATTERNS; p++) {
+      if (!inList(patList, patterns[p].name)) continue;
+
+      Bench b = { .size = size, .tmpname = tmpname };
+      b.src = ImageCreate(size, size, PixMax);
+      if (b.src == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+      patterns[p].fill(b.src);
+      int s16 = size / 16;
+      b.small = ImageCrop(b.src, (size - s16) / 2, (size - s16) / 2, s16, s16);
+      if (b.small == NULL) error(2, errno, "Cropping image: %s", ImageErrMsg());
+
+      for (int o = 0; o < NOPS; o++) {
+        if (!inList(opList, ops[o].name)) continue;
+        double base = 0.0;   // median time with the first thread count
+        for (const char* j = threadList; j != NULL; j = strchr(j, ',')) {
+          if (*j == ',') j++;
+          int threads = ImageSetThreads(atoi(j) > 0 ? atoi(j) : 0);
+          int n = 0;
+          double total = 0.0;
+          for (int r = 0; r < warmup + reps; r++) {
+            if (ops[o].setup != NULL) ops[o].setup(&b);
+            double t0 = wall_time();
+            ops[o].run(&b);
+            double dt = wall_time() - t0;
+            cleanup(&b);
+            // A single run over budget is enough: skip the warm-up.
+            if (r >= warmup || dt > budget) {
+              t[n++] = dt;
+              total += dt;
+              if (total > budget) break;
+            }
+          }
+          qsort(t, n, sizeof(double), cmpDouble);
+          double median = percentile(t, n, 50);
+          if (j == threadList) base = median;
+          printf(" %-9s %-8s %6d %4d %5d %12.6f %12.6f %12.6f %10.1f %8.2f\n",
+                 ops[o].name, patterns[p].name, size, threads, n,
+                 t[0], median, percentile(t, n, 90),
+                 (double)size * size / median / 1e6, base / median);
+          fflush(stdout);
+        }
+      }
+      ImageDestroy(&b.small);
+      ImageDestroy(&b.src);
+    }
+  }
+
+  free(t);
+  unlink(tmpname);
+  ImageDone();
+  return 0;
+}
@@ -0,0 +1,1236 @@
+// imageDiffTest - Randomized differential tester for the image8bit module.
+//
+// Every operation in image8bit may have fast paths (table lookups, SIMD,
+// tiling, threads) that must produce exactly the same bytes as a plain,
+// obviously correct implementation.  This program contains such reference
+// implementations, written only in terms of ImageGetPixel/ImageSetPixel,
+// runs both versions on thousands of random images and parameters, and
+// reports the first differing pixel.
+//
+// Sizes are deliberately skewed towards awkward cases: 1-pixel images,
+// odd widths, very thin images, and filter radii much larger than the image.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageDiffTest [OPTION...]\n"
+    "  Compare image8bit operations against reference implementations.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -n ITER         Number of random cases per operation  [2000]\n"
+    "  -s SEED         Random seed  [1]\n"
+    "  -m MAXSIZE      Maximum image width/height  [300]\n"
+    "  -o OP1,OP2,...  Operations to test  [all]\n"
+    "  -l              List operations and exit\n"
+    "\n"
+    ;
+
+// Small, fast and reproducible pseudo-random generator (xorshift32).
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+  uint32_t x = rng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rng_state = x;
+}
+
+// Random integer in [lo, hi].
+static int rnd(int lo, int hi) {
+  return lo + (int)(rng() % (uint32_t)(hi - lo + 1));
+}
+
+// Random double in [lo, hi).
+static double rndf(double lo, double hi) {
+  return lo + (hi - lo) * (rng() / 4294967296.0);
+}
+
+static int maxSize = 300;
+
+// Random image dimension, skewed towards small and odd values.
+static int rndDim(void) {
+  switch (rnd(0, 9)) {
+  case 0: return 1;
+  case 1: case 2: case 3: return rnd(1, 8);
+  case 4: case 5: case 6: return rnd(1, 70) | 1;
+  default: return rnd(1, maxSize);
+  }
+}
+
+// Create an image filled with random levels in [0, maxval].
+// Low maxvals are common, so that equal pixels (and matches) occur often.
+static Image rndImage(int w, int h) {
+  uint8 maxval = rnd(0, 3) == 0 ? (uint8)rnd(1, 3) : PixMax;
+  Image img = ImageCreate(w, h, maxval);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(img, x, y, (uint8)(rng() % (maxval + 1u)));
+  return img;
+}
+
+// Pixel-by-pixel copy.
+static Image copy(Image img) {
+  Image c = ImageCreate(ImageWidth(img), ImageHeight(img), ImageMaxval(img));
+  if (c == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(c, x, y, ImageGetPixel(img, x, y));
+  return c;
+}
+
+// Description of the current test case, for error messages.
+static char what[256];
+
+static int failures = 0;
+
+// Compare result img to reference ref.
+// Reports the first difference found (in raster order).
+static int same(Image img, Image ref) {
+  if (img == NULL) {
+    fprintf(stderr, "FAIL %s: returned NULL (%s)\n", what, ImageErrMsg());
+    failures++;
+    return 0;
+  }
+  if (ImageWidth(img) != ImageWidth(ref) || ImageHeight(img) != ImageHeight(ref)
+      || ImageMaxval(img) != ImageMaxval(ref)) {
+    fprintf(stderr, "FAIL %s: got %dx%d maxval %d, expected %dx%d maxval %d\n",
+            what, ImageWidth(img), ImageHeight(img), ImageMaxval(img),
+            ImageWidth(ref), ImageHeight(ref), ImageMaxval(ref));
+    failures++;
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(ref); y++) {
+    for (int x = 0; x < ImageWidth(ref); x++) {
+      uint8 a = ImageGetPixel(img, x, y);
+      uint8 b = ImageGetPixel(ref, x, y);
+      if (a != b) {
+        fprintf(stderr, "FAIL %s: first difference at (%d,%d): got %u, expected %u\n",
+                what, x, y, a, b);
+        failures++;
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static int sameInt(long got, long expected) {
+  if (got != expected) {
+    fprintf(stderr, "FAIL %s: got %ld, expected %ld\n", what, got, expected);
+    failures++;
+    return 0;
+  }
+  return 1;
+}
+
+// Compare doubles, with a relative tolerance (for results that may be
+// rounded differently, like sums computed in another order).
+static int sameDouble(double got, double expected) {
+  double tol = 1e-9 * (expected < 0 ? -expected : expected) + 1e-12;
+  if (got - expected > tol || expected - got > tol) {
+    fprintf(stderr, "FAIL %s: got %.17g, expected %.17g\n", what, got, expected);
+    failures++;
+    return 0;
+  }
+  return 1;
+}
+
+
+/// Reference implementations
+
+static void RefStats(Image img, uint8* min, uint8* max) {
+  *min = PixMax;
+  *max = 0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      if (v < *min) *min = v;
+      if (v > *max) *max = v;
+    }
+}
+
+static void RefFullStats(Image img, ImageStatistics* st) {
+  memset(st, 0, sizeof(*st));
+  RefStats(img, &st->min, &st->max);
+  double sum = 0.0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      st->hist[v]++;
+      st->count++;
+      sum += v;
+    }
+  if (st->count == 0) return;
+  st->mean = sum / st->count;
+  double ss = 0.0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) {
+      double d = ImageGetPixel(img, x, y) - st->mean;
+      ss += d * d;
+    }
+  st->variance = ss / st->count;
+}
+
+static uint64_t RefRegionSum(Image img, int x0, int y0, int w, int h) {
+  uint64_t sum = 0;
+  for (int y = y0; y < y0 + h; y++)
+    for (int x = x0; x < x0 + w; x++)
+      sum += ImageGetPixel(img, x, y);
+  return sum;
+}
+
+static int RefValidRect(Image img, int x, int y, int w, int h) {
+  for (int i = x; i < x + w; i++)
+    for (int j = y; j < y + h; j++)
+      if (!ImageValidPos(img, i, j)) return 0;
+  return 1;
+}
+
+// For coordinates far outside the image (where the loop above would
+// overflow or take forever): the same condition, in 64-bit arithmetic.
+static int RefValidRectWide(Image img, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return 1;
+  return x >= 0 && (long long)x + w <= ImageWidth(img) &&
+         y >= 0 && (long long)y + h <= ImageHeight(img);
+}
+
+static void RefNegative(Image img) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y, (uint8)(ImageMaxval(img) - ImageGetPixel(img, x, y)));
+}
+
+static void RefThreshold(Image img, uint8 thr) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y, ImageGetPixel(img, x, y) < thr ? 0 : ImageMaxval(img));
+}
+
+// Round and saturate to [0, maxval].
+static uint8 saturate(double v, int maxval) {
+  if (v < 0.0) return 0;
+  if (v > maxval) return (uint8)maxval;
+  return (uint8)v;
+}
+
+static void RefBrighten(Image img, double factor) {
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      ImageSetPixel(img, x, y,
+                    saturate(ImageGetPixel(img, x, y) * factor + 0.5, ImageMaxval(img)));
+}
+
+// 90 degrees counter-clockwise
+static Image RefRotate(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image r = ImageCreate(h, w, ImageMaxval(img));
+  for (int y = 0; y < w; y++)
+    for (int x = 0; x < h; x++)
+      ImageSetPixel(r, x, y, ImageGetPixel(img, w - 1 - y, x));
+  return r;
+}
+
+static Image RefMirror(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image r = ImageCreate(w, h, ImageMaxval(img));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(r, x, y, ImageGetPixel(img, w - 1 - x, y));
+  return r;
+}
+
+static Image RefCrop(Image img, int x0, int y0, int w, int h) {
+  Image r = ImageCreate(w, h, ImageMaxval(img));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(r, x, y, ImageGetPixel(img, x0 + x, y0 + y));
+  return r;
+}
+
+// Bilinear rotation, pixel by pixel: the same fixed-point source
+// coordinates (24 fraction bits, 8 used for the weights) as ImageRotateAngle.
+// Multiples of 90 degrees are RefRotate, 1 to 3 times.
+static Image RefRotateAngle(Image img, double degrees, uint8 fill) {
+  double r = fmod(degrees, 360.0);
+  if (r < 0.0) r += 360.0;
+  if (r >= 360.0) r = 0.0;
+  if (fmod(r, 90.0) == 0.0) {
+    Image res = RefCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+    for (int k = 0; k < (int)(r / 90.0); k++) {
+      Image tmp = RefRotate(res);
+      ImageDestroy(&res);
+      res = tmp;
+    }
+    return res;
+  }
+  int w = ImageWidth(img), h = ImageHeight(img);
+  double c = cos(r * M_PI / 180.0), s = sin(r * M_PI / 180.0);
+  int rw = (int)floor(w * fabs(c) + h * fabs(s) + 0.5);
+  int rh = (int)floor(w * fabs(s) + h * fabs(c) + 0.5);
+  Image res = ImageCreate(rw, rh, ImageMaxval(img));
+  const long long one = 1LL << 24;
+  double dx = 0.5 - rw / 2.0, dy = 0.5 - rh / 2.0;
+  long long u0 = llround(one * (w / 2.0 - 0.5 + dx * c - dy * s));
+  long long v0 = llround(one * (h / 2.0 - 0.5 + dx * s + dy * c));
+  long long cq = llround(one * c), sq = llround(one * s);
+  for (int y = 0; y < rh; y++) {
+    for (int x = 0; x < rw; x++) {
+      long long u = u0 + x * cq - y * sq;
+      long long v = v0 + x * sq + y * cq;
+      if (2 * u < -one || 2 * u >= (2LL * w - 1) * one
+          || 2 * v < -one || 2 * v >= (2LL * h - 1) * one) {
+        ImageSetPixel(res, x, y, fill);
+        continue;
+      }
+      // floor, with the fraction in 1/256, clamped at the borders
+      long long i = (long long)floor((double)u / one);
+      long long j = (long long)floor((double)v / one);
+      long long fx = i < 0 ? 0 : (u - i * one) * 256 / one;
+      long long fy = j < 0 ? 0 : (v - j * one) * 256 / one;
+      if (i < 0) i = 0;
+      if (j < 0) j = 0;
+      long long i1 = i + 1 < w ? i + 1 : i;
+      long long j1 = j + 1 < h ? j + 1 : j;
+      long long top = ImageGetPixel(img, i, j) * (256 - fx) + ImageGetPixel(img, i1, j) * fx;
+      long long bot = ImageGetPixel(img, i, j1) * (256 - fx) + ImageGetPixel(img, i1, j1) * fx;
+      ImageSetPixel(res, x, y, (uint8)((top * (256 - fy) + bot * fy + 32768) / 65536));
+    }
+  }
+  return res;
+}
+
+// Source coordinate of the center of pixel x of n (source size m), times
+// 256, rounded down, minus 1/2, clamped to [0, (m-1)*256].
+static long RefCenter(int x, int n, int m) {
+  long c = (long)((__int128)(2 * x + 1) * m * 256 / (2 * (__int128)n)) - 128;
+  return c < 0 ? 0 : c > (long)(m - 1) * 256 ? (long)(m - 1) * 256 : c;
+}
+
+static Image RefResize(Image img, int w, int h, int mode) {
+  int sw = ImageWidth(img), sh = ImageHeight(img);
+  Image r = ImageCreate(w, h, ImageMaxval(img));
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      long v;
+      if (mode == IMAGE_RESIZE_NEAREST) {
+        v = ImageGetPixel(img, (int)((2L * x + 1) * sw / (2L * w)), (int)((2L * y + 1) * sh / (2L * h)));
+      } else if (mode == IMAGE_RESIZE_BILINEAR) {
+        long cx = RefCenter(x, w, sw), cy = RefCenter(y, h, sh);
+        int x0 = cx / 256, y0 = cy / 256;
+        int x1 = x0 + 1 < sw ? x0 + 1 : x0, y1 = y0 + 1 < sh ? y0 + 1 : y0;
+        long fx = cx % 256, fy = cy % 256;
+        long top = ImageGetPixel(img, x0, y0) * (256 - fx) + ImageGetPixel(img, x1, y0) * fx;
+        long bot = ImageGetPixel(img, x0, y1) * (256 - fx) + ImageGetPixel(img, x1, y1) * fx;
+        v = (top * (256 - fy) + bot * fy + 32768) / 65536;
+      } else {
+        // Every source pixel, weighted by its overlap with the pixel
+        // (in units of 1/w horizontally, 1/h vertically)
+        long sum = 0;
+        for (int j = 0; j < sh; j++)
+          for (int i = 0; i < sw; i++) {
+            long ox = (i + 1L) * w < (x + 1L) * sw ? (i + 1L) * w : (x + 1L) * sw;
+            ox -= (long)i * w > (long)x * sw ? (long)i * w : (long)x * sw;
+            long oy = (j + 1L) * h < (y + 1L) * sh ? (j + 1L) * h : (y + 1L) * sh;
+            oy -= (long)j * h > (long)y * sh ? (long)j * h : (long)y * sh;
+            if (ox > 0 && oy > 0) sum += ox * oy * ImageGetPixel(img, i, j);
+          }
+        long area = (long)sw * sh;
+        v = (sum + area / 2) / area;
+      }
+      ImageSetPixel(r, x, y, (uint8)v);
+    }
+  return r;
+}
+
+// Mean of each 2x2 block (of fewer pixels at an odd last row or column).
+static Image RefHalve(Image img) {
+  int sw = ImageWidth(img), sh = ImageHeight(img);
+  Image r = ImageCreate((sw + 1) / 2, (sh + 1) / 2, ImageMaxval(img));
+  for (int y = 0; y < ImageHeight(r); y++)
+    for (int x = 0; x < ImageWidth(r); x++) {
+      int sum = 0, count = 0;
+      for (int j = 2 * y; j < 2 * y + 2 && j < sh; j++)
+        for (int i = 2 * x; i < 2 * x + 2 && i < sw; i++) {
+          sum += ImageGetPixel(img, i, j);
+          count++;
+        }
+      ImageSetPixel(r, x, y, (uint8)((sum + count / 2) / count));
+    }
+  return r;
+}
+
+static void RefPaste(Image img1, int x0, int y0, Image img2) {
+  for (int y = 0; y < ImageHeight(img2); y++)
+    for (int x = 0; x < ImageWidth(img2); x++)
+      ImageSetPixel(img1, x0 + x, y0 + y, ImageGetPixel(img2, x, y));
+}
+
+static void RefBlend(Image img1, int x0, int y0, Image img2, double alpha) {
+  for (int y = 0; y < ImageHeight(img2); y++)
+    for (int x = 0; x < ImageWidth(img2); x++) {
+      double v = ImageGetPixel(img1, x0 + x, y0 + y) * (1 - alpha)
+               + ImageGetPixel(img2, x, y) * alpha + 0.5;
+      ImageSetPixel(img1, x0 + x, y0 + y, saturate(v, ImageMaxval(img1)));
+    }
+}
+
+static int RefMatchSubImage(Image img1, int x0, int y0, Image img2) {
+  for (int y = 0; y < ImageHeight(img2); y++)
+    for (int x = 0; x < ImageWidth(img2); x++)
+      if (ImageGetPixel(img1, x0 + x, y0 + y) != ImageGetPixel(img2, x, y))
+        return 0;
+  return 1;
+}
+
+// First match in raster order
+static int RefLocateSubImage(Image img1, int* px, int* py, Image img2) {
+  for (int y = 0; y + ImageHeight(img2) <= ImageHeight(img1); y++)
+    for (int x = 0; x + ImageWidth(img2) <= ImageWidth(img1); x++)
+      if (RefMatchSubImage(img1, x, y, img2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+  return 0;
+}
+
+// Mean over the window clipped to the image.
+// (Uses a summed-area table so that huge radii remain affordable.)
+static void RefBlur(Image img, int dx, int dy) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  long* s = calloc((size_t)(w + 1) * (h + 1), sizeof(long));
+  assert(s != NULL);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      s[(y+1)*(w+1) + x+1] = ImageGetPixel(img, x, y)
+          + s[y*(w+1) + x+1] + s[(y+1)*(w+1) + x] - s[y*(w+1) + x];
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int x0 = x - dx < 0 ? 0 : x - dx;
+      int x1 = x + dx >= w ? w - 1 : x + dx;
+      int y0 = y - dy < 0 ? 0 : y - dy;
+      int y1 = y + dy >= h ? h - 1 : y + dy;
+      long sum = s[(y1+1)*(w+1) + x1+1] - s[y0*(w+1) + x1+1]
+               - s[(y1+1)*(w+1) + x0] + s[y0*(w+1) + x0];
+      long count = (long)(x1 - x0 + 1) * (y1 - y0 + 1);
+      ImageSetPixel(img, x, y, (uint8)((sum + count * 0.5) / count));
+    }
+  free(s);
+}
+
+// Lower median of the window clipped to the image, from its histogram.
+static void RefMedian(Image img, int dx, int dy) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image src = copy(img);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int x0 = x - dx < 0 ? 0 : x - dx;
+      int x1 = x + dx >= w ? w - 1 : x + dx;
+      int y0 = y - dy < 0 ? 0 : y - dy;
+      int y1 = y + dy >= h ? h - 1 : y + dy;
+      long hist[256] = { 0 };
+      long count = 0;
+      for (int yy = y0; yy <= y1; yy++)
+        for (int xx = x0; xx <= x1; xx++) {
+          hist[ImageGetPixel(src, xx, yy)]++;
+          count++;
+        }
+      long rank = (count + 1) / 2;
+      int v = 0;
+      for (long cum = hist[0]; cum < rank; cum += hist[++v]) {}
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  ImageDestroy(&src);
+}
+
+// Minimum (max == 0) or maximum (max == 1) of the window clipped to the image.
+static void RefMorph(Image img, int dx, int dy, int max) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image src = copy(img);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int x0 = x - dx < 0 ? 0 : x - dx;
+      int x1 = x + dx >= w ? w - 1 : x + dx;
+      int y0 = y - dy < 0 ? 0 : y - dy;
+      int y1 = y + dy >= h ? h - 1 : y + dy;
+      int m = ImageGetPixel(src, x0, y0);
+      for (int yy = y0; yy <= y1; yy++)
+        for (int xx = x0; xx <= x1; xx++) {
+          int v = ImageGetPixel(src, xx, yy);
+          if (max ? v > m : v < m) m = v;
+        }
+      ImageSetPixel(img, x, y, (uint8)m);
+    }
+  ImageDestroy(&src);
+}
+
+// Taps in fixed point, multiples of 1/4096, with the rounding error of the
+// sum added to the center tap.  Returns the sum.
+static long RefQuantize(long* q, const double* k, int n) {
+  double sum = 0.0;
+  long qsum = 0;
+  for (int i = 0; i < n; i++) {
+    q[i] = lround(k[i] * 4096);
+    sum += k[i];
+    qsum += q[i];
+  }
+  q[n/2] += llround(sum * 4096) - qsum;
+  return llround(sum * 4096);
+}
+
+// round(v*num/den), halves away from zero.
+static __int128 RefScale(__int128 v, long num, long in) {
+  if (in == 0 || num == 0 || in == num) return v;
+  v *= num;
+  if (in < 0) { v = -v; in = -in; }
+  return v >= 0 ? (v + in/2) / in : -((-v + in/2) / in);
+}
+
+// Horizontal, then vertical sums of the taps that fall inside the image,
+// each rescaled by (sum of taps)/(sum of taps inside); the horizontal sums
+// saturate to 32 bits.
+static void RefConvolve(Image img, const double* kx, int nkx, const double* ky, int nky) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  long qx[nkx], qy[nky];
+  long sx = RefQuantize(qx, kx, nkx);
+  long sy = RefQuantize(qy, ky, nky);
+  long* hs = malloc((size_t)w * h * sizeof(long));
+  assert(hs != NULL);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      long sum = 0, in = 0;
+      for (int i = 0; i < nkx; i++) {
+        int xx = x + i - nkx/2;
+        if (xx < 0 || xx >= w) continue;
+        sum += qx[i] * ImageGetPixel(img, xx, y);
+        in += qx[i];
+      }
+      __int128 v = RefScale(sum, sx, in);
+      hs[(size_t)y*w + x] = v > INT32_MAX ? INT32_MAX : v < -INT32_MAX ? -INT32_MAX : (long)v;
+    }
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      __int128 sum = 0;
+      long in = 0;
+      for (int j = 0; j < nky; j++) {
+        int yy = y + j - nky/2;
+        if (yy < 0 || yy >= h) continue;
+        sum += (__int128)qy[j] * hs[(size_t)yy*w + x];
+        in += qy[j];
+      }
+      sum = RefScale(sum, sy, in);
+      // 24 fraction bits: round halves up
+      __int128 v = sum + (1 << 23);
+      v = v >= 0 ? v / (1 << 24) : -((-v + (1 << 24) - 1) / (1 << 24));
+      if (v < 0) v = 0;
+      if (v > ImageMaxval(img)) v = ImageMaxval(img);
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  free(hs);
+}
+
+
+/// Test cases
+/// Each one runs a single random case and returns nonzero on success.
+
+static int testCreate(void) {
+  int w = rndDim(), h = rndDim();
+  sprintf(what, "create %dx%d", w, h);
+  Image img = ImageCreate(w, h, PixMax);
+  Image ref = ImageCreate(w, h, PixMax);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(ref, x, y, 0);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static char tmpname[] = "/tmp/imageDiffTestXXXXXX";
+
+static int testLoadSave(void) {
+  Image ref = rndImage(rndDim(), rndDim());
+  sprintf(what, "save+load %dx%d", ImageWidth(ref), ImageHeight(ref));
+  int ok = sameInt(ImageSave(ref, tmpname) != 0, 1);
+  if (ok) {
+    Image img = ImageLoad(tmpname);
+    ok = same(img, ref);
+    ImageDestroy(&img);
+  }
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testStats(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  sprintf(what, "stats %dx%d", ImageWidth(img), ImageHeight(img));
+  uint8 min, max, rmin, rmax;
+  ImageStats(img, &min, &max);
+  RefStats(img, &rmin, &rmax);
+  int ok = sameInt(min, rmin) && sameInt(max, rmax);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static Image rndInside(Image img1, int* x, int* y);   // (see below)
+
+// Random change to img: usually small (a few pixels, a paste or a blend),
+// sometimes to the whole image.
+static void rndChange(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int x, y;
+  Image img2;
+  switch (rnd(0, 5)) {
+  case 0: case 1:
+    for (int n = rnd(1, 20); n > 0; n--)
+      ImageSetPixel(img, rnd(0, w - 1), rnd(0, h - 1), (uint8)rnd(0, ImageMaxval(img)));
+    break;
+  case 2: case 3:
+    img2 = rndInside(img, &x, &y);
+    if (rnd(0, 1)) ImagePaste(img, x, y, img2);
+    else ImageBlend(img, x, y, img2, rndf(0.0, 1.0));
+    ImageDestroy(&img2);
+    break;
+  case 4: ImageNegative(img); break;
+  default: ImageBlur(img, rnd(0, 3), rnd(0, 3)); break;
+  }
+}
+
+// Statistics between random changes to the image: each must count the
+// pixels as they are (not stale band histograms).
+static int testFullStats(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int ok = 1;
+  for (int k = 0; ok && k < 3; k++) {
+    sprintf(what, "fullstats %dx%d step %d", ImageWidth(img), ImageHeight(img), k);
+    ImageStatistics st, ref;
+    ImageFullStats(img, &st);
+    RefFullStats(img, &ref);
+    ok = sameInt((long)st.count, (long)ref.count) &&
+         sameInt(st.min, ref.min) && sameInt(st.max, ref.max) &&
+         sameDouble(st.mean, ref.mean) && sameDouble(st.variance, ref.variance);
+    for (int v = 0; ok && v < 256; v++) {
+      ok = sameInt((long)st.hist[v], (long)ref.hist[v]);
+    }
+    rndChange(img);
+    if (ok) {  // ImageStats, from the band histograms
+      uint8 min, max;
+      ImageStats(img, &min, &max);
+      RefStats(img, &ref.min, &ref.max);
+      ok = sameInt(min, ref.min) && sameInt(max, ref.max);
+    }
+  }
+  ImageDestroy(&img);
+  return ok;
+}
+
+// Sums of random rectangles, between random changes to the image: each sum
+// must see the pixels as they are (not a stale integral image).
+static int testRegionSum(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int ok = 1;
+  for (int k = 0; ok && k < 4; k++) {
+    int x = rnd(0, w - 1), y = rnd(0, h - 1);
+    int rw = rnd(0, w - x), rh = rnd(0, h - y);
+    sprintf(what, "regionsum %dx%d (%d,%d,%d,%d) step %d", w, h, x, y, rw, rh, k);
+    ok = sameInt((long)ImageRegionSum(img, x, y, rw, rh), (long)RefRegionSum(img, x, y, rw, rh));
+    rndChange(img);
+  }
+  ImageDestroy(&img);
+  return ok;
+}
+
+// Every pixel changed since the image was marked clean must be inside
+// one of its dirty rectangles.
+static int testDirty(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image old = copy(img);
+  ImageMarkClean(img);
+  int steps = rnd(1, 30);
+  for (int k = 0; k < steps; k++) rndChange(img);
+  ImageRect r[IMAGE_DIRTY_MAX];
+  int n = ImageDirtyRects(img, r);
+  sprintf(what, "dirty %dx%d %d changes, %d rects", ImageWidth(img), ImageHeight(img), steps, n);
+  int ok = 1;
+  for (int y = 0; ok && y < ImageHeight(img); y++)
+    for (int x = 0; ok && x < ImageWidth(img); x++) {
+      if (ImageGetPixel(img, x, y) == ImageGetPixel(old, x, y)) continue;
+      int in = 0;
+      for (int i = 0; i < n; i++)
+        in |= r[i].x <= x && x < r[i].x + r[i].w && r[i].y <= y && y < r[i].y + r[i].h;
+      ok = sameInt(in, 1);
+    }
+  ImageDestroy(&img);
+  ImageDestroy(&old);
+  return ok;
+}
+
+// Change img by operation op, with operands a and b (and src, of the same
+// size, to paste): the same change leaves equal images equal.
+static void cloneChange(Image img, Image src, int op, int a, int b) {
+  switch (op) {
+  case 0: ImageSetPixel(img, a % ImageWidth(img), b % ImageHeight(img), (uint8)a); break;
+  case 1: ImageNegative(img); break;
+  case 2: ImageThreshold(img, (uint8)a); break;
+  case 3: ImageBrighten(img, b / 4.0); break;
+  case 4: ImagePaste(img, 0, 0, src); break;
+  case 5: ImageBlur(img, a % 4, b % 4); break;
+  case 6: ImageMedian(img, a % 3, b % 3); break;
+  default: ImageErode(img, a % 3, b % 3); break;
+  }
+}
+
+// Clones (and clones of clones) changed in random order: each must change
+// alone, and all must survive the others being destroyed.
+static int testClone(void) {
+  enum { N = 4 };
+  Image img[N], ref[N];
+  img[0] = rndImage(rndDim(), rndDim());
+  ref[0] = copy(img[0]);
+  for (int i = 1; i < N; i++) {
+    int j = rnd(0, i - 1);
+    img[i] = ImageClone(img[j]);
+    ref[i] = copy(ref[j]);
+  }
+  int w = ImageWidth(img[0]), h = ImageHeight(img[0]);
+  int steps = rnd(1, 8);
+  int ok = 1;
+  for (int k = 0; ok && k < steps; k++) {
+    int i = rnd(0, N - 1), j = rnd(0, N - 1);
+    int op = rnd(0, 7), a = rnd(0, 255), b = rnd(0, 8);
+    sprintf(what, "clone %dx%d step %d: op %d (%d,%d) on %d from %d", w, h, k, op, a, b, i, j);
+    if (w == 0 || h == 0) op = 1;
+    cloneChange(img[i], img[j], op, a, b);
+    cloneChange(ref[i], ref[j], op, a, b);
+    for (int c = 0; ok && c < N; c++) ok = same(img[c], ref[c]);
+    if (ok && rnd(0, 3) == 0) {   // (a clone destroyed, and replaced by a new one)
+      int c = rnd(0, N - 1);
+      ImageDestroy(&img[c]);
+      img[c] = ImageClone(img[(c + 1) % N]);
+      ImageDestroy(&ref[c]);
+      ref[c] = copy(ref[(c + 1) % N]);
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    ImageDestroy(&img[rnd(0, 1) ? i : N - 1 - i]);
+    ImageDestroy(&ref[i]);
+  }
+  for (int i = 0; i < N; i++) ImageDestroy(&img[i]);
+  return ok;
+}
+
+static int testValidRect(void) {
+  Image img = ImageCreate(rndDim(), rndDim(), PixMax);
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int x = rnd(-3, w + 2), y = rnd(-3, h + 2);
+  int rw = rnd(-3, w + 3), rh = rnd(-3, h + 3);
+  int wide = rnd(0, 3) == 0;
+  if (wide) {
+    // Replace some values by extremes (x+w, y+h overflow an int)
+    static const int extreme[] = { INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX - 1, INT_MAX };
+    int* v[] = { &x, &y, &rw, &rh };
+    for (int i = 0; i < 4; i++)
+      if (rnd(0, 1)) *v[i] = extreme[rnd(0, 6)];
+  }
+  sprintf(what, "validrect %dx%d (%d,%d,%d,%d)", w, h, x, y, rw, rh);
+  int ok = sameInt(ImageValidRect(img, x, y, rw, rh),
+                   wide ? RefValidRectWide(img, x, y, rw, rh) : RefValidRect(img, x, y, rw, rh));
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testNegative(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image ref = copy(img);
+  sprintf(what, "neg %dx%d maxval %d", ImageWidth(img), ImageHeight(img), ImageMaxval(img));
+  ImageNegative(img);
+  RefNegative(ref);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testThreshold(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image ref = copy(img);
+  uint8 thr = (uint8)rnd(0, 255);
+  sprintf(what, "thr %u %dx%d", thr, ImageWidth(img), ImageHeight(img));
+  ImageThreshold(img, thr);
+  RefThreshold(ref, thr);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testBrighten(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image ref = copy(img);
+  double factor = rnd(0, 4) == 0 ? rnd(0, 3) : rndf(0.0, 3.0);
+  sprintf(what, "bri %g %dx%d", factor, ImageWidth(img), ImageHeight(img));
+  ImageBrighten(img, factor);
+  RefBrighten(ref, factor);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testRotate(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  sprintf(what, "rotate %dx%d", ImageWidth(img), ImageHeight(img));
+  Image res = ImageRotate(img);
+  Image ref = RefRotate(img);
+  int ok = same(res, ref);
+  ImageDestroy(&res);
+  ImageDestroy(&ref);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testMirror(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  sprintf(what, "mirror %dx%d", ImageWidth(img), ImageHeight(img));
+  Image res = ImageMirror(img);
+  Image ref = RefMirror(img);
+  int ok = same(res, ref);
+  ImageDestroy(&res);
+  ImageDestroy(&ref);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testRotateAngle(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  double degrees;
+  switch (rnd(0, 3)) {
+  case 0: degrees = 90.0 * rnd(-8, 8); break;   // exact
+  case 1: degrees = rndf(-5.0, 5.0); break;      // deskewing
+  default: degrees = rndf(-720.0, 720.0); break;
+  }
+  uint8 fill = (uint8)rnd(0, ImageMaxval(img));
+  sprintf(what, "turn %dx%d %.17g,%d", ImageWidth(img), ImageHeight(img), degrees, fill);
+  Image res = ImageRotateAngle(img, degrees, fill);
+  Image ref = RefRotateAngle(img, degrees, fill);
+  int ok = same(res, ref);
+  ImageDestroy(&res);
+  ImageDestroy(&ref);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testCrop(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int x = rnd(0, w - 1), y = rnd(0, h - 1);
+  int cw = rnd(0, w - x), ch = rnd(0, h - y);
+  sprintf(what, "crop %dx%d (%d,%d,%d,%d)", w, h, x, y, cw, ch);
+  Image res = ImageCrop(img, x, y, cw, ch);
+  Image ref = RefCrop(img, x, y, cw, ch);
+  int ok = same(res, ref);
+  ImageDestroy(&res);
+  ImageDestroy(&ref);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testResize(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int w = rndDim(), h = rndDim();
+  if (rnd(0, 9) == 0) { w = 0; }
+  int mode = rnd(0, 2);
+  if (mode == IMAGE_RESIZE_AREA) {   // the reference is slow
+    w = 1 + w % 60;
+    h = 1 + h % 60;
+  }
+  static const char* names[] = { "nearest", "bilinear", "area" };
+  sprintf(what, "resize %dx%d to %dx%d %s", ImageWidth(img), ImageHeight(img), w, h, names[mode]);
+  Image res = ImageResize(img, w, h, mode);
+  Image ref = RefResize(img, w, h, mode);
+  int ok = same(res, ref);
+  ImageDestroy(&res);
+  ImageDestroy(&ref);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static int testPyramid(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image levels[12];
+  int max = rnd(1, 12);
+  sprintf(what, "pyramid %dx%d %d", ImageWidth(img), ImageHeight(img), max);
+  int n = ImageBuildPyramid(img, levels, max);
+  int ok = n >= 1 && same(levels[0], img);
+  Image ref = RefHalve(img);
+  for (int i = 1; ok && i < max; i++) {
+    if (ImageWidth(levels[i-1]) == 1 && ImageHeight(levels[i-1]) == 1) {
+      ok = sameInt(n, i);   // stops after a 1x1 level
+      break;
+    }
+    ok = sameInt(n > i, 1) && same(levels[i], ref);
+    Image next = RefHalve(ref);
+    ImageDestroy(&ref);
+    ref = next;
+  }
+  ImageDestroy(&ref);
+  for (int i = 0; i < n; i++) ImageDestroy(&levels[i]);
+  ImageDestroy(&img);
+  return ok;
+}
+
+// Random img2 that fits inside img1 at random position (*x, *y).
+static Image rndInside(Image img1, int* x, int* y) {
+  int w = ImageWidth(img1), h = ImageHeight(img1);
+  Image img2 = rndImage(rnd(1, w), rnd(1, h));
+  *x = rnd(0, w - ImageWidth(img2));
+  *y = rnd(0, h - ImageHeight(img2));
+  return img2;
+}
+
+static int testPaste(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int x, y;
+  Image img2 = rndInside(img, &x, &y);
+  Image ref = copy(img);
+  sprintf(what, "paste %dx%d at %dx%d (%d,%d)", ImageWidth(img2), ImageHeight(img2),
+          ImageWidth(img), ImageHeight(img), x, y);
+  ImagePaste(img, x, y, img2);
+  RefPaste(ref, x, y, img2);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&img2);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testBlend(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int x, y;
+  Image img2 = rndInside(img, &x, &y);
+  Image ref = copy(img);
+  double alpha = rnd(0, 3) == 0 ? rndf(-1.0, 2.0) : rndf(0.0, 1.0);
+  sprintf(what, "blend %dx%d at %dx%d (%d,%d) alpha %g", ImageWidth(img2), ImageHeight(img2),
+          ImageWidth(img), ImageHeight(img), x, y, alpha);
+  ImageBlend(img, x, y, img2, alpha);
+  RefBlend(ref, x, y, img2, alpha);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&img2);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testMatch(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int x, y;
+  Image img2;
+  if (rnd(0, 1)) {  // a subimage that certainly matches somewhere
+    Image tmp = rndInside(img, &x, &y);
+    img2 = RefCrop(img, x, y, ImageWidth(tmp), ImageHeight(tmp));
+    ImageDestroy(&tmp);
+  } else {
+    img2 = rndInside(img, &x, &y);
+  }
+  x = rnd(0, ImageWidth(img) - ImageWidth(img2));
+  y = rnd(0, ImageHeight(img) - ImageHeight(img2));
+  sprintf(what, "match %dx%d at %dx%d (%d,%d)", ImageWidth(img2), ImageHeight(img2),
+          ImageWidth(img), ImageHeight(img), x, y);
+  int ok = sameInt(ImageMatchSubImage(img, x, y, img2), RefMatchSubImage(img, x, y, img2));
+  ImageDestroy(&img);
+  ImageDestroy(&img2);
+  return ok;
+}
+
+static int testLocate(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int x, y;
+  Image img2 = rndInside(img, &x, &y);
+  if (rnd(0, 3) != 0) {  // usually, a subimage that certainly matches
+    Image tmp = img2;
+    img2 = RefCrop(img, x, y, ImageWidth(tmp), ImageHeight(tmp));
+    ImageDestroy(&tmp);
+  }
+  sprintf(what, "locate %dx%d in %dx%d", ImageWidth(img2), ImageHeight(img2),
+          ImageWidth(img), ImageHeight(img));
+  int px = -1, py = -1, rx = -1, ry = -1;
+  int found = ImageLocateSubImage(img, &px, &py, img2);
+  int ok = sameInt(found, RefLocateSubImage(img, &rx, &ry, img2))
+        && sameInt(px, rx) && sameInt(py, ry);
+  if (ok && rnd(0, 1)) {  // again, after pasting img2 somewhere else
+    x = rnd(0, ImageWidth(img) - ImageWidth(img2));
+    y = rnd(0, ImageHeight(img) - ImageHeight(img2));
+    ImagePaste(img, x, y, img2);
+    strcat(what, " after paste");
+    found = ImageLocateSubImage(img, &px, &py, img2);
+    ok = sameInt(found, RefLocateSubImage(img, &rx, &ry, img2))
+      && sameInt(px, rx) && sameInt(py, ry);
+  }
+  ImageDestroy(&img);
+  ImageDestroy(&img2);
+  return ok;
+}
+
+// Any match will do: it must exist if, and only if, the reference finds one.
+static int testLocatePyramid(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  if (rnd(0, 1)) RefBlur(img, rnd(1, 3), rnd(1, 3));   // smooth, like photos
+  int x, y;
+  Image img2 = rndInside(img, &x, &y);
+  if (rnd(0, 3) != 0) {  // usually, a subimage that certainly matches
+    Image tmp = img2;
+    img2 = RefCrop(img, x, y, ImageWidth(tmp), ImageHeight(tmp));
+    ImageDestroy(&tmp);
+  }
+  sprintf(what, "plocate %dx%d in %dx%d", ImageWidth(img2), ImageHeight(img2),
+          ImageWidth(img), ImageHeight(img));
+  int px = -1, py = -1, rx = -1, ry = -1;
+  int found = ImageLocateSubImagePyramid(img, &px, &py, img2);
+  int ok = sameInt(found, RefLocateSubImage(img, &rx, &ry, img2))
+        && (!found || sameInt(RefMatchSubImage(img, px, py, img2), 1));
+  ImageDestroy(&img);
+  ImageDestroy(&img2);
+  return ok;
+}
+
+static int testBlur(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image ref = copy(img);
+  int dx, dy;
+  if (rnd(0, 4) == 0) {  // huge radii
+    dx = rnd(0, 3 * maxSize);
+    dy = rnd(0, 3 * maxSize);
+  } else {
+    dx = rnd(0, 9);
+    dy = rnd(0, 9);
+  }
+  sprintf(what, "blur %d,%d %dx%d", dx, dy, ImageWidth(img), ImageHeight(img));
+  ImageBlur(img, dx, dy);
+  RefBlur(ref, dx, dy);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+// Incremental blur after random changes, against a full blur.
+static int testBlurUpdate(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  int dx = rnd(0, 9), dy = rnd(0, 9);
+  Image blurred = copy(img);
+  ImageBlur(blurred, dx, dy);
+  ImageMarkClean(img);
+  int steps = rnd(1, 4);
+  for (int k = 0; k < steps; k++) rndChange(img);
+  sprintf(what, "blurupdate %d,%d %dx%d %d changes", dx, dy, ImageWidth(img), ImageHeight(img), steps);
+  ImageBlurUpdate(img, blurred, dx, dy);
+  Image ref = copy(img);
+  RefBlur(ref, dx, dy);
+  int ok = same(blurred, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&blurred);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testMedian(void) {
+  int w = rndDim(), h = rndDim();
+  int dx, dy;
+  int kind = rnd(0, 4);
+  if (kind == 0) {  // huge radii (on small images: the reference is slow)
+    w = 1 + w % 40;
+    h = 1 + h % 40;
+    dx = rnd(0, 3 * maxSize);
+    dy = rnd(0, 3 * maxSize);
+  } else if (kind == 1) {  // medium radii
+    w = 1 + w % 100;
+    h = 1 + h % 100;
+    dx = rnd(5, 30);
+    dy = rnd(5, 30);
+  } else {
+    dx = rnd(0, 4);
+    dy = rnd(0, 4);
+  }
+  Image img = rndImage(w, h);
+  Image ref = copy(img);
+  sprintf(what, "median %d,%d %dx%d", dx, dy, w, h);
+  ImageMedian(img, dx, dy);
+  RefMedian(ref, dx, dy);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static int testMorph(void) {
+  int w = rndDim(), h = rndDim();
+  int dx, dy;
+  if (rnd(0, 4) == 0) {  // huge radii (on small images: the reference is slow)
+    w = 1 + w % 40;
+    h = 1 + h % 40;
+    dx = rnd(0, 3 * maxSize);
+    dy = rnd(0, 3 * maxSize);
+  } else {
+    dx = rnd(0, 6);
+    dy = rnd(0, 6);
+  }
+  Image img = rndImage(w, h);
+  Image ref = copy(img);
+  int op = rnd(0, 3);
+  static const char* names[] = { "erode", "dilate", "open", "close" };
+  sprintf(what, "%s %d,%d %dx%d", names[op], dx, dy, w, h);
+  switch (op) {
+  case 0: ImageErode(img, dx, dy); RefMorph(ref, dx, dy, 0); break;
+  case 1: ImageDilate(img, dx, dy); RefMorph(ref, dx, dy, 1); break;
+  case 2: ImageOpen(img, dx, dy); RefMorph(ref, dx, dy, 0); RefMorph(ref, dx, dy, 1); break;
+  case 3: ImageClose(img, dx, dy); RefMorph(ref, dx, dy, 1); RefMorph(ref, dx, dy, 0); break;
+  }
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+// Random kernel of n taps: normalized, integer, sharpening or zero-sum.
+static void rndKernel(double* k, int n) {
+  int kind = rnd(0, 3);
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) {
+    switch (kind) {
+    case 0: k[i] = rndf(0.0, 1.0); break;
+    case 1: k[i] = rnd(0, 4); break;
+    default: k[i] = rndf(-1.0, 1.0); break;
+    }
+    sum += k[i];
+  }
+  if (kind == 0 && sum > 0.0)
+    for (int i = 0; i < n; i++) k[i] /= sum;
+  if (kind == 3)   // zero sum (no rescaling at the borders)
+    k[n/2] -= sum;
+}
+
+static int testConvolve(void) {
+  Image img = rndImage(rndDim(), rndDim());
+  Image ref = copy(img);
+  int nkx = rnd(0, 4) == 0 ? rnd(1, 41) : rnd(1, 9);
+  int nky = rnd(0, 4) == 0 ? rnd(1, 41) : rnd(1, 9);
+  double kx[nkx], ky[nky];
+  rndKernel(kx, nkx);
+  rndKernel(ky, nky);
+  sprintf(what, "conv %dx%d taps %dx%d", nkx, nky, ImageWidth(img), ImageHeight(img));
+  ImageConvolveSeparable(img, kx, nkx, ky, nky);
+  RefConvolve(ref, kx, nkx, ky, nky);
+  int ok = same(img, ref);
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+  return ok;
+}
+
+static const struct {
+  const char* name;
+  int (*test)(void);
+} tests[] = {
+  { "create",    testCreate },
+  { "loadsave",  testLoadSave },
+  { "stats",     testStats },
+  { "fullstats", testFullStats },
+  { "regionsum", testRegionSum },
+  { "dirty",     testDirty },
+  { "clone",     testClone },
+  { "validrect", testValidRect },
+  { "neg",       testNegative },
+  { "thr",       testThreshold },
+  { "bri",       testBrighten },
+  { "rotate",    testRotate },
+  { "mirror",    testMirror },
+  { "turn",      testRotateAngle },
+  { "crop",      testCrop },
+  { "resize",    testResize },
+  { "pyramid",   testPyramid },
+  { "paste",     testPaste },
+  { "blend",     testBlend },
+  { "match",     testMatch },
+  { "locate",    testLocate },
+  { "plocate",   testLocatePyramid },
+  { "blur",      testBlur },
+  { "blurupdate", testBlurUpdate },
+  { "conv",      testConvolve },
+  { "median",    testMedian },
+  { "morph",     testMorph },
+};
+#define NTESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+// Check if name is in comma-separated list (NULL list means everything).
+static int inList(const char* list, const char* name) {
+  if (list == NULL) return 1;
+  size_t len = strlen(name);
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return 1;
+  }
+  return 0;
+}
+
+int main(int ac, char* av[]) {
+  int iter = 2000;
+  const char* opList = NULL;
+
+  int opt;
+  while ((opt = getopt(ac, av, "n:s:m:o:lh")) != -1) {
+    switch (opt) {
+    case 'n': iter = atoi(optarg); break;
+    case 's': rng_state = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'm': maxSize = atoi(optarg); break;
+    case 'o': opList = optarg; break;
+    case 'l':
+      for (int i = 0; i < NTESTS; i++) puts(tests[i].name);
+      return 0;
+    default:
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (rng_state == 0 || maxSize < 1) error(1, 0, "\n%s", USAGE);
+
+  ImageInit();
+
+  int fd = mkstemp(tmpname);
+  if (fd < 0) error(2, errno, "%s", tmpname);
+  close(fd);
+
+  for (int t = 0; t < NTESTS; t++) {
+    if (!inList(opList, tests[t].name)) continue;
+    int before = failures;
+    int i;
+    for (i = 0; i < iter; i++) {
+      if (!tests[t].test()) break;  // report only the first failure
+    }
+    printf("%-10s %s (%d cases)\n", tests[t].name,
+           failures > before ? "FAIL" : "ok", i + (failures > before));
+  }
+
+  unlink(tmpname);
+  ImageDone();
+  if (failures > 0) {
+    printf("%d operation(s) FAILED\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,240 @@
+/// imageKernels - Low-level pixel kernels with runtime CPU dispatch.
+///
+/// See imageKernels.h.
+
+#include "imageKernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Table lookups do not vectorize (there are no byte gathers),
+// so a single scalar version serves every level.
+
+static void lookup(uint8_t* restrict p, size_t n, const uint8_t* restrict lut) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = lut[p[i]];
+}
+
+static void lookup2(uint8_t* restrict dst, const uint8_t* restrict src, size_t n,
+                    const uint8_t* restrict lut2) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = lut2[dst[i] << 8 | src[i]];
+}
+
+// Histograms do not vectorize either (scattered increments).
+// What limits them is the chain of increments of the same bin, each of
+// which must wait for the store of the previous one (runs of equal pixels
+// are common); consecutive pixels are counted in 4 separate sub-histograms
+// to break that chain.  Pixels are loaded 8 at a time.
+static void histogram(const uint8_t* restrict p, size_t n, uint32_t* restrict sub) {
+  uint32_t* h0 = sub;
+  uint32_t* h1 = sub + 256;
+  uint32_t* h2 = sub + 512;
+  uint32_t* h3 = sub + 768;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    h0[v & 0xff]++;
+    h1[(v >> 8) & 0xff]++;
+    h2[(v >> 16) & 0xff]++;
+    h3[(v >> 24) & 0xff]++;
+    h0[(v >> 32) & 0xff]++;
+    h1[(v >> 40) & 0xff]++;
+    h2[(v >> 48) & 0xff]++;
+    h3[v >> 56]++;
+  }
+  for (; i < n; i++)
+    sub[(i & 3) * 256 + p[i]]++;
+}
+
+// Is the span p[0..n-1] aligned to, and a multiple of, the vector size?
+#define KALIGNED(p, n) (((uintptr_t)(p) | (n)) % VSIZE == 0)
+
+// Instantiate the kernels for each level.
+// The scalar level must not be auto-vectorized: it is the baseline.
+
+#pragma GCC push_options
+#pragma GCC optimize("no-tree-vectorize")
+#define KFN(name) name##_scalar
+#define VSIZE 0
+#include "imageKernels.inc"
+#undef KFN
+#undef VSIZE
+#pragma GCC pop_options
+
+#define KERNEL_TABLE(LEVEL, NAME) {         \
+    .level = NAME,                          \
+    .negate = negate_##LEVEL,               \
+    .threshold = threshold_##LEVEL,         \
+    .lookup = lookup,                       \
+    .lookup2 = lookup2,                     \
+    .histogram = histogram,                 \
+    .minmax = minmax_##LEVEL,               \
+    .reverse = reverse_##LEVEL,             \
+    .mismatch = mismatch_##LEVEL,           \
+    .sadRow = sadRow_##LEVEL,               \
+    .addRow = addRow_##LEVEL,               \
+    .subRow = subRow_##LEVEL,               \
+    .boxRow = boxRow_##LEVEL,               \
+    .minRow = minRow_##LEVEL,               \
+    .maxRow = maxRow_##LEVEL,               \
+    .lerpRow = lerpRow_##LEVEL,             \
+    .bilerpRow = bilerpRow_##LEVEL,         \
+    .halveRow = halveRow_##LEVEL,           \
+    .convRow = convRow_##LEVEL,             \
+    .macRow = macRow_##LEVEL,               \
+    .packRow = packRow_##LEVEL,             \
+  }
+
+const ImageKernels KernelsScalar = KERNEL_TABLE(scalar, "scalar");
+
+ImageKernels Kernels = KERNEL_TABLE(scalar, "scalar");
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_LEVELS 1
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#pragma GCC optimize("tree-vectorize")
+#define KFN(name) name##_sse42
+#define VSIZE 16
+#include "imageKernels.inc"
+#undef KFN
+#undef VSIZE
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("tree-vectorize")
+#define KFN(name) name##_avx2
+#define VSIZE 32
+#include "imageKernels.inc"
+#undef KFN
+#undef VSIZE
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx512vl,avx512dq,prefer-vector-width=512")
+#pragma GCC optimize("tree-vectorize")
+#define KFN(name) name##_avx512
+#define VSIZE 64
+#include "imageKernels.inc"
+#undef KFN
+#undef VSIZE
+#pragma GCC pop_options
+
+#endif
+
+// The levels, from worst to best, and whether the CPU supports them.
+static struct {
+  const char* name;
+  ImageKernels table;
+  int supported;
+} levels[] = {
+  { "scalar", KERNEL_TABLE(scalar, "scalar"), 1 },
+#ifdef HAVE_X86_LEVELS
+  { "sse4.2", KERNEL_TABLE(sse42, "sse4.2"), 0 },
+  { "avx2",   KERNEL_TABLE(avx2, "avx2"), 0 },
+  { "avx512", KERNEL_TABLE(avx512, "avx512"), 0 },
+#endif
+};
+#define NLEVELS (int)(sizeof(levels) / sizeof(levels[0]))
+
+// Why the current level was selected (for KernelsInfo).
+static const char* reason = "default";
+
+/// Select the kernels for the running CPU (and IMAGE8BIT_SIMD).
+void KernelsInit(void) { ///
+#ifdef HAVE_X86_LEVELS
+  __builtin_cpu_init();
+  levels[1].supported = __builtin_cpu_supports("sse4.2");
+  levels[2].supported = __builtin_cpu_supports("avx2");
+  levels[3].supported = __builtin_cpu_supports("avx512f")
+                     && __builtin_cpu_supports("avx512bw")
+                     && __builtin_cpu_supports("avx512vl")
+                     && __builtin_cpu_supports("avx512dq");
+#endif
+  // Best supported level
+  int best = 0;
+  for (int i = 0; i < NLEVELS; i++)
+    if (levels[i].supported) best = i;
+  reason = "best supported by CPU";
+
+  const char* force = getenv("IMAGE8BIT_SIMD");
+  if (force != NULL && *force != '\0') {
+    int i;
+    for (i = 0; i < NLEVELS; i++)
+      if (strcmp(force, levels[i].name) == 0) break;
+    if (i == NLEVELS && strcmp(force, "sse42") == 0) i = 1;   // alias
+    if (i == NLEVELS) {
+      reason = "IMAGE8BIT_SIMD unknown, ignored";
+    } else if (i > best) {
+      reason = "IMAGE8BIT_SIMD not supported by CPU, ignored";
+    } else {
+      best = i;
+      reason = "forced by IMAGE8BIT_SIMD";
+    }
+  }
+  Kernels = levels[best].table;
+}
+
+// Name of the level a kernel function belongs to.
+#define LEVEL_OF(field)                                       \
+  static const char* levelOf_##field(void) {                  \
+    for (int i = 0; i < NLEVELS; i++)                         \
+      if (levels[i].table.field == Kernels.field)             \
+        return levels[i].name;                                \
+    return "?";                                               \
+  }
+LEVEL_OF(negate)
+LEVEL_OF(threshold)
+LEVEL_OF(lookup)
+LEVEL_OF(lookup2)
+LEVEL_OF(histogram)
+LEVEL_OF(minmax)
+LEVEL_OF(reverse)
+LEVEL_OF(mismatch)
+LEVEL_OF(sadRow)
+LEVEL_OF(boxRow)
+LEVEL_OF(convRow)
+LEVEL_OF(minRow)
+LEVEL_OF(maxRow)
+LEVEL_OF(lerpRow)
+LEVEL_OF(bilerpRow)
+LEVEL_OF(halveRow)
+
+/// Describe detected CPU features and the kernel selected for each
+/// operation.  Returns a pointer to a static string.
+const char* KernelsInfo(void) { ///
+  static char buf[2048];
+  size_t len = 0;
+#define ADD(...) \
+  len += (size_t)snprintf(buf + len, len < sizeof(buf) ? sizeof(buf) - len : 0, __VA_ARGS__)
+
+  ADD("# CPU levels:");
+  for (int i = 0; i < NLEVELS; i++)
+    ADD(" %s%s", levels[i].name, levels[i].supported ? "" : "(no)");
+  ADD("\n# Selected: %s (%s)\n", Kernels.level, reason);
+  ADD("# %-10s %-22s %s\n", "operation", "kernels", "level");
+  ADD("# %-10s %-22s %s\n", "stats", "minmax", levelOf_minmax());
+  ADD("# %-10s %-22s %s\n", "info", "histogram", levelOf_histogram());
+  ADD("# %-10s %-22s %s\n", "neg", "negate", levelOf_negate());
+  ADD("# %-10s %-22s %s\n", "thr", "threshold", levelOf_threshold());
+  ADD("# %-10s %-22s %s\n", "bri", "lookup", levelOf_lookup());
+  ADD("# %-10s %-22s %s\n", "mirror", "reverse", levelOf_reverse());
+  ADD("# %-10s %-22s %s\n", "blend", "lookup2", levelOf_lookup2());
+  ADD("# %-10s %-22s %s\n", "match", "mismatch", levelOf_mismatch());
+  ADD("# %-10s %-22s %s\n", "locate", "mismatch", levelOf_mismatch());
+  ADD("# %-10s %-22s %s\n", "plocate", "sadRow,mismatch", levelOf_sadRow());
+  ADD("# %-10s %-22s %s\n", "blur", "addRow,subRow,boxRow", levelOf_boxRow());
+  ADD("# %-10s %-22s %s\n", "conv", "convRow,macRow,packRow", levelOf_convRow());
+  ADD("# %-10s %-22s %s\n", "erode", "minRow", levelOf_minRow());
+  ADD("# %-10s %-22s %s\n", "dilate", "maxRow", levelOf_maxRow());
+  ADD("# %-10s %-22s %s\n", "resize", "lerpRow", levelOf_lerpRow());
+  ADD("# %-10s %-22s %s\n", "turn", "bilerpRow", levelOf_bilerpRow());
+  ADD("# %-10s %-22s %s\n", "pyramid", "halveRow", levelOf_halveRow());
+#undef ADD
+  return buf;
+}
@@ -0,0 +1,120 @@
+/// imageKernels - Low-level pixel kernels with runtime CPU dispatch.
+///
+/// This is an internal module of image8bit.
+/// It provides the inner loops of the image operations, working on plain
+/// arrays of pixels (usually one image row), in several versions compiled
+/// for different instruction sets: scalar, SSE4.2, AVX2 and AVX-512.
+/// KernelsInit() picks the best version supported by the running CPU,
+/// so a single binary runs (and runs well) on a mixed fleet.
+///
+/// All versions of a kernel compute exactly the same results.
+///
+/// The level may be forced with the environment variable IMAGE8BIT_SIMD
+/// set to one of: scalar, sse4.2, avx2, avx512.
+/// (A level not supported by the CPU falls back to the best one that is.)
+
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Table of kernels for one instruction set level.
+typedef struct {
+  const char* level;  // name of the level: "scalar", "sse4.2", ...
+
+  /// p[i] = maxval - p[i]  (modulo 256)
+  void (*negate)(uint8_t* p, size_t n, uint8_t maxval);
+
+  /// p[i] = p[i] < thr ? 0 : maxval
+  void (*threshold)(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval);
+
+  /// p[i] = lut[p[i]]
+  void (*lookup)(uint8_t* p, size_t n, const uint8_t* lut);
+
+  /// dst[i] = lut2[dst[i]*256 + src[i]]
+  void (*lookup2)(uint8_t* dst, const uint8_t* src, size_t n, const uint8_t* lut2);
+
+  /// Count the levels of p[0..n-1] into 4 sub-histograms:
+  /// sub[k*256 + v] counts some of the pixels with level v, and the
+  /// histogram is the sum of the 4.  (The caller must keep the counts
+  /// from overflowing.)
+  void (*histogram)(const uint8_t* p, size_t n, uint32_t* sub);
+
+  /// Minimum and maximum of p[0..n-1], merged into (*min, *max).
+  void (*minmax)(const uint8_t* p, size_t n, uint8_t* min, uint8_t* max);
+
+  /// dst[i] = src[n-1-i]
+  void (*reverse)(uint8_t* dst, const uint8_t* src, size_t n);
+
+  /// Index of first i with a[i] != b[i], or n if none.
+  size_t (*mismatch)(const uint8_t* a, const uint8_t* b, size_t n);
+
+  /// Sum of absolute differences: sum of |a[i] - b[i]|
+  uint64_t (*sadRow)(const uint8_t* a, const uint8_t* b, size_t n);
+
+  /// acc[i] += p[i]
+  void (*addRow)(uint32_t* acc, const uint8_t* p, size_t n);
+
+  /// acc[i] -= p[i]
+  void (*subRow)(uint32_t* acc, const uint8_t* p, size_t n);
+
+  /// Horizontal part of the mean filter.
+  /// colsum[i] is the sum of a column of rows pixels; computes
+  /// dst[i] = mean of colsum[max(0,i-dx)..min(n-1,i+dx)], rounded as
+  /// (uint8)((sum + count*0.5) / count).
+  /// prefix must have room for n+1 elements (scratch).
+  void (*boxRow)(uint8_t* dst, const uint32_t* colsum, uint64_t* prefix,
+                 size_t n, int dx, uint32_t rows);
+
+  /// dst[i] = min(a[i], b[i])
+  void (*minRow)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+
+  /// dst[i] = max(a[i], b[i])
+  void (*maxRow)(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t n);
+
+  /// Vertical part of the bilinear resize (8 fraction bits per axis):
+  /// dst[i] = (a[i]*(256-f) + b[i]*f + 2^15) >> 16
+  void (*lerpRow)(uint8_t* dst, const uint16_t* a, const uint16_t* b, size_t n, uint32_t f);
+
+  /// Bilinear interpolation (8 fraction bits per axis) of the 2x2
+  /// neighbours a (top left), b (top right), c (bottom left) and
+  /// d (bottom right) of each pixel:
+  /// dst[i] = (((a*(256-fx) + b*fx) * (256-fy) + (c*(256-fx) + d*fx) * fy) + 2^15) >> 16
+  void (*bilerpRow)(uint8_t* dst, const uint8_t* a, const uint8_t* b, const uint8_t* c,
+                    const uint8_t* d, const uint8_t* fx, const uint8_t* fy, size_t n);
+
+  /// 2x2 box downsampling of rows r0 and r1 (2n pixels each):
+  /// dst[i] = (r0[2i] + r0[2i+1] + r1[2i] + r1[2i+1] + 2) >> 2
+  void (*halveRow)(uint8_t* dst, const uint8_t* r0, const uint8_t* r1, size_t n);
+
+  /// Horizontal part of the separable convolution (fixed point):
+  /// dst[i] = sum of q[j]*src[i+j], j in [0, nq).
+  /// (src must have n+nq-1 elements; the sums must fit in 31 bits.)
+  void (*convRow)(int32_t* dst, const uint8_t* src, size_t n,
+                  const int32_t* q, int nq);
+
+  /// Vertical part of the separable convolution:
+  /// acc[i] += q*row[i]
+  void (*macRow)(int64_t* acc, const int32_t* row, size_t n, int32_t q);
+
+  /// Final rounding of the separable convolution (2 x 12 fraction bits):
+  /// dst[i] = clamp((acc[i] + 2^23) >> 24, 0, maxval)
+  void (*packRow)(uint8_t* dst, const int64_t* acc, size_t n, uint8_t maxval);
+} ImageKernels;
+
+/// The kernels selected by KernelsInit().
+/// (Before KernelsInit(), these are the scalar kernels.)
+extern ImageKernels Kernels;
+
+/// The scalar kernels, always available (reference for the others).
+extern const ImageKernels KernelsScalar;
+
+/// Select the kernels for the running CPU (and IMAGE8BIT_SIMD).
+void KernelsInit(void) ;
+
+/// Describe detected CPU features and the kernel selected for each
+/// operation.  Returns a pointer to a static string.
+const char* KernelsInfo(void) ;
+
+#endif
@@ -0,0 +1,301 @@
+// imageLargeTest - Tests of the image8bit module on very large images.
+//
+// Images may have more than INT_MAX (and more than UINT32_MAX) pixels,
+// so sizes and pixel indices must never be computed in int.
+// These tests create such images without needing that much memory:
+// large pixel buffers are mapped lazily, so untouched (black) pixels cost
+// nothing, and the tests only write a few pixels far from the origin.
+//
+// Tests marked "full" really touch gigabytes (loading a 2.5 Gpixel file,
+// blurring a 17 Mpixel-tall image) and only run with option -f.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageLargeTest [OPTION...]\n"
+    "  Test image8bit operations on images with more than 2^32 pixels.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -f              Also run the full tests (need a few GB of memory and disk)\n"
+    "  -o T1,T2,...    Tests to run  [all]\n"
+    "  -l              List tests and exit\n"
+    "\n"
+    ;
+
+// Dimensions of the huge image: 70000*70000 = 4.9e9 pixels > 2^32.
+#define HUGE_W 70000
+#define HUGE_H 70000
+
+static int failures = 0;
+
+// Check a condition; report and count a failure if false.
+#define CHECK(cond) \
+  ((cond) ? 1 : (fprintf(stderr, "FAIL %s:%d: %s\n", __func__, __LINE__, #cond), \
+                 failures++, 0))
+
+// Create an image, or abort the program if that fails.
+static Image create(int w, int h, uint8 maxval) {
+  Image img = ImageCreate(w, h, maxval);
+  if (img == NULL) error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+  return img;
+}
+
+static char tmpname[] = "/tmp/imageLargeTest-XXXXXX";
+
+// Pixels far from the origin, and their distinct levels.
+static const struct { int x, y; uint8 level; } far[] = {
+  { HUGE_W - 1, HUGE_H - 1, 200 },
+  { 0,          HUGE_H - 1, 100 },
+  { HUGE_W - 1, 0,          50 },
+  { 12345,      61357,      7 },   // index > 2^32
+};
+#define NFAR (int)(sizeof(far) / sizeof(far[0]))
+
+static void testCreate(void) {
+  Image img = create(HUGE_W, HUGE_H, PixMax);
+  CHECK(ImageWidth(img) == HUGE_W && ImageHeight(img) == HUGE_H);
+  for (int i = 0; i < NFAR; i++)
+    CHECK(ImageGetPixel(img, far[i].x, far[i].y) == 0);
+  for (int i = 0; i < NFAR; i++)
+    ImageSetPixel(img, far[i].x, far[i].y, far[i].level);
+  for (int i = 0; i < NFAR; i++)
+    CHECK(ImageGetPixel(img, far[i].x, far[i].y) == far[i].level);
+  CHECK(ImageGetPixel(img, 0, 0) == 0);
+  ImageDestroy(&img);
+
+  // A single row of INT_MAX pixels
+  img = create(INT_MAX, 1, PixMax);
+  ImageSetPixel(img, INT_MAX - 1, 0, 9);
+  CHECK(ImageGetPixel(img, INT_MAX - 1, 0) == 9);
+  CHECK(ImageGetPixel(img, INT_MAX - 2, 0) == 0);
+  ImageDestroy(&img);
+}
+
+static void testTooLarge(void) {
+  // INT_MAX*INT_MAX bytes: the size fits in size_t, but no system has it
+  errno = 0;
+  Image img = ImageCreate(INT_MAX, INT_MAX, PixMax);
+  CHECK(img == NULL);
+  CHECK(errno == ENOMEM);
+  ImageDestroy(&img);
+}
+
+static void testStats(void) {
+  Image img = create(HUGE_W, HUGE_H, PixMax);
+  for (int i = 0; i < NFAR; i++)
+    ImageSetPixel(img, far[i].x, far[i].y, far[i].level);
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+  CHECK(min == 0 && max == 200);
+  ImageDestroy(&img);
+}
+
+static void testRegionSum(void) {
+  // Without an integral image (too large for one)
+  Image img = create(HUGE_W, HUGE_H, PixMax);
+  for (int i = 0; i < NFAR; i++)
+    ImageSetPixel(img, far[i].x, far[i].y, far[i].level);
+  CHECK(ImageRegionSum(img, 12300, 61300, 100, 100) == 7);
+  CHECK(ImageRegionSum(img, HUGE_W - 2, 0, 2, HUGE_H) == 250);
+  ImageDestroy(&img);
+
+  // Sums of more than 2^32 (in rectangles larger than the integral image
+  // sums exactly)
+  img = create(4500, 4500, PixMax);
+  ImageNegative(img);   // all white
+  CHECK(ImageRegionSum(img, 0, 0, 4500, 4500) == 4500ull * 4500 * PixMax);
+  CHECK(ImageRegionSum(img, 1, 2, 4499, 4498) == 4499ull * 4498 * PixMax);
+  ImageSetPixel(img, 4499, 4499, 0);
+  CHECK(ImageRegionSum(img, 0, 0, 4500, 4500) == 4500ull * 4500 * PixMax - PixMax);
+  ImageDestroy(&img);
+}
+
+static void testCropPaste(void) {
+  Image img = create(HUGE_W, HUGE_H, PixMax);
+  Image small = create(100, 100, PixMax);
+  for (int y = 0; y < 100; y++)
+    for (int x = 0; x < 100; x++)
+      ImageSetPixel(small, x, y, (uint8)(x * 7 + y * 13));
+
+  int x0 = HUGE_W - 100;
+  int y0 = HUGE_H - 100;
+  ImagePaste(img, x0, y0, small);
+  CHECK(ImageGetPixel(img, x0 + 99, y0 + 99) == (uint8)(99 * 20));
+  CHECK(ImageMatchSubImage(img, x0, y0, small));
+  CHECK(!ImageMatchSubImage(img, x0 - 1, y0, small));
+
+  Image crop = ImageCrop(img, x0, y0, 100, 100);
+  if (CHECK(crop != NULL)) {
+    CHECK(ImageMatchSubImage(crop, 0, 0, small));
+    ImageDestroy(&crop);
+  }
+
+  ImageBlend(img, x0, y0, small, 1.0);
+  CHECK(ImageMatchSubImage(img, x0, y0, small));
+  ImageDestroy(&small);
+  ImageDestroy(&img);
+}
+
+static void testBlurRadius(void) {
+  // Radii near INT_MAX: every pixel becomes the mean of the whole image
+  Image img = create(101, 37, PixMax);
+  unsigned long sum = 0;
+  for (int y = 0; y < 37; y++)
+    for (int x = 0; x < 101; x++) {
+      uint8 v = (uint8)((x * 31 + y * 17) % 256);
+      ImageSetPixel(img, x, y, v);
+      sum += v;
+    }
+  uint8 mean = (uint8)((sum + 101 * 37 * 0.5) / (101 * 37));
+  ImageBlur(img, INT_MAX, INT_MAX);
+  int bad = 0;
+  for (int y = 0; y < 37; y++)
+    for (int x = 0; x < 101; x++)
+      bad += ImageGetPixel(img, x, y) != mean;
+  CHECK(bad == 0);
+  ImageDestroy(&img);
+}
+
+// Write a PGM header and return its length.
+static long writeHeader(FILE* f, const char* dims) {
+  fprintf(f, "P5\n%s\n255\n", dims);
+  return ftell(f);
+}
+
+static void testLoadHeader(void) {
+  // Dimensions that do not fit in an int
+  FILE* f = fopen(tmpname, "wb");
+  writeHeader(f, "99999999999 10");
+  fclose(f);
+  Image img = ImageLoad(tmpname);
+  CHECK(img == NULL);
+  CHECK(strcmp(ImageErrMsg(), "Invalid width") == 0);
+
+  // Dimensions that fit, but far too large for memory (and the file)
+  f = fopen(tmpname, "wb");
+  writeHeader(f, "2147483647 2147483647");
+  fclose(f);
+  img = ImageLoad(tmpname);
+  CHECK(img == NULL);
+}
+
+static void testLoadSparse(void) {
+  // A sparse file with a 50000x50000 (2.5e9 pixels > 2^31) image
+  const int w = 50000, h = 50000;
+  FILE* f = fopen(tmpname, "wb");
+  if (f == NULL) error(2, errno, "%s", tmpname);
+  long hdr = writeHeader(f, "50000 50000");
+  for (int i = 1; i <= 3; i++) {
+    fseek(f, hdr + (long)(h - i) * w + (w - i), SEEK_SET);
+    fputc(i, f);
+  }
+  fclose(f);
+  if (truncate(tmpname, hdr + (long)w * h) != 0) error(2, errno, "%s", tmpname);
+
+  Image img = ImageLoad(tmpname);
+  if (CHECK(img != NULL)) {
+    for (int i = 1; i <= 3; i++)
+      CHECK(ImageGetPixel(img, w - i, h - i) == i);
+    CHECK(ImageGetPixel(img, w - 4, h - 4) == 0);
+    ImageDestroy(&img);
+  }
+  if (truncate(tmpname, 0) != 0) error(2, errno, "%s", tmpname);
+}
+
+static void testBlurTall(void) {
+  // A window of more than 2^32/255 rows: column sums exceed 32 bits
+  const int h = 17000000;
+  Image img = create(1, h, PixMax);
+  ImageNegative(img);   // all white
+  ImageBlur(img, 0, INT_MAX);
+  int bad = 0;
+  for (int y = 0; y < h; y++)
+    bad += ImageGetPixel(img, 0, y) != PixMax;
+  CHECK(bad == 0);
+  ImageDestroy(&img);
+}
+
+static const struct {
+  const char* name;
+  void (*test)(void);
+  int full;   // heavy test, only run with -f
+} tests[] = {
+  { "create",     testCreate,     0 },
+  { "toolarge",   testTooLarge,   0 },
+  { "stats",      testStats,      0 },
+  { "regionsum",  testRegionSum,  0 },
+  { "croppaste",  testCropPaste,  0 },
+  { "blurradius", testBlurRadius, 0 },
+  { "loadheader", testLoadHeader, 0 },
+  { "loadsparse", testLoadSparse, 1 },
+  { "blurtall",   testBlurTall,   1 },
+};
+#define NTESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+// Check if name is in comma-separated list (NULL list means everything).
+static int inList(const char* list, const char* name) {
+  if (list == NULL) return 1;
+  size_t len = strlen(name);
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return 1;
+  }
+  return 0;
+}
+
+int main(int ac, char* av[]) {
+  int full = 0;
+  const char* testList = NULL;
+
+  int opt;
+  while ((opt = getopt(ac, av, "fo:lh")) != -1) {
+    switch (opt) {
+    case 'f': full = 1; break;
+    case 'o': testList = optarg; break;
+    case 'l':
+      for (int i = 0; i < NTESTS; i++)
+        printf("%s%s\n", tests[i].name, tests[i].full ? " (full)" : "");
+      return 0;
+    default:
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+
+  ImageInit();
+
+  int fd = mkstemp(tmpname);
+  if (fd < 0) error(2, errno, "%s", tmpname);
+  close(fd);
+
+  for (int t = 0; t < NTESTS; t++) {
+    if (!inList(testList, tests[t].name)) continue;
+    if (tests[t].full && !full) {
+      printf("%-10s skipped (use -f)\n", tests[t].name);
+      continue;
+    }
+    int before = failures;
+    tests[t].test();
+    printf("%-10s %s\n", tests[t].name, failures > before ? "FAIL" : "ok");
+  }
+
+  unlink(tmpname);
+  ImageDone();
+  if (failures > 0) {
+    printf("%d check(s) FAILED\n", failures);
+    return 1;
+  }
+  return 0;
+}
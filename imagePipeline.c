@@ -0,0 +1,1278 @@
+/// imagePipeline - Compiled pipelines of image operations.
+///
+/// See imagePipeline.h.
+
+#include "imagePipeline.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+#include "xxhash64.h"
+
+// Operations (instruction codes)
+enum {
+  OP_LOAD, OP_SAVE, OP_INFO, OP_TIC, OP_TOC, OP_CPUINFO, OP_THREADS,
+  OP_NEG, OP_THR, OP_BRI,
+  OP_CREATE, OP_DUP, OP_ROTATE, OP_TURN, OP_MIRROR, OP_CROP, OP_RESIZE, OP_PYRAMID,
+  OP_PASTE, OP_BLEND, OP_LOCATE, OP_PLOCATE,
+  OP_BLUR, OP_ERODE, OP_DILATE, OP_OPEN, OP_CLOSE, OP_MEDIAN, OP_GAUSS, OP_CONV,
+  NOPS
+};
+
+// Names (as in the arguments and in plan files) and properties of the
+// operations, indexed by code.
+static const struct {
+  const char* name;
+  int operand;    // takes an operand
+  int uses;       // images used: CURR (1), or PRED and CURR (2)
+  int creates;    // creates an image (pyramid: several)
+  int cached;     // its results are cached (see PipelineIO)
+  int changes;    // changes CURR in-place
+} ops[NOPS] = {
+  [OP_LOAD]    = { "load",    1, 0, 1, 0, 0 },  // (not an argument: any file name)
+  [OP_SAVE]    = { "save",    1, 1, 0, 0, 0 },
+  [OP_INFO]    = { "info",    0, 1, 0, 0, 0 },  // (optional --hist)
+  [OP_TIC]     = { "tic",     0, 0, 0, 0, 0 },
+  [OP_TOC]     = { "toc",     0, 0, 0, 0, 0 },
+  [OP_CPUINFO] = { "cpuinfo", 0, 0, 0, 0, 0 },
+  [OP_THREADS] = { "-j",      1, 0, 0, 0, 0 },
+  [OP_NEG]     = { "neg",     0, 1, 0, 0, 1 },
+  [OP_THR]     = { "thr",     1, 1, 0, 0, 1 },
+  [OP_BRI]     = { "bri",     1, 1, 0, 0, 1 },
+  [OP_CREATE]  = { "create",  1, 0, 1, 0, 0 },
+  [OP_DUP]     = { "dup",     0, 1, 1, 0, 0 },  // (shares the pixels: see check)
+  [OP_ROTATE]  = { "rotate",  0, 1, 1, 1, 0 },
+  [OP_TURN]    = { "turn",    1, 1, 1, 1, 0 },
+  [OP_MIRROR]  = { "mirror",  0, 1, 1, 0, 0 },
+  [OP_CROP]    = { "crop",    1, 1, 1, 0, 0 },
+  [OP_RESIZE]  = { "resize",  1, 1, 1, 1, 0 },
+  [OP_PYRAMID] = { "pyramid", 1, 1, 0, 0, 0 },  // (creates several: see check)
+  [OP_PASTE]   = { "paste",   1, 2, 0, 0, 1 },
+  [OP_BLEND]   = { "blend",   1, 2, 0, 0, 1 },
+  [OP_LOCATE]  = { "locate",  0, 2, 0, 0, 0 },
+  [OP_PLOCATE] = { "plocate", 0, 2, 0, 0, 0 },
+  [OP_BLUR]    = { "blur",    1, 1, 0, 1, 1 },
+  [OP_ERODE]   = { "erode",   1, 1, 0, 1, 1 },
+  [OP_DILATE]  = { "dilate",  1, 1, 0, 1, 1 },
+  [OP_OPEN]    = { "open",    1, 1, 0, 1, 1 },
+  [OP_CLOSE]   = { "close",   1, 1, 0, 1, 1 },
+  [OP_MEDIAN]  = { "median",  1, 1, 0, 1, 1 },
+  [OP_GAUSS]   = { "gauss",   1, 1, 0, 1, 1 },
+  [OP_CONV]    = { "conv",    1, 1, 0, 1, 1 },
+};
+
+// Maximum number of taps of a convolution kernel (conv).
+#define MAX_TAPS 255
+
+// An instruction: an operation with its parsed operands.
+typedef struct {
+  int op;
+  int i[4];         // integer operands (x, y, w, h, dx, dy, mode, ...)
+  double d;         // real operand (factor, alpha, sigma, degrees)
+  int nkx, nky;     // conv: taps[0..nkx-1] along rows, then nky along columns
+  double* taps;
+  char* name;       // load, save: file name
+  int input;        // load: input number
+  // Inferred by the check, for the sizes of the inputs checked:
+  int n;            // images in the buffer after the instruction
+  int w, h, maxval; // size of CURR after the instruction
+} Instr;
+
+struct pipeline {
+  Instr* code;
+  int ncode;
+  int ninputs;
+  int checked;      // the code was checked for inputs of sizes insize
+  int* insize;      // width, height, maxval of each input
+  int prealloced;   // the buffers for those sizes were preallocated
+  uint64_t budget;  // maximum memory (bytes) of the live images
+  uint64_t peak;    // memory of the live images at the peak (if checked)
+  int nimages;      // images created by a run (if checked)
+  int* last;        // last instruction using each image (if checked)
+};
+
+// Size of a plan, for the sanity checks of PipelineLoad.
+#define PLAN_MAX_CODE 100000
+
+// Maximum number of reductions of a pyramid (down to 1x1).
+#define PYRAMID_MAX 32
+
+// Maximum number of images preallocated.
+#define PREALLOC_MAX 16
+
+
+// Messages of the error codes.
+static const char* errors[] = {
+  [PIPE_OK]         = "Success",
+  [PIPE_EOPERANDS]  = "Insufficient operands",
+  [PIPE_EIMAGES]    = "Insufficient images",
+  [PIPE_EFULL]      = "Image buffer is full (memory budget exceeded)",
+  [PIPE_EIMAGE8BIT] = "Image8bit failure: %s",
+  [PIPE_EOPERAND]   = "Invalid operand",
+  [PIPE_ERECT]      = "Invalid rect (overflow)",
+  [PIPE_EALPHA]     = "Invalid alpha",
+  [PIPE_EPLAN]      = "Invalid plan file",
+  [PIPE_ESERVER]    = "Server failure",
+};
+
+/// Message of error code err.
+const char* PipelineErrFormat(int err) { ///
+  if (err < 0 || err >= (int)(sizeof(errors) / sizeof(errors[0]))) return "Unknown error";
+  return errors[err];
+}
+
+
+/// Compiling
+
+// Parse comma-separated kernel taps from s into k (at most MAX_TAPS),
+// up to the end of s or a '/'.  Returns the number of taps (0 if invalid)
+// and sets *end to the character after the taps.
+static int parseTaps(const char* s, double* k, const char** end) {
+  int n = 0;
+  for (;;) {
+    char* e;
+    if (n >= MAX_TAPS) return 0;
+    k[n++] = strtod(s, &e);
+    if (e == s) return 0;
+    s = e;
+    if (*s != ',') break;
+    s++;
+  }
+  *end = s;
+  return n;
+}
+
+// Is the sum of the absolute values of the taps acceptable?
+static int validTaps(const double* k, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += k[i] < 0 ? -k[i] : k[i];
+  return sum <= 1024.0;
+}
+
+// Check the operands of instruction in that do not depend on image sizes
+// (see check for the rest): the preconditions of the image8bit functions.
+// Used for arguments and for plan files (which may lie).
+// Returns PIPE_OK or an error code.
+static int validOperands(const Instr* in) {
+  const int* i = in->i;
+  switch (in->op) {
+  case OP_INFO:
+    if (i[0] != 0 && i[0] != 1) return PIPE_EOPERAND;
+    break;
+  case OP_THREADS:
+  case OP_PYRAMID:
+    if (i[0] < 0) return PIPE_EOPERAND;
+    break;
+  case OP_THR:
+    if (i[0] < 0 || i[0] > PixMax) return PIPE_EOPERAND;
+    break;
+  case OP_BRI:
+  case OP_GAUSS:
+    if (!(in->d >= 0.0) || !isfinite(in->d)) return PIPE_EOPERAND;
+    break;
+  case OP_CREATE:
+    if (i[0] < 0 || i[1] < 0) return PIPE_EOPERAND;
+    break;
+  case OP_CROP:
+    if (i[2] < 0 || i[3] < 0) return PIPE_EOPERAND;
+    break;
+  case OP_TURN:
+    if (!isfinite(in->d) || i[0] < 0 || i[0] > PixMax) return PIPE_EOPERAND;
+    break;
+  case OP_RESIZE:
+    if (i[0] < 0 || i[1] < 0) return PIPE_EOPERAND;
+    if (i[2] != IMAGE_RESIZE_NEAREST && i[2] != IMAGE_RESIZE_BILINEAR
+        && i[2] != IMAGE_RESIZE_AREA) return PIPE_EOPERAND;
+    break;
+  case OP_BLEND:
+    if (!isfinite(in->d)) return PIPE_EALPHA;
+    break;
+  case OP_BLUR:
+  case OP_ERODE:
+  case OP_DILATE:
+  case OP_OPEN:
+  case OP_CLOSE:
+  case OP_MEDIAN:
+    if (i[0] < 0 || i[1] < 0) return PIPE_EOPERAND;
+    break;
+  case OP_CONV:
+    if (in->nkx <= 0 || in->nky <= 0 || in->taps == NULL) return PIPE_EOPERAND;
+    if (!validTaps(in->taps, in->nkx) || !validTaps(in->taps + in->nkx, in->nky)) return PIPE_EOPERAND;
+    break;
+  }
+  return PIPE_OK;
+}
+
+// Parse the operand s of instruction in (whose op is set), and validate
+// it (see validOperands).
+// Returns PIPE_OK or an error code.
+static int parseOperand(Instr* in, const char* s) {
+  int* i = in->i;
+  int got;
+  switch (in->op) {
+  case OP_SAVE:
+  case OP_LOAD:
+    in->name = strdup(s);
+    if (in->name == NULL) return PIPE_EIMAGE8BIT;
+    break;
+  case OP_THREADS:
+  case OP_PYRAMID:
+    if (sscanf(s, "%d", &i[0]) != 1) return PIPE_EOPERAND;
+    break;
+  case OP_THR: {
+    uint8 thr;
+    if (sscanf(s, "%hhu", &thr) != 1) return PIPE_EOPERAND;
+    i[0] = thr;
+    break;
+  }
+  case OP_BRI:
+  case OP_GAUSS:
+    if (sscanf(s, "%lf", &in->d) != 1) return PIPE_EOPERAND;
+    break;
+  case OP_TURN:
+    i[0] = 0;
+    got = sscanf(s, "%lf,%d", &in->d, &i[0]);
+    if (got != 1 && got != 2) return PIPE_EOPERAND;
+    break;
+  case OP_CROP:
+    if (sscanf(s, "%d,%d,%d,%d", &i[0], &i[1], &i[2], &i[3]) != 4) return PIPE_EOPERAND;
+    break;
+  case OP_RESIZE: {
+    char mode[16] = "bilinear";
+    got = sscanf(s, "%d,%d,%15s", &i[0], &i[1], mode);
+    if (got != 2 && got != 3) return PIPE_EOPERAND;
+    if (strcmp(mode, "nearest") == 0) i[2] = IMAGE_RESIZE_NEAREST;
+    else if (strcmp(mode, "bilinear") == 0) i[2] = IMAGE_RESIZE_BILINEAR;
+    else if (strcmp(mode, "area") == 0) i[2] = IMAGE_RESIZE_AREA;
+    else return PIPE_EOPERAND;
+    break;
+  }
+  case OP_CREATE:
+  case OP_PASTE:
+    if (sscanf(s, "%d,%d", &i[0], &i[1]) != 2) return PIPE_EOPERAND;
+    break;
+  case OP_BLEND:
+    if (sscanf(s, "%d,%d,%lf", &i[0], &i[1], &in->d) != 3) return PIPE_EOPERAND;
+    break;
+  case OP_BLUR:
+  case OP_ERODE:
+  case OP_DILATE:
+  case OP_OPEN:
+  case OP_CLOSE:
+  case OP_MEDIAN:
+    if (sscanf(s, "%d,%d", &i[0], &i[1]) != 2) return PIPE_EOPERAND;
+    break;
+  case OP_CONV: {
+    double k[2 * MAX_TAPS];
+    const char* end;
+    int nkx = parseTaps(s, k, &end);
+    if (nkx == 0) return PIPE_EOPERAND;
+    int nky = nkx;
+    if (*end == '/') {
+      nky = parseTaps(end + 1, k + nkx, &end);
+      if (nky == 0) return PIPE_EOPERAND;
+    } else {
+      memcpy(k + nkx, k, sizeof(double) * nkx);
+    }
+    if (*end != '\0') return PIPE_EOPERAND;
+    in->taps = malloc(sizeof(double) * (nkx + nky));
+    if (in->taps == NULL) return PIPE_EIMAGE8BIT;
+    memcpy(in->taps, k, sizeof(double) * (nkx + nky));
+    in->nkx = nkx;
+    in->nky = nky;
+    break;
+  }
+  }
+  return validOperands(in);
+}
+
+// Code of the operation named s (in the arguments), or OP_LOAD if none.
+static int opcode(const char* s) {
+  for (int op = 0; op < NOPS; op++) {
+    if (op != OP_LOAD && strcmp(s, ops[op].name) == 0) return op;
+  }
+  return OP_LOAD;
+}
+
+// Default memory budget: half of the physical memory.
+static uint64_t defaultBudget(void) {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || size <= 0) return UINT64_MAX;
+  return (uint64_t)pages * size / 2;
+}
+
+static Pipeline newPipeline(int ncode) {
+  Pipeline p = calloc(1, sizeof(struct pipeline));
+  if (p == NULL) return NULL;
+  p->budget = defaultBudget();
+  p->code = calloc(ncode > 0 ? ncode : 1, sizeof(Instr));
+  if (p->code == NULL) {
+    free(p);
+    return NULL;
+  }
+  return p;
+}
+
+/// Destroy the pipeline pointed to by (*pp), and set (*pp) to NULL.
+void PipelineDestroy(Pipeline* pp) { ///
+  Pipeline p = *pp;
+  if (p == NULL) return;
+  for (int k = 0; k < p->ncode; k++) {
+    free(p->code[k].taps);
+    free(p->code[k].name);
+  }
+  free(p->code);
+  free(p->insize);
+  free(p->last);
+  free(p);
+  *pp = NULL;
+}
+
+/// Compile arguments av[0..ac-1] into a pipeline.
+Pipeline PipelineCompile(int ac, char* av[], int* err, int* bad) { ///
+  Pipeline p = newPipeline(ac);
+  if (p == NULL) {
+    *err = PIPE_EIMAGE8BIT;
+    *bad = 0;
+    return NULL;
+  }
+  int e = PIPE_OK;
+  int k = 0;
+  while (k < ac && e == PIPE_OK) {
+    if (strcmp(av[k], "-m") == 0) {     // not an instruction
+      double mib;
+      if (++k >= ac) e = PIPE_EOPERANDS;
+      else if (sscanf(av[k], "%lf", &mib) != 1 || !(mib >= 0.0)) e = PIPE_EOPERAND;
+      else p->budget = mib * 1048576.0 >= 0x1p64 ? UINT64_MAX : (uint64_t)(mib * 1048576.0);
+      k++;
+      continue;
+    }
+    Instr* in = &p->code[p->ncode++];
+    in->op = opcode(av[k]);
+    if (in->op == OP_LOAD) {            // an image file
+      in->input = p->ninputs++;
+      e = parseOperand(in, av[k]);
+    } else if (in->op == OP_INFO) {
+      if (k+1 < ac && strcmp(av[k+1], "--hist") == 0) {
+        in->i[0] = 1;
+        k++;
+      }
+    } else if (ops[in->op].operand) {
+      if (++k >= ac) e = PIPE_EOPERANDS;
+      else e = parseOperand(in, av[k]);
+    }
+    k++;
+  }
+  if (e == PIPE_OK) {
+    p->insize = calloc(p->ninputs > 0 ? 3 * p->ninputs : 1, sizeof(int));
+    if (p->insize == NULL) e = PIPE_EIMAGE8BIT;
+  }
+  if (e != PIPE_OK) {
+    PipelineDestroy(&p);
+    *err = e;
+    *bad = k - 1;
+  }
+  return p;
+}
+
+/// Number of inputs (files loaded) of the pipeline.
+int PipelineInputs(Pipeline p) { ///
+  return p->ninputs;
+}
+
+/// File name of input k of the pipeline, as compiled.
+const char* PipelineInputName(Pipeline p, int k) { ///
+  for (int j = 0; j < p->ncode; j++) {
+    if (p->code[j].op == OP_LOAD && p->code[j].input == k) return p->code[j].name;
+  }
+  return NULL;
+}
+
+
+/// Checking
+
+// Size of ImageRotateAngle(img, degrees, ...) for img of w x h
+// (the same computation).
+static void turnSize(double degrees, int w, int h, double* rw, double* rh) {
+  double r = fmod(degrees, 360.0);
+  if (r < 0.0) r += 360.0;
+  if (r >= 360.0) r = 0.0;
+  if (fmod(r, 90.0) == 0.0) {
+    int q = (int)(r / 90.0);
+    *rw = q % 2 ? h : w;
+    *rh = q % 2 ? w : h;
+    return;
+  }
+  double t = r * (M_PI / 180.0);
+  double c = cos(t);
+  double s = sin(t);
+  *rw = floor(w * fabs(c) + h * fabs(s) + 0.5);
+  *rh = floor(w * fabs(s) + h * fabs(c) + 0.5);
+}
+
+// Is rectangle (x, y, w, h) inside an image of width x height?
+// (As ImageValidRect.)
+static int validRect(int width, int height, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return 1;
+  return (0 <= x && x <= width - w) && (0 <= y && y <= height - h);
+}
+
+// Infer the size of every image in the buffer (width, height, maxval into
+// size), for inputs of the given sizes, checking the operands.
+// Returns PIPE_OK or an error code.
+static int infer(Pipeline p, const int* insize, int (*size)[3]) {
+  int n = 0;
+  for (int k = 0; k < p->ncode; k++) {
+    Instr* in = &p->code[k];
+    const int* i = in->i;
+    int* cur = n > 0 ? size[n-1] : NULL;
+    int* pred = n > 1 ? size[n-2] : NULL;
+    if (n < ops[in->op].uses) return PIPE_EIMAGES;
+    int* next = ops[in->op].creates ? size[n] : NULL;
+    switch (in->op) {
+    case OP_LOAD:
+      memcpy(next, &insize[3 * in->input], sizeof(size[0]));
+      break;
+    case OP_CREATE:
+      next[0] = i[0];
+      next[1] = i[1];
+      next[2] = PixMax;
+      break;
+    case OP_ROTATE:
+      next[0] = cur[1];
+      next[1] = cur[0];
+      next[2] = cur[2];
+      break;
+    case OP_TURN: {
+      if (i[0] > cur[2]) return PIPE_EOPERAND;   // precondition check!
+      double rw, rh;
+      turnSize(in->d, cur[0], cur[1], &rw, &rh);
+      if (rw > INT_MAX || rh > INT_MAX) return PIPE_EOPERAND;
+      next[0] = (int)rw;
+      next[1] = (int)rh;
+      next[2] = cur[2];
+      break;
+    }
+    case OP_DUP:
+    case OP_MIRROR:
+      memcpy(next, cur, sizeof(size[0]));
+      break;
+    case OP_CROP:
+      if (!validRect(cur[0], cur[1], i[0], i[1], i[2], i[3])) return PIPE_EOPERAND;   // precondition check!
+      next[0] = i[2];
+      next[1] = i[3];
+      next[2] = cur[2];
+      break;
+    case OP_RESIZE:
+      if ((cur[0] == 0 || cur[1] == 0) && i[0] > 0 && i[1] > 0) return PIPE_EOPERAND;
+      next[0] = i[0];
+      next[1] = i[1];
+      next[2] = cur[2];
+      break;
+    case OP_PYRAMID: {
+      // Level 0 is CURR itself: only the reductions are created
+      int w = cur[0], h = cur[1], maxval = cur[2];
+      for (int l = 0; l < i[0] && (w > 1 || h > 1); l++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        size[n][0] = w;
+        size[n][1] = h;
+        size[n][2] = maxval;
+        n++;
+      }
+      break;
+    }
+    case OP_PASTE:
+    case OP_BLEND:
+      if (!validRect(cur[0], cur[1], i[0], i[1], pred[0], pred[1])) return PIPE_ERECT;
+      break;
+    }
+    if (ops[in->op].creates) n++;
+    in->n = n;
+    in->w = n > 0 ? size[n-1][0] : 0;
+    in->h = n > 0 ? size[n-1][1] : 0;
+    in->maxval = n > 0 ? size[n-1][2] : 0;
+  }
+  return PIPE_OK;
+}
+
+// Find the last instruction that uses each image, from the numbers of
+// images after each instruction (in->n): after it, the image is dead.
+// Returns PIPE_OK, or PIPE_EPLAN if those numbers are inconsistent.
+static int liveness(Pipeline p) {
+  int nimages = p->ncode > 0 ? p->code[p->ncode-1].n : 0;
+  int* last = malloc(sizeof(int) * (nimages > 0 ? nimages : 1));
+  if (last == NULL) return PIPE_EIMAGE8BIT;
+  int n = 0;
+  for (int k = 0; k < p->ncode; k++) {
+    Instr* in = &p->code[k];
+    int created = in->n - n;
+    int ok = n >= ops[in->op].uses &&
+        (in->op == OP_PYRAMID ? 0 <= created && created <= in->i[0] && created <= PYRAMID_MAX
+                              : created == ops[in->op].creates);
+    if (!ok) {
+      free(last);
+      return PIPE_EPLAN;
+    }
+    // CURR (and PRED) are used, new images are created (and may be unused)
+    for (int u = 1; u <= ops[in->op].uses; u++) last[n-u] = k;
+    for (int j = n; j < in->n; j++) last[j] = k;
+    n = in->n;
+  }
+  free(p->last);
+  p->last = last;
+  p->nimages = nimages;
+  return PIPE_OK;
+}
+
+// Check the code for inputs of the given sizes (width, height, maxval of
+// each): infer the sizes of the images, find when they die, and check that
+// the live images never take more memory than the budget.
+// An image created by dup shares the pixel buffer of its original (see
+// ImageClone): the buffer is counted once, until the last image sharing
+// it dies.  An operation that changes a shared image copies its pixels
+// first (a new buffer); if the others sharing it are dead, it does not.
+// Returns PIPE_OK or an error code.
+static int check(Pipeline p, const int* insize) {
+  int max = 0;   // images created, at most
+  for (int k = 0; k < p->ncode; k++) {
+    Instr* in = &p->code[k];
+    if (in->op == OP_PYRAMID) max += in->i[0] < PYRAMID_MAX ? in->i[0] : PYRAMID_MAX;
+    else max += ops[in->op].creates;
+  }
+  int (*size)[3] = malloc(sizeof(*size) * (max > 0 ? max : 1));
+  uint64_t* bytes = malloc(sizeof(uint64_t) * (max > 0 ? max : 1));   // memory of each buffer
+  int* buf = malloc(sizeof(int) * (max > 0 ? max : 1));     // buffer of each image
+  int* refs = calloc(max > 0 ? max : 1, sizeof(int));      // images sharing each buffer
+  if (size == NULL || bytes == NULL || buf == NULL || refs == NULL) {
+    free(size);
+    free(bytes);
+    free(buf);
+    free(refs);
+    return PIPE_EIMAGE8BIT;
+  }
+  int err = infer(p, insize, size);
+  if (err == PIPE_OK) err = liveness(p);
+  if (err == PIPE_OK) {
+    uint64_t live = 0;
+    p->peak = 0;
+    for (int k = 0, n = 0; k < p->ncode; k++) {
+      Instr* in = &p->code[k];
+      // (Buffers are numbered by the first image that has them)
+      for (int j = n; j < in->n; j++) {
+        if (in->op == OP_DUP) {
+          buf[j] = buf[n-1];
+        } else {
+          buf[j] = j;
+          bytes[j] = (uint64_t)size[j][0] * size[j][1];
+          live += bytes[j];
+        }
+        refs[buf[j]]++;
+      }
+      int c = n - 1;   // CURR
+      if (ops[in->op].changes && refs[buf[c]] > 1) {   // (copies the shared pixels)
+        refs[buf[c]]--;
+        buf[c] = c;
+        refs[c] = 1;
+        bytes[c] = (uint64_t)size[c][0] * size[c][1];
+        live += bytes[c];
+      }
+      if (live > p->peak) p->peak = live;
+      for (int j = 0; j < in->n; j++) {
+        if (p->last[j] == k && --refs[buf[j]] == 0) live -= bytes[buf[j]];
+      }
+      n = in->n;
+    }
+    if (p->peak > p->budget) err = PIPE_EFULL;
+  }
+  free(size);
+  free(bytes);
+  free(buf);
+  free(refs);
+  return err;
+}
+
+// Preallocate the pixel buffers of the first images the (checked) code
+// creates, as long as they take no more memory than the peak of the run:
+// creating them all and destroying them leaves their buffers in the pool,
+// where the operations that create them will find them.
+// (Of a pyramid, only the first reduction: the others are smaller.
+// Huge images are mapped directly, not pooled: they are left out, and so
+// are the images created by dup, which share the pixels of others.)
+static void prealloc(Pipeline p) {
+  Image img[PREALLOC_MAX];
+  int m = 0;
+  uint64_t total = 0;
+  for (int k = 0, n = 0; k < p->ncode && m < PREALLOC_MAX; k++) {
+    Instr* in = &p->code[k];
+    if (in->n > n && in->op != OP_DUP) {
+      int w = in->w, h = in->h;
+      if (in->op == OP_PYRAMID) {
+        w = (p->code[k-1].w + 1) / 2;
+        h = (p->code[k-1].h + 1) / 2;
+      }
+      uint64_t bytes = (uint64_t)w * h;
+      if (bytes < ((uint64_t)32 << 20) && total + bytes <= p->peak) {
+        total += bytes;
+        img[m] = ImageCreate(w, h, (uint8)in->maxval);
+        if (img[m] != NULL) m++;
+      }
+    }
+    n = in->n;
+  }
+  while (m > 0) ImageDestroy(&img[--m]);
+}
+
+
+/// Running
+
+// Copy name into buf (of size len), replacing "{}" with base.
+// Returns 0 if it does not fit.
+static int expandName(char* buf, size_t len, const char* name, const char* base) {
+  size_t k = 0;
+  for (const char* s = name; *s != '\0'; s++) {
+    const char* add = s;
+    size_t n = 1;
+    if (s[0] == '{' && s[1] == '}') {
+      add = base;
+      n = strlen(base);
+      s++;
+    }
+    if (k + n >= len) return 0;
+    memcpy(buf + k, add, n);
+    k += n;
+  }
+  buf[k] = '\0';
+  return 1;
+}
+
+// Base name of a file: without directory, nor .pgm suffix.
+static void baseName(char* buf, size_t len, const char* file) {
+  const char* s = strrchr(file, '/');
+  s = s != NULL ? s + 1 : file;
+  size_t n = strlen(s);
+  if (n > 4 && strcmp(s + n - 4, ".pgm") == 0) n -= 4;
+  if (n >= len) n = len - 1;
+  memcpy(buf, s, n);
+  buf[n] = '\0';
+}
+
+/// Result cache
+
+// Cache hits and misses (instrumentation counters).
+#define CACHEHIT  InstrCount[2]
+#define CACHEMISS InstrCount[3]
+
+// Version of the cache contents (part of the keys).
+#define CACHE_VERSION "imageTool cache 1"
+
+// Key of the result of instruction in, applied to an image of key src:
+// a hash of src, the operation and its operands.  Never 0.
+static uint64_t resultKey(const Instr* in, uint64_t src) {
+  XXH64_state st;
+  XXH64_reset(&st, src);
+  XXH64_update(&st, CACHE_VERSION, sizeof(CACHE_VERSION));
+  XXH64_update(&st, ops[in->op].name, strlen(ops[in->op].name) + 1);
+  XXH64_update(&st, in->i, sizeof(in->i));
+  XXH64_update(&st, &in->d, sizeof(in->d));
+  XXH64_update(&st, &in->nkx, sizeof(in->nkx));
+  XXH64_update(&st, &in->nky, sizeof(in->nky));
+  if (in->taps != NULL) XXH64_update(&st, in->taps, sizeof(double) * (in->nkx + in->nky));
+  uint64_t key = XXH64_digest(&st);
+  return key != 0 ? key : 1;
+}
+
+// Key of an image of unknown origin: a hash of its contents.  Never 0.
+static uint64_t imageKey(Image img) {
+  uint64_t key = ImageHash(img, 0);
+  return key != 0 ? key : 1;
+}
+
+// Path of the cache file of key, into buf (of size len).
+// Returns 0 if it does not fit.
+static int cachePath(char* buf, size_t len, const PipelineIO* io, uint64_t key) {
+  int n = snprintf(buf, len, "%s/%016" PRIx64 ".pgm", io->cache, key);
+  return n >= 0 && (size_t)n < len;
+}
+
+// Get the cached result of key, of width x height (NULL if none).
+static Image cacheGet(const PipelineIO* io, uint64_t key, int width, int height) {
+  char path[4096];
+  if (!cachePath(path, sizeof(path), io, key)) return NULL;
+  int e = errno;
+  Image img = ImageLoad(path);
+  if (img != NULL && (ImageWidth(img) != width || ImageHeight(img) != height)) {
+    ImageDestroy(&img);
+  }
+  errno = e;
+  return img;
+}
+
+// Store img in the cache, as the result of key.
+// (Best effort: failures are ignored.  The file is written under a
+// temporary name and renamed, so that readers never see partial files.)
+static void cachePut(const PipelineIO* io, uint64_t key, Image img) {
+  char path[4096];
+  char tmp[4096 + 32];
+  if (!cachePath(path, sizeof(path), io, key)) return;
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+  int e = errno;
+  mkdir(io->cache, 0777);
+  if (ImageSave(img, tmp) == 0 || rename(tmp, path) != 0) unlink(tmp);
+  errno = e;
+}
+
+// Print a progress message to the log of io (if any).
+static void say(const PipelineIO* io, const char* format, ...) {
+  if (io->log == NULL) return;
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(io->log, format, ap);
+  va_end(ap);
+}
+
+// Path of file name, relative to the directory of io, into buf (of size
+// len).  Returns buf, or NULL (with errno set) if it does not fit.
+static const char* filePath(char* buf, size_t len, const PipelineIO* io, const char* name) {
+  int n = name[0] == '/' || io->dir == NULL
+        ? snprintf(buf, len, "%s", name)
+        : snprintf(buf, len, "%s/%s", io->dir, name);
+  if (n < 0 || (size_t)n >= len) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  return buf;
+}
+
+// Save img to file path through the I/O engine aio: it is written into
+// memory, and the engine writes the file while the run goes on.
+// (If the file cannot be opened, img is saved the usual way, so that the
+// failure is the usual one.)  Returns nonzero on success.
+static int saveAsync(Aio aio, Image img, const char* path) {
+  size_t len = (size_t)ImageWidth(img) * ImageHeight(img) + 64;   // (and the header)
+  char* data = malloc(len);
+  FILE* f = data != NULL ? fmemopen(data, len, "w") : NULL;
+  if (f == NULL) {
+    free(data);
+    return ImageSave(img, path);
+  }
+  int ok = ImageWrite(img, f);
+  long size = ftell(f);
+  ok = fclose(f) == 0 && ok && size > 0;
+  if (ok && AioWrite(aio, path, data, size)) return 1;
+  if (!ok) free(data);
+  return ImageSave(img, path);
+}
+
+// Execute the code on the given input file names, with the streams of io.
+// The images of inputs "-" were already read into ready (and are taken
+// from there).
+// Returns PIPE_OK or an error code.
+static int execute(Pipeline p, char* const* files, const PipelineIO* io, Image* ready) {
+  int err = PIPE_OK;
+  int x, y, w, h;
+  Image* img;               // the images (NULL when dead)
+  uint64_t* key;            // their cache keys (0: unknown)
+  int n = 0;                // number of images created
+  char base[256] = "";
+  char name[4096];
+  char path[4096];
+  if (io->base != NULL) snprintf(base, sizeof(base), "%s", io->base);
+  else if (p->ninputs > 0) baseName(base, sizeof(base), files[0]);
+  img = calloc(p->nimages > 0 ? p->nimages : 1, sizeof(Image));
+  key = calloc(p->nimages > 0 ? p->nimages : 1, sizeof(uint64_t));
+  if (img == NULL || key == NULL) {
+    free(img);
+    free(key);
+    return PIPE_EIMAGE8BIT;
+  }
+
+  for (int k = 0; k < p->ncode && err == PIPE_OK; k++) {
+    Instr* in = &p->code[k];
+    const int* i = in->i;
+    // (Checked before running, but a plan file may lie about the images: check
+    // again; its operands were checked by planInstr, see validOperands)
+    if (n < ops[in->op].uses) { err = PIPE_EIMAGES; break; }
+    if (ops[in->op].creates && n >= p->nimages) { err = PIPE_EPLAN; break; }
+
+    // Costly operations: their result may be in the cache
+    uint64_t result = 0;
+    Image hit = NULL;
+    if (io->cache != NULL && ops[in->op].cached) {
+      if (key[n-1] == 0) key[n-1] = imageKey(img[n-1]);
+      result = resultKey(in, key[n-1]);
+      hit = ops[in->op].creates ? cacheGet(io, result, in->w, in->h)
+                                : cacheGet(io, result, ImageWidth(img[n-1]), ImageHeight(img[n-1]));
+      if (hit != NULL) CACHEHIT++;
+      else CACHEMISS++;
+    }
+    if (hit != NULL) {
+      say(io, "Cached %s of I%d -> I%d\n", ops[in->op].name, n-1, ops[in->op].creates ? n : n-1);
+      if (ops[in->op].creates) n++;
+      ImageDestroy(&img[n-1]);
+      img[n-1] = hit;
+    } else switch (in->op) {
+    case OP_THREADS:
+      say(io, "Using %d threads\n", ImageSetThreads(i[0]));
+      break;
+    case OP_INFO: {
+      say(io, "Info on I%d\n", n-1);
+      ImageStatistics st;
+      w = ImageWidth(img[n-1]);
+      h = ImageHeight(img[n-1]);
+      uint8 maxval = ImageMaxval(img[n-1]);
+      ImageFullStats(img[n-1], &st);
+      fprintf(io->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(io->out, "# Gray level range: [%hhu, %hhu]\n", st.min, st.max);
+      fprintf(io->out, "# Mean: %.3f\n# Variance: %.3f\n", st.mean, st.variance);
+      if (i[0]) {
+        fprintf(io->out, "# Histogram (level count):\n");
+        for (int v = 0; v <= maxval; v++) {
+          fprintf(io->out, "%d %" PRIu64 "\n", v, st.hist[v]);
+        }
+      }
+      break;
+    }
+    case OP_TIC:
+      InstrReset();
+      ImageThreadStatsReset();
+      break;
+    case OP_TOC:
+      InstrPrint();
+      if (ImageGetThreads() > 1) ImageThreadStatsPrint();
+      break;
+    case OP_CPUINFO:
+      fprintf(io->out, "%s", ImageCpuInfo());
+      break;
+    case OP_NEG:
+      say(io, "Negating I%d\n", n-1);
+      ImageNegative(img[n-1]);
+      break;
+    case OP_THR:
+      say(io, "Thresholding I%d at %d\n", n-1, i[0]);
+      ImageThreshold(img[n-1], (uint8)i[0]);
+      break;
+    case OP_BRI:
+      say(io, "Brightening I%d by %lf\n", n-1, in->d);
+      ImageBrighten(img[n-1], in->d);
+      break;
+    case OP_CREATE:
+      say(io, "Creating black image (%d,%d) -> I%d\n", i[0], i[1], n);
+      img[n] = ImageCreate(i[0], i[1], PixMax);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    case OP_DUP:
+      say(io, "Duplicating I%d -> I%d\n", n-1, n);
+      img[n] = ImageClone(img[n-1]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      key[n] = key[n-1];   // (the same pixels)
+      n++;
+      break;
+    case OP_ROTATE:
+      say(io, "Rotating I%d -> I%d\n", n-1, n);
+      img[n] = ImageRotate(img[n-1]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    case OP_TURN:
+      if (i[0] > ImageMaxval(img[n-1])) { err = PIPE_EOPERAND; break; }   // precondition check!
+      say(io, "Turning I%d %g degrees (fill %d) -> I%d\n", n-1, in->d, i[0], n);
+      img[n] = ImageRotateAngle(img[n-1], in->d, (uint8)i[0]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    case OP_MIRROR:
+      say(io, "Mirroring I%d -> I%d\n", n-1, n);
+      img[n] = ImageMirror(img[n-1]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    case OP_CROP:
+      if (!ImageValidRect(img[n-1], i[0], i[1], i[2], i[3])) { err = PIPE_EOPERAND; break; }   // precondition check!
+      say(io, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, i[0], i[1], i[2], i[3], n);
+      img[n] = ImageCrop(img[n-1], i[0], i[1], i[2], i[3]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    case OP_RESIZE: {
+      static const char* modes[] = { "nearest", "bilinear", "area" };
+      if ((ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) && i[0] > 0 && i[1] > 0) { err = PIPE_EOPERAND; break; }
+      say(io, "Resizing I%d to %dx%d (%s) -> I%d\n", n-1, i[0], i[1], modes[i[2]], n);
+      img[n] = ImageResize(img[n-1], i[0], i[1], i[2]);
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    }
+    case OP_PYRAMID: {
+      // Level 0 is CURR itself: keep only the reductions
+      Image pyr[PYRAMID_MAX + 1];
+      int got = ImageBuildPyramid(img[n-1], pyr, (i[0] < PYRAMID_MAX ? i[0] : PYRAMID_MAX) + 1);
+      if (got == 0) { err = PIPE_EIMAGE8BIT; break; }
+      ImageDestroy(&pyr[0]);
+      if (n + got - 1 > p->nimages) {
+        while (got > 1) ImageDestroy(&pyr[--got]);
+        err = PIPE_EPLAN;
+        break;
+      }
+      say(io, "Pyramid of I%d -> I%d..I%d\n", n-1, n, n + got - 2);
+      for (int l = 1; l < got; l++) img[n++] = pyr[l];
+      break;
+    }
+    case OP_PASTE:
+      x = i[0];
+      y = i[1];
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = PIPE_ERECT; break; }
+      say(io, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      ImagePaste(img[n-1], x, y, img[n-2]);
+      break;
+    case OP_BLEND:
+      x = i[0];
+      y = i[1];
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = PIPE_ERECT; break; }
+      say(io, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, in->d);
+      ImageBlend(img[n-1], x, y, img[n-2], in->d);
+      break;
+    case OP_LOCATE:
+      say(io, "Locating I%d in I%d\n", n-2, n-1);
+      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+        fprintf(io->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(io->out, "# NOTFOUND\n");
+      }
+      break;
+    case OP_PLOCATE:
+      say(io, "Locating I%d in I%d, coarse to fine\n", n-2, n-1);
+      if (ImageLocateSubImagePyramid(img[n-1], &x, &y, img[n-2])) {
+        fprintf(io->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(io->out, "# NOTFOUND\n");
+      }
+      break;
+    case OP_BLUR:
+      say(io, "Blur I%d with %dx%d mean filter\n", n-1, 2*i[0]+1, 2*i[1]+1);
+      ImageBlur(img[n-1], i[0], i[1]);
+      break;
+    case OP_ERODE:
+    case OP_DILATE:
+    case OP_OPEN:
+    case OP_CLOSE:
+      say(io, "Morphological %s of I%d with %dx%d rectangle\n",
+              ops[in->op].name, n-1, 2*i[0]+1, 2*i[1]+1);
+      switch (in->op) {
+      case OP_ERODE: ImageErode(img[n-1], i[0], i[1]); break;
+      case OP_DILATE: ImageDilate(img[n-1], i[0], i[1]); break;
+      case OP_OPEN: ImageOpen(img[n-1], i[0], i[1]); break;
+      default: ImageClose(img[n-1], i[0], i[1]); break;
+      }
+      break;
+    case OP_MEDIAN:
+      say(io, "Median filter I%d with %dx%d window\n", n-1, 2*i[0]+1, 2*i[1]+1);
+      ImageMedian(img[n-1], i[0], i[1]);
+      break;
+    case OP_GAUSS:
+      say(io, "Blur I%d with Gaussian filter, sigma=%g\n", n-1, in->d);
+      ImageGaussianBlur(img[n-1], in->d);
+      break;
+    case OP_CONV:
+      say(io, "Convolve I%d with %dx%d separable kernel\n", n-1, in->nkx, in->nky);
+      ImageConvolveSeparable(img[n-1], in->taps, in->nkx, in->taps + in->nkx, in->nky);
+      break;
+    case OP_SAVE:
+      if (!expandName(name, sizeof(name), in->name, base)
+          || filePath(path, sizeof(path), io, name) == NULL) {
+        errno = ENAMETOOLONG;
+        err = PIPE_EOPERAND;
+        break;
+      }
+      say(io, "Saving %s <- I%d\n", name, n-1);
+      if (strcmp(name, "-") == 0) {
+        if (ImageWrite(img[n-1], io->out) == 0) { err = PIPE_EIMAGE8BIT; break; }
+      } else if (io->aio != NULL) {
+        if (saveAsync(io->aio, img[n-1], path) == 0) { err = PIPE_EIMAGE8BIT; break; }
+      } else {
+        if (ImageSave(img[n-1], path) == 0) { err = PIPE_EIMAGE8BIT; break; }
+      }
+      break;
+    case OP_LOAD:
+      say(io, "Loading %s -> I%d\n", files[in->input], n);
+      if (ready[in->input] != NULL) {
+        img[n] = ready[in->input];
+        ready[in->input] = NULL;
+      } else if (filePath(path, sizeof(path), io, files[in->input]) == NULL) {
+        err = PIPE_EOPERAND;
+        break;
+      } else {
+        img[n] = ImageLoad(path);
+      }
+      if (img[n] == NULL) { err = PIPE_EIMAGE8BIT; break; }
+      n++;
+      break;
+    }
+    if (err == PIPE_OK && n != in->n) err = PIPE_EPLAN;
+    if (err == PIPE_OK) {
+      // Keep the keys of the images up to date (and the cache)
+      if (result != 0) {
+        if (hit == NULL) cachePut(io, result, img[n-1]);
+        key[n-1] = result;
+      } else if (ops[in->op].changes) {
+        key[n-1] = 0;   // (modified)
+      }
+    }
+    // Free the images that are no longer used
+    for (int j = 0; j < n; j++) {
+      if (p->last[j] == k) ImageDestroy(&img[j]);
+    }
+  }
+
+  // Destroy remaining images
+  while (n > 0) {
+    ImageDestroy(&img[--n]);
+  }
+  free(img);
+  free(key);
+  return err;
+}
+
+// Fill names with the input files the code was compiled with.
+static char* const* compiledInputs(Pipeline p, char** names) {
+  for (int k = 0; k < p->ncode; k++) {
+    if (p->code[k].op == OP_LOAD) names[p->code[k].input] = p->code[k].name;
+  }
+  return names;
+}
+
+// Check the code for the given input files (the compiled ones if NULL),
+// unless it was checked for inputs of the same sizes.
+// The inputs already in ready are used as they are, and inputs "-" are read
+// from the input stream of io, into ready (or are invalid, if ready is NULL).
+// Returns PIPE_OK or an error code.
+static int prepare(Pipeline p, char* const* inputs, const PipelineIO* io, Image* ready) {
+  char* compiled[p->ninputs > 0 ? p->ninputs : 1];
+  if (inputs == NULL) inputs = compiledInputs(p, compiled);
+  int size[p->ninputs > 0 ? 3 * p->ninputs : 1];
+  char path[4096];
+  for (int k = 0; k < p->ninputs; k++) {
+    if (ready != NULL && ready[k] == NULL && strcmp(inputs[k], "-") == 0) {
+      ready[k] = ImageRead(io->in);
+      if (ready[k] == NULL) return PIPE_EIMAGE8BIT;
+    }
+    if (ready != NULL && ready[k] != NULL) {
+      size[3*k] = ImageWidth(ready[k]);
+      size[3*k+1] = ImageHeight(ready[k]);
+      size[3*k+2] = ImageMaxval(ready[k]);
+    } else if (strcmp(inputs[k], "-") == 0) {
+      return PIPE_EOPERAND;
+    } else if (filePath(path, sizeof(path), io, inputs[k]) == NULL) {
+      return PIPE_EOPERAND;
+    } else if (!ImageLoadInfo(path, &size[3*k], &size[3*k+1], &size[3*k+2])) {
+      return PIPE_EIMAGE8BIT;
+    }
+  }
+  if (p->checked && memcmp(size, p->insize, sizeof(int) * 3 * p->ninputs) == 0) {
+    return PIPE_OK;
+  }
+  p->checked = 0;
+  p->prealloced = 0;
+  int err = check(p, size);
+  if (err != PIPE_OK) return err;
+  memcpy(p->insize, size, sizeof(int) * 3 * p->ninputs);
+  p->checked = 1;
+  return PIPE_OK;
+}
+
+// Run the pipeline once, on the given input files, with the given streams
+// and the inputs already in ready (which are taken).
+static int run(Pipeline p, char* const* inputs, const PipelineIO* io, Image* ready) {
+  if (io->cache != NULL) {
+    InstrName[2] = "cachehit";    // InstrCount[2] counts cache hits
+    InstrName[3] = "cachemiss";   // InstrCount[3] counts cache misses
+  }
+  int err = prepare(p, inputs, io, ready);
+  if (err == PIPE_OK) {
+    if (!p->prealloced) {
+      prealloc(p);
+      p->prealloced = 1;
+    }
+    char* compiled[p->ninputs > 0 ? p->ninputs : 1];
+    if (inputs == NULL) inputs = compiledInputs(p, compiled);
+    err = execute(p, inputs, io, ready);
+  }
+  // (Images read, but not used)
+  for (int k = 0; k < p->ninputs; k++) ImageDestroy(&ready[k]);
+  return err;
+}
+
+/// Run the pipeline once, on the given input files, with the given streams.
+int PipelineRunIO(Pipeline p, char* const* inputs, const PipelineIO* io) { ///
+  Image ready[p->ninputs > 0 ? p->ninputs : 1];
+  for (int k = 0; k < p->ninputs; k++) ready[k] = NULL;
+  return run(p, inputs, io, ready);
+}
+
+/// Run the pipeline once, with the given images as inputs.
+int PipelineRunImages(Pipeline p, char* const* inputs, Image* images, const PipelineIO* io) { ///
+  return run(p, inputs, io, images);
+}
+
+/// Run the pipeline once, on the given input files.
+int PipelineRun(Pipeline p, char* const* inputs) { ///
+  PipelineIO io = { .in = stdin, .out = stdout, .log = stderr, .cache = getenv("IMAGETOOL_CACHE") };
+  return PipelineRunIO(p, inputs, &io);
+}
+
+
+/// Plan files
+///
+/// A plan file is a text file: a header line, a line with the number of
+/// inputs and of instructions, whether the plan was checked, the memory
+/// budget and the peak memory checked, the sizes of the inputs checked,
+/// and a line per instruction:
+///   NAME i0 i1 i2 i3 d nkx nky TAPS... input n w h maxval [FILE]
+/// (reals in hexadecimal floating point, so that they are exact).
+
+#define PLAN_HEADER "imageTool plan 2"
+
+/// Save the pipeline to a plan file.
+int PipelineSave(Pipeline p, const char* filename) { ///
+  // Save the sizes inferred for the compiled inputs, if they can be read
+  // (otherwise, the plan is saved unchecked)
+  PipelineIO io = { .in = NULL };
+  int e = errno;
+  prepare(p, NULL, &io, NULL);
+  errno = e;
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return PIPE_EIMAGE8BIT;
+  fprintf(f, "%s\n%d %d %d %" PRIu64 " %" PRIu64 "\n", PLAN_HEADER,
+          p->ninputs, p->ncode, p->checked, p->budget, p->peak);
+  for (int k = 0; k < p->ninputs; k++) {
+    fprintf(f, "%d %d %d\n", p->insize[3*k], p->insize[3*k+1], p->insize[3*k+2]);
+  }
+  for (int k = 0; k < p->ncode; k++) {
+    Instr* in = &p->code[k];
+    fprintf(f, "%s %d %d %d %d %a %d %d", ops[in->op].name,
+            in->i[0], in->i[1], in->i[2], in->i[3], in->d, in->nkx, in->nky);
+    for (int t = 0; t < in->nkx + in->nky; t++) fprintf(f, " %a", in->taps[t]);
+    fprintf(f, " %d %d %d %d %d", in->input, in->n, in->w, in->h, in->maxval);
+    if (in->name != NULL) fprintf(f, " %s", in->name);
+    fprintf(f, "\n");
+  }
+  int ok = !ferror(f);
+  if (fclose(f) != 0) ok = 0;
+  return ok ? PIPE_OK : PIPE_EIMAGE8BIT;
+}
+
+// Parse the next integer of a plan line, in [lo, hi].
+static int planInt(char** s, int lo, int hi, int* v) {
+  char* e;
+  long x = strtol(*s, &e, 10);
+  if (e == *s || x < lo || x > hi) return 0;
+  *s = e;
+  *v = (int)x;
+  return 1;
+}
+
+// Parse the next real of a plan line.
+static int planReal(char** s, double* v) {
+  char* e;
+  *v = strtod(*s, &e);
+  if (e == *s) return 0;
+  *s = e;
+  return 1;
+}
+
+// Parse instruction line s into in.  Returns nonzero on success.
+static int planInstr(Pipeline p, char* s, Instr* in) {
+  s[strcspn(s, "\n")] = '\0';
+  size_t len = strcspn(s, " ");
+  in->op = -1;
+  for (int op = 0; op < NOPS; op++) {
+    if (strlen(ops[op].name) == len && strncmp(s, ops[op].name, len) == 0) in->op = op;
+  }
+  if (in->op < 0) return 0;
+  s += len;
+  int ok = 1;
+  for (int t = 0; t < 4; t++) ok = ok && planInt(&s, INT_MIN, INT_MAX, &in->i[t]);
+  ok = ok && planReal(&s, &in->d)
+          && planInt(&s, 0, MAX_TAPS, &in->nkx) && planInt(&s, 0, MAX_TAPS, &in->nky);
+  if (!ok) return 0;
+  if (in->op == OP_CONV) {
+    if (in->nkx == 0 || in->nky == 0) return 0;
+    in->taps = malloc(sizeof(double) * (in->nkx + in->nky));
+    if (in->taps == NULL) return 0;
+    for (int t = 0; t < in->nkx + in->nky; t++) ok = ok && planReal(&s, &in->taps[t]);
+  } else if (in->nkx != 0 || in->nky != 0) {
+    return 0;
+  }
+  ok = ok && planInt(&s, 0, p->ninputs > 0 ? p->ninputs - 1 : 0, &in->input)
+          && planInt(&s, 0, INT_MAX, &in->n)
+          && planInt(&s, 0, INT_MAX, &in->w) && planInt(&s, 0, INT_MAX, &in->h)
+          && planInt(&s, 0, PixMax, &in->maxval);
+  if (!ok || validOperands(in) != PIPE_OK) return 0;
+  if (in->op == OP_LOAD || in->op == OP_SAVE) {
+    if (*s++ != ' ' || *s == '\0') return 0;
+    in->name = strdup(s);
+    return in->name != NULL;
+  }
+  return *s == '\0';
+}
+
+/// Load a pipeline from a plan file.
+Pipeline PipelineLoad(const char* filename, int* err) { ///
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    *err = PIPE_EIMAGE8BIT;
+    return NULL;
+  }
+  char* line = NULL;
+  size_t cap = 0;
+  int ninputs, ncode, checked;
+  uint64_t budget, peak;
+  Pipeline p = NULL;
+  int ok = getline(&line, &cap, f) > 0 && strcmp(line, PLAN_HEADER "\n") == 0
+        && fscanf(f, "%d %d %d %" SCNu64 " %" SCNu64 "\n",
+                  &ninputs, &ncode, &checked, &budget, &peak) == 5
+        && 0 <= ncode && ncode <= PLAN_MAX_CODE && 0 <= ninputs && ninputs <= ncode
+        && (p = newPipeline(ncode)) != NULL
+        && (p->insize = calloc(ninputs > 0 ? 3 * ninputs : 1, sizeof(int))) != NULL;
+  if (ok) {
+    p->ninputs = ninputs;
+    p->checked = checked != 0;
+    p->budget = budget;
+    p->peak = peak;
+    for (int k = 0; k < 3 * ninputs && ok; k++) ok = fscanf(f, "%d", &p->insize[k]) == 1;
+    ok = ok && fscanf(f, "\n") == 0;
+    int loads = 0;
+    for (int k = 0; k < ncode && ok; k++) {
+      p->ncode++;
+      ok = getline(&line, &cap, f) > 0 && planInstr(p, line, &p->code[k]);
+      // Inputs are loaded in order, once each
+      if (ok && p->code[k].op == OP_LOAD) ok = p->code[k].input == loads++;
+    }
+    ok = ok && loads == ninputs;
+    // (The peak was checked against the budget, for the sizes checked)
+    if (ok && p->checked) ok = liveness(p) == PIPE_OK && p->peak <= p->budget;
+  }
+  free(line);
+  fclose(f);
+  if (!ok) {
+    PipelineDestroy(&p);
+    *err = PIPE_EPLAN;
+  }
+  return p;
+}
@@ -0,0 +1,123 @@
+/// imagePipeline - Compiled pipelines of image operations.
+///
+/// This module is part of imageTool (see imageTool.c for the operations).
+/// A pipeline is compiled once from imageTool arguments (files, operations
+/// and their operands) into a plan: an array of instructions with their
+/// operands already parsed.  Before running, the plan is checked against
+/// the sizes of its input files (read from their headers): the size of
+/// every image it creates is inferred, every operand is validated, and
+/// the pixel buffers of the images to be created are preallocated (in the
+/// image8bit pool).  Nothing runs if the check fails.
+///
+/// The check also finds the last instruction that uses each image (only
+/// CURR and PRED can be used, so an image dies at the latest when two more
+/// are created): images are freed as soon as they die, giving their
+/// buffers back to the pool for later images.  Instead of a fixed number
+/// of images, the check limits the memory of the images alive at the same
+/// time to a budget ("-m MIB" in the arguments; by default, half of the
+/// physical memory).  Images created by dup share the pixels of CURR (see
+/// ImageClone), which count once, until the last image sharing them dies;
+/// an operation that changes a shared image counts its copy.
+///
+/// A plan may then run any number of times, on different input files:
+/// the files named in the arguments are the inputs, and each run may
+/// replace them.  In the file names of save operations, "{}" stands for
+/// the base name (without directory and .pgm suffix) of the first input
+/// of the run, so that batch runs write distinct files.
+///
+/// Plans can be saved to and loaded from (text) plan files, which hold
+/// the instructions with their parsed operands and the sizes inferred for
+/// the inputs they were compiled with: running a loaded plan on inputs of
+/// those sizes skips both the parsing and the check.
+
+#ifndef IMAGEPIPELINE_H
+#define IMAGEPIPELINE_H
+
+#include <stdio.h>
+
+#include "image8bit.h"
+#include "imageAio.h"
+
+/// Error codes (the exit status of imageTool).
+enum {
+  PIPE_OK = 0,
+  PIPE_EOPERANDS,     // insufficient operands
+  PIPE_EIMAGES,       // insufficient images
+  PIPE_EFULL,         // memory budget exceeded
+  PIPE_EIMAGE8BIT,    // image8bit failure (see ImageErrMsg)
+  PIPE_EOPERAND,      // invalid operand
+  PIPE_ERECT,         // invalid rect
+  PIPE_EALPHA,        // invalid alpha
+  PIPE_EPLAN,         // invalid plan file
+  PIPE_ESERVER,       // server failure (see imageServer.h)
+};
+
+/// Message of error code err: a printf format, for ImageErrMsg().
+const char* PipelineErrFormat(int err) ;
+
+/// Type Pipeline is a pointer to compiled pipelines.
+typedef struct pipeline *Pipeline;
+
+/// Compile arguments av[0..ac-1] into a pipeline.
+/// Arguments "-m MIB" set the memory budget (MiB).
+/// On success, returns the pipeline (destroy it with PipelineDestroy).
+/// On failure, returns NULL, sets *err to the error code and *bad to the
+/// index of the offending argument.
+Pipeline PipelineCompile(int ac, char* av[], int* err, int* bad) ;
+
+/// Destroy the pipeline pointed to by (*pp), and set (*pp) to NULL.
+void PipelineDestroy(Pipeline* pp) ;
+
+/// Number of inputs (files loaded) of the pipeline.
+int PipelineInputs(Pipeline p) ;
+
+/// File name of input k (0 <= k < PipelineInputs) of the pipeline, as
+/// compiled.
+const char* PipelineInputName(Pipeline p, int k) ;
+
+/// Save the pipeline to a plan file.
+/// Returns PIPE_OK, or PIPE_EIMAGE8BIT with errno set.
+int PipelineSave(Pipeline p, const char* filename) ;
+
+/// Load a pipeline from a plan file.
+/// On failure, returns NULL and sets *err (errno is set if the file could
+/// not be read).
+Pipeline PipelineLoad(const char* filename, int* err) ;
+
+/// Run the pipeline once, on the given input files (PipelineInputs of
+/// them), or on the files it was compiled with if inputs is NULL.
+/// Standard streams are used (see PipelineRunIO), and the cache in
+/// directory $IMAGETOOL_CACHE, if set.
+/// Returns PIPE_OK, or an error code.
+int PipelineRun(Pipeline p, char* const* inputs) ;
+
+/// Streams and directories of a run.
+/// With a cache directory, the results of the costly operations (rotate,
+/// turn, resize and the filters) are stored there, in files named after a
+/// hash (XXH64) of the operation, its operands and its input image, and
+/// later runs that find them skip the operations.  The input images are
+/// hashed only when their keys are unknown: the key of a result is derived
+/// from the key of its input, so chains of cached operations hash only the
+/// images loaded.  Cache hits and misses are counted in InstrCount[2] and
+/// InstrCount[3] (shown by toc).
+typedef struct {
+  FILE* in;           // inputs named "-" are read from here, in order
+  FILE* out;          // save "-" and the results of info, locate, cpuinfo
+  FILE* log;          // progress messages (none if NULL)
+  const char* dir;    // directory of relative file names (NULL: current)
+  const char* cache;  // directory of the result cache (NULL: no cache)
+  const char* base;   // stands for {} in save names (NULL: base name of the first input)
+  Aio aio;            // saves to files are written by it, while the run goes on (NULL: at once)
+} PipelineIO;
+
+/// Run the pipeline once, as PipelineRun, with the given streams.
+/// (The results of tic and toc always go to the standard output.)
+int PipelineRunIO(Pipeline p, char* const* inputs, const PipelineIO* io) ;
+
+/// Run the pipeline once, as PipelineRunIO on the given input files (the
+/// ones it was compiled with if inputs is NULL), but with images[k], if
+/// not NULL, as input k (instead of reading it).  The images are taken by
+/// the run, which destroys them (and sets images[k] to NULL).
+int PipelineRunImages(Pipeline p, char* const* inputs, Image* images, const PipelineIO* io) ;
+
+#endif
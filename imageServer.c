@@ -0,0 +1,316 @@
+/// imageServer - imageTool pipelines served over a Unix domain socket.
+///
+/// See imageServer.h.
+
+#define _GNU_SOURCE   // (for splice)
+
+#include "imageServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "imagePipeline.h"
+
+// Maximum size of a request (arguments and data).
+#define REQUEST_MAX ((size_t)1 << 30)
+
+// Maximum number of arguments of a request.
+#define REQUEST_ARGS 65536
+
+// Maximum size of the first line of a reply.
+#define REPLY_LINE 1024
+
+// Runs are serialized: the image8bit module is not reentrant.
+static pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of requests received (for the log).
+static unsigned long requests = 0;
+
+// Set the address of the socket at path.  Returns 0 if path is too long.
+static int address(struct sockaddr_un* sa, const char* path) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa->sun_path)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(sa->sun_path, path);
+  return 1;
+}
+
+// Send all n bytes of buf to socket fd.  Returns nonzero on success.
+static int sendAll(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t k = send(fd, buf, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return 0;
+    buf += k;
+    n -= k;
+  }
+  return 1;
+}
+
+// Receive from socket fd until end of stream, into a new buffer
+// (*buf, of *n bytes, plus a '\0').  Returns nonzero on success.
+static int recvAll(int fd, char** buf, size_t* n) {
+  size_t cap = 4096;
+  *n = 0;
+  *buf = malloc(cap);
+  if (*buf == NULL) return 0;
+  for (;;) {
+    if (*n + 1 == cap) {
+      char* b = cap < REQUEST_MAX ? realloc(*buf, 2 * cap) : NULL;
+      if (b == NULL) {
+        free(*buf);
+        errno = ENOMEM;
+        return 0;
+      }
+      *buf = b;
+      cap *= 2;
+    }
+    ssize_t k = recv(fd, *buf + *n, cap - 1 - *n, 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) {
+      free(*buf);
+      return 0;
+    }
+    if (k == 0) break;
+    *n += k;
+  }
+  (*buf)[*n] = '\0';
+  return 1;
+}
+
+// Run the request (of n bytes) in req, writing the reply data to out and
+// its message into msg (of size len).  Returns the status.
+static int runRequest(char* req, size_t n, FILE* out, char* msg, size_t len) {
+  // Split DIR and the arguments, up to an empty one
+  char* end = req + n;
+  char* dir = req;
+  char* s = dir + strlen(dir) + 1;
+  int ac = 0;
+  for (char* t = s; t < end && *t != '\0' && ac <= REQUEST_ARGS; t += strlen(t) + 1) ac++;
+  if (ac > REQUEST_ARGS) {
+    snprintf(msg, len, "Too many arguments (at most %d)", REQUEST_ARGS);
+    return PIPE_EOPERANDS;
+  }
+  char** av = malloc(sizeof(char*) * (ac > 0 ? ac : 1));
+  if (av == NULL) {
+    snprintf(msg, len, "%s", strerror(errno));
+    return PIPE_EOPERANDS;
+  }
+  for (int k = 0; k < ac; k++) {
+    av[k] = s;
+    s += strlen(s) + 1;
+  }
+  if (s >= end) {   // (no empty argument: truncated request)
+    snprintf(msg, len, "Invalid request");
+    free(av);
+    return PIPE_EOPERANDS;
+  }
+  s++;
+  FILE* in = fmemopen(s, end - s, "r");
+  if (in == NULL) {
+    snprintf(msg, len, "%s", strerror(errno));
+    free(av);
+    return PIPE_EIMAGE8BIT;
+  }
+
+  int err, bad;
+  Pipeline p = PipelineCompile(ac, av, &err, &bad);
+  free(av);
+  PipelineIO io = { .in = in, .out = out, .dir = dir, .cache = getenv("IMAGETOOL_CACHE") };
+  pthread_mutex_lock(&runLock);
+  errno = 0;
+  if (p != NULL) {
+    // (-j applies to this request only)
+    int threads = ImageGetThreads();
+    err = PipelineRunIO(p, NULL, &io);
+    ImageSetThreads(threads);
+  }
+  int e = errno;
+  int k = snprintf(msg, len, PipelineErrFormat(err), ImageErrMsg());
+  pthread_mutex_unlock(&runLock);
+  if (err != PIPE_OK && e != 0 && k >= 0 && (size_t)k < len) {
+    snprintf(msg + k, len - k, ": %s", strerror(e));
+  }
+  PipelineDestroy(&p);
+  fclose(in);
+  return err;
+}
+
+// Serve the request on connection (int)(intptr_t)arg, and close it.
+static void* serve(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char* req;
+  size_t n;
+  char* data = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&data, &size);
+  if (out != NULL && recvAll(fd, &req, &n)) {
+    char msg[REPLY_LINE - 64];
+    int status = runRequest(req, n, out, msg, sizeof(msg));
+    free(req);
+    if (fclose(out) != 0) {
+      status = PIPE_EIMAGE8BIT;
+      snprintf(msg, sizeof(msg), "%s", strerror(errno));
+      size = 0;
+    }
+    out = NULL;
+    // (The message is a single line)
+    for (char* c = msg; *c != '\0'; c++) if (*c == '\n') *c = ' ';
+    char line[REPLY_LINE];
+    int k = snprintf(line, sizeof(line), "%d %zu %s\n", status, size, msg);
+    if (sendAll(fd, line, k)) sendAll(fd, data, size);
+    fprintf(stderr, "Request %lu: %s\n", __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED), msg);
+  }
+  if (out != NULL) fclose(out);
+  free(data);
+  close(fd);
+  return NULL;
+}
+
+/// Serve requests on a Unix domain socket at path.
+void ServerRun(const char* path) { ///
+  struct sockaddr_un sa;
+  struct stat st;
+  if (!address(&sa, path)) return;
+  // Replace a stale socket (but nothing else)
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return;
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(fd, 64) != 0) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return;
+  }
+  fprintf(stderr, "Serving on %s with %d threads\n", path, ImageGetThreads());
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    pthread_t t;
+    if (pthread_create(&t, &attr, serve, (void*)(intptr_t)c) != 0) {
+      close(c);   // (too many requests at once: drop this one)
+    }
+  }
+  int e = errno;
+  pthread_attr_destroy(&attr);
+  close(fd);
+  errno = e;
+}
+
+// Move n bytes (or all, up to the end, if n is SIZE_MAX) from descriptor
+// from to descriptor to, with splice, which needs one of them to be a pipe:
+// the data then never enters this process.
+// Returns 1 on success, 0 on failure (with errno set: EPROTO if the end
+// comes before n bytes), or -1 if neither is a pipe (nothing was moved).
+static int spliceAll(int from, int to, size_t n) {
+  int moved = 0;
+  while (n > 0) {
+    ssize_t k = splice(from, NULL, to, NULL, n < ((size_t)1 << 20) ? n : (size_t)1 << 20,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) return !moved && errno == EINVAL ? -1 : 0;
+    if (k == 0) {
+      if (n == SIZE_MAX) return 1;
+      errno = EPROTO;
+      return 0;
+    }
+    moved = 1;
+    if (n != SIZE_MAX) n -= k;
+  }
+  return 1;
+}
+
+// Is argument k of av an input named "-" (not the file of save)?
+static int stdinInput(int k, char* av[]) {
+  return strcmp(av[k], "-") == 0 && (k == 0 || strcmp(av[k-1], "save") != 0);
+}
+
+/// Send a request to the server at path.
+int ServerRequest(const char* path, int ac, char* av[], char* msg, size_t len) { ///
+  struct sockaddr_un sa;
+  if (!address(&sa, path)) return -1;
+  char dir[4096];
+  if (getcwd(dir, sizeof(dir)) == NULL) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  int ok = connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0
+        && sendAll(fd, dir, strlen(dir) + 1);
+  int data = 0;
+  for (int k = 0; k < ac && ok; k++) {
+    ok = sendAll(fd, av[k], strlen(av[k]) + 1);
+    data |= stdinInput(k, av);
+  }
+  ok = ok && sendAll(fd, "", 1);
+  char buf[65536];
+  int spliced = ok && data ? spliceAll(STDIN_FILENO, fd, SIZE_MAX) : -1;
+  if (spliced >= 0) {
+    ok = spliced;
+  } else if (data) {
+    size_t n;
+    while (ok && (n = fread(buf, 1, sizeof(buf), stdin)) > 0) ok = sendAll(fd, buf, n);
+    ok = ok && !ferror(stdin);
+  }
+  ok = ok && shutdown(fd, SHUT_WR) == 0;
+
+  // Reply: the first line, then the data
+  char line[REPLY_LINE];
+  size_t n = 0;
+  while (ok && n + 1 < sizeof(line)) {
+    ssize_t k = recv(fd, line + n, 1, 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) ok = 0;
+    else if (line[n++] == '\n') break;
+  }
+  line[n] = '\0';
+  int status, pos;
+  size_t size;
+  if (ok && sscanf(line, "%d %zu %n", &status, &size, &pos) < 2) {
+    errno = EPROTO;
+    ok = 0;
+  }
+  if (ok && size > 0 && fflush(stdout) == 0) {
+    spliced = spliceAll(fd, STDOUT_FILENO, size);
+    if (spliced >= 0) {
+      ok = spliced;
+      size = 0;
+    }
+  }
+  while (ok && size > 0) {
+    ssize_t k = recv(fd, buf, size < sizeof(buf) ? size : sizeof(buf), 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) {
+      if (k == 0) errno = EPROTO;
+      ok = 0;
+    } else {
+      ok = fwrite(buf, 1, k, stdout) == (size_t)k;
+      size -= k;
+    }
+  }
+  int e = errno;
+  close(fd);
+  errno = e;
+  if (!ok) return -1;
+  line[strcspn(line, "\n")] = '\0';
+  snprintf(msg, len, "%s", line + pos);
+  return status;
+}
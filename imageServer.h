@@ -0,0 +1,43 @@
+/// imageServer - imageTool pipelines served over a Unix domain socket.
+///
+/// This module is part of imageTool (see imageTool.c).
+/// A server is a long-running imageTool: it initializes the image8bit
+/// module once, and keeps its thread pool and pixel buffer pool warm
+/// across requests, so small requests do not pay for process startup.
+///
+/// A request is a pipeline, as the arguments of imageTool, relative to
+/// the directory of the client.  Inputs named "-" are read (in order)
+/// from the data sent with the request, and "save -", as well as the
+/// results of info, locate and cpuinfo, go to the data of the reply.
+///
+/// Each connection carries one request, handled by a thread of its own:
+/// requests are received, compiled and answered concurrently, but they
+/// run one at a time (the image8bit module is not reentrant), each with
+/// all the threads of the pool.
+///
+/// Protocol (on a SOCK_STREAM connection):
+///   request: DIR \0 ARG \0 ... ARG \0 \0 DATA, then end of stream
+///   reply:   STATUS LENGTH MESSAGE \n DATA (LENGTH bytes)
+/// STATUS is the exit status of imageTool (see imagePipeline.h), and
+/// MESSAGE its error message.  A request takes at most 1 GiB, with at
+/// most 65536 arguments.
+/// The client moves DATA with splice when its standard input (or output)
+/// is a pipe, without copying it through its own memory.
+
+#ifndef IMAGESERVER_H
+#define IMAGESERVER_H
+
+#include <stddef.h>
+
+/// Serve requests on a Unix domain socket at path (replacing a stale one).
+/// Runs until killed; returns only on failure, with errno set.
+void ServerRun(const char* path) ;
+
+/// Send the request av[0..ac-1] to the server at path, with the standard
+/// input as data if an input is "-", and copy the reply data to the
+/// standard output.
+/// Returns the status of the reply (and copies its message into msg, of
+/// size len), or -1 on failure, with errno set.
+int ServerRequest(const char* path, int ac, char* av[], char* msg, size_t len) ;
+
+#endif
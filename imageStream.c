@@ -0,0 +1,313 @@
+/// imageStream - imageTool pipelines run on every frame of a PGM stream.
+///
+/// See imageStream.h.
+
+#include "imageStream.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image8bit.h"
+
+// Maximum size of the header of a frame (with its comments).
+#define HEADER_MAX 4096
+
+// A frame as read (PGM header and pixels), or the output of a run.
+typedef struct {
+  char* data;
+  size_t size;
+} Frame;
+
+// A bounded queue of frames, from one thread to another.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;    // signaled on every change
+  Frame slot[STREAM_DEPTH];
+  int head;     // first frame
+  int count;    // number of frames
+  int done;     // no more frames will be put
+  int closed;   // no more frames will be taken
+  int err;      // errno of the failure that ended the frames (0: none)
+} Queue;
+
+static void queueInit(Queue* q) {
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+}
+
+// Free the frames left in q, and q.
+static void queueFree(Queue* q) {
+  for (; q->count > 0; q->count--) {
+    free(q->slot[q->head].data);
+    q->head = (q->head + 1) % STREAM_DEPTH;
+  }
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+}
+
+// Put frame f at the end of q, waiting for room.
+// Returns 0 (and frees f) if q is closed.
+static int queuePut(Queue* q, Frame f) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == STREAM_DEPTH && !q->closed) pthread_cond_wait(&q->cond, &q->lock);
+  int ok = !q->closed;
+  if (ok) {
+    q->slot[(q->head + q->count++) % STREAM_DEPTH] = f;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (!ok) free(f.data);
+  return ok;
+}
+
+// Take the first frame of q into (*f), waiting for one.
+// Returns 0 if there are no more (see q->err).
+static int queueGet(Queue* q, Frame* f) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->done) pthread_cond_wait(&q->cond, &q->lock);
+  int ok = q->count > 0;
+  if (ok) {
+    *f = q->slot[q->head];
+    q->head = (q->head + 1) % STREAM_DEPTH;
+    q->count--;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// End the frames of q, after a failure with errno err (or 0).
+static void queueEnd(Queue* q, int err) {
+  pthread_mutex_lock(&q->lock);
+  q->done = 1;
+  q->err = err;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Close q: the frames put from now on are dropped.
+static void queueClose(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Read the next PGM image of stream f, as it is (header and pixels), into
+// a new buffer (fr->data, of fr->size bytes), skipping whitespace before it.
+// Returns 1 if the image is complete.  Otherwise returns 0, with the bytes
+// read (if any) in the buffer, so that ImageRead tells what is wrong with
+// them, and errno set on read errors (0 at the end of the stream).
+static int readFrame(FILE* f, Frame* fr) {
+  char head[HEADER_MAX];
+  size_t n = 0;
+  long v[4] = { 0, 0, 0, 0 };   // (magic number), width, height, maxval
+  int field = 0;                // fields read
+  int len = 0;                  // length of the current field
+  int valid = 1;                // the fields are as expected so far
+  int c;
+  errno = 0;
+  fr->data = NULL;
+  fr->size = 0;
+  do c = getc(f); while (c != EOF && isspace(c));
+  // The header: P5, width, height and maxval (with comments between them),
+  // and a single whitespace
+  while (c != EOF && field < 4 && n < sizeof(head)) {
+    head[n++] = (char)c;
+    if (c == '#' && len == 0) {
+      while (n < sizeof(head) && (c = getc(f)) != EOF) {
+        head[n++] = (char)c;
+        if (c == '\n') break;
+      }
+    } else if (isspace(c)) {
+      field += len > 0;
+      len = 0;
+    } else if (field == 0) {
+      valid = valid && len < 2 && c == "P5"[len];
+      len++;
+    } else {
+      valid = valid && isdigit(c) && v[field] <= INT_MAX / 10;
+      if (valid) v[field] = 10 * v[field] + (c - '0');
+      len++;
+    }
+    if (field < 4) c = getc(f);
+  }
+  if (n == 0) {
+    if (ferror(f) && errno == 0) errno = EIO;
+    return 0;
+  }
+  int complete = valid && field == 4 && 0 < v[3] && v[3] <= PixMax;
+  size_t raster = complete ? (size_t)v[1] * (size_t)v[2] : 0;
+  fr->data = malloc(n + raster);
+  if (fr->data == NULL) {
+    errno = ENOMEM;
+    return 0;
+  }
+  memcpy(fr->data, head, n);
+  size_t got = raster > 0 ? fread(fr->data + n, 1, raster, f) : 0;
+  fr->size = n + got;
+  if (ferror(f) && errno == 0) errno = EIO;
+  return complete && got == raster;
+}
+
+// The streams and the queues between the threads.
+typedef struct {
+  FILE* in;
+  FILE* out;
+  Queue frames;    // read ahead, for the main thread
+  Queue outputs;   // of the runs, for the writer
+} Stream;
+
+// Cleanup handler of the reader: free the frame being read.
+static void dropFrame(void* arg) {
+  free(((Frame*)arg)->data);
+}
+
+// Reader thread: put the frames of s->in in s->frames.
+// It may be cancelled only while reading (not while holding a lock).
+static void* reader(void* arg) {
+  Stream* s = arg;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  for (;;) {
+    Frame f;
+    int complete;
+    pthread_cleanup_push(dropFrame, &f);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    complete = readFrame(s->in, &f);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_pop(0);
+    int e = errno;
+    if (f.size == 0) free(f.data);
+    else if (!queuePut(&s->frames, f)) break;
+    if (!complete) {
+      queueEnd(&s->frames, e);
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Writer thread: write the outputs in s->outputs to s->out, each at once.
+// Returns the errno of the first failure (as a pointer), or 0.
+static void* writer(void* arg) {
+  Stream* s = arg;
+  Frame f;
+  int err = 0;
+  while (queueGet(&s->outputs, &f)) {
+    if (err == 0 && fwrite(f.data, 1, f.size, s->out) != f.size) err = errno != 0 ? errno : EIO;
+    if (err == 0 && fflush(s->out) != 0) err = errno;
+    free(f.data);
+  }
+  return (void*)(intptr_t)err;
+}
+
+// Image of frame f (NULL on failure).
+static Image frameImage(Frame f) {
+  FILE* m = fmemopen(f.data, f.size, "r");
+  if (m == NULL) return NULL;
+  Image img = ImageRead(m);
+  int e = errno;
+  fclose(m);
+  errno = e;
+  return img;
+}
+
+// Stop the reader thread t of s.
+static void stopReader(Stream* s, pthread_t t) {
+  queueClose(&s->frames);
+  pthread_cancel(t);
+  pthread_join(t, NULL);
+}
+
+/// Run pipeline p on every frame of stream io->in.
+int StreamRun(Pipeline p, const PipelineIO* io, unsigned long* runs) { ///
+  int m = PipelineInputs(p);
+  int stdinputs = 0;   // inputs "-"
+  for (int k = 0; k < m; k++) stdinputs += strcmp(PipelineInputName(p, k), "-") == 0;
+  *runs = 0;
+  if (stdinputs == 0) return PIPE_EOPERAND;
+
+  Stream s = { .in = io->in, .out = io->out };
+  queueInit(&s.frames);
+  queueInit(&s.outputs);
+  pthread_t rt, wt;
+  int e = pthread_create(&rt, NULL, reader, &s);
+  if (e == 0 && (e = pthread_create(&wt, NULL, writer, &s)) != 0) stopReader(&s, rt);
+  if (e != 0) {
+    queueFree(&s.frames);
+    queueFree(&s.outputs);
+    errno = e;
+    return PIPE_EIMAGE8BIT;
+  }
+
+  int err = PIPE_OK;
+  for (unsigned long frame = 0; err == PIPE_OK; frame += stdinputs) {
+    // The next frames, as the inputs "-"
+    Image images[m > 0 ? m : 1];
+    int got = 0;
+    for (int k = 0; k < m; k++) images[k] = NULL;
+    for (int k = 0; k < m; k++) {
+      Frame f;
+      if (err != PIPE_OK || strcmp(PipelineInputName(p, k), "-") != 0) continue;
+      if (!queueGet(&s.frames, &f)) break;
+      images[k] = frameImage(f);
+      e = errno;
+      free(f.data);
+      got++;
+      if (images[k] == NULL) err = PIPE_EIMAGE8BIT;
+    }
+    if (err == PIPE_OK && got < stdinputs) {
+      // (The end of the stream, unless it ended in a failure or a partial group)
+      e = s.frames.err;
+      if (e != 0) err = PIPE_EIMAGE8BIT;
+      else if (got > 0) err = PIPE_EIMAGES;
+    }
+    if (err != PIPE_OK || got < stdinputs) {
+      for (int k = 0; k < m; k++) ImageDestroy(&images[k]);
+      break;
+    }
+
+    // Run, with the output into a buffer for the writer
+    Frame out = { NULL, 0 };
+    FILE* f = open_memstream(&out.data, &out.size);
+    if (f == NULL) {
+      e = errno;
+      for (int k = 0; k < m; k++) ImageDestroy(&images[k]);
+      err = PIPE_EIMAGE8BIT;
+      break;
+    }
+    char base[32];
+    snprintf(base, sizeof(base), "%06lu", frame);
+    PipelineIO rio = *io;
+    rio.out = f;
+    rio.base = base;
+    err = PipelineRunImages(p, NULL, images, &rio);
+    e = errno;
+    if (fclose(f) != 0 && err == PIPE_OK) {
+      e = errno;
+      err = PIPE_EIMAGE8BIT;
+    }
+    queuePut(&s.outputs, out);   // (even after a failure: as much as was written)
+    if (err == PIPE_OK) (*runs)++;
+  }
+
+  stopReader(&s, rt);
+  queueEnd(&s.outputs, 0);
+  void* werr;
+  pthread_join(wt, &werr);
+  if (werr != NULL && err == PIPE_OK) {
+    e = (int)(intptr_t)werr;
+    err = PIPE_EIMAGE8BIT;
+  }
+  queueFree(&s.frames);
+  queueFree(&s.outputs);
+  errno = e;
+  return err;
+}
@@ -0,0 +1,34 @@
+/// imageStream - imageTool pipelines run on every frame of a PGM stream.
+///
+/// This module is part of imageTool (see imageTool.c).
+/// A PGM file (or pipe) may hold several images back to back: the frames
+/// of a video or of a camera sequence.  The pipeline runs once per frame
+/// (or per group of frames, if it has several inputs "-"), compiled and
+/// checked once, with the same pixel buffers: memory stays constant,
+/// however long the stream.
+///
+/// Input and output overlap with the computation: a reader thread reads
+/// up to STREAM_DEPTH frames ahead, and a writer thread writes the output
+/// of each run (save -, info, locate, ...) while the next ones run.  Only
+/// the main thread uses the image8bit module (which is not reentrant): the
+/// other threads move bytes.
+
+#ifndef IMAGESTREAM_H
+#define IMAGESTREAM_H
+
+#include "imagePipeline.h"
+
+/// Number of frames read ahead, and of outputs waiting to be written.
+#define STREAM_DEPTH 4
+
+/// Run pipeline p on every frame of stream io->in: each run takes the
+/// next frames as the inputs named "-" of p, in order, and its output is
+/// written to io->out, in the order of the frames.  In save file names,
+/// {} stands for the number of the (first) frame of the run, from 0.
+/// Returns PIPE_OK at the end of the stream, or the error code of the
+/// first run that fails (PIPE_EOPERAND if p has no input "-", and
+/// PIPE_EIMAGES if the last frames are too few for a run), with the number
+/// of runs completed in (*runs).
+int StreamRun(Pipeline p, const PipelineIO* io, unsigned long* runs) ;
+
+#endif
@@ -52,6 +52,7 @@ int main(int argc, char* argv[]) {
 
   ImageDestroy(&img1);
   ImageDestroy(&img2);
+  ImageDone();
   return 0;
 }
 
@@ -0,0 +1,305 @@
+/// imageThreads - A persistent pool of worker threads.
+///
+/// See imageThreads.h.
+
+#include "imageThreads.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Threads wanted (including the caller), and default grain.
+static int wanted = 1;
+static size_t grain = (size_t)1 << 18;
+
+// The workers running (wanted-1 of them, once started).
+static pthread_t* workers = NULL;
+static int nworkers = 0;
+
+// Only one job runs at a time (operations called from several threads
+// take turns); lock protects the fields of the current job.
+static pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;   // new job or quit
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;   // a worker left a job
+
+static struct {
+  void (*fn)(void* arg, int task, int ntasks);
+  void* arg;
+  int ntasks;
+  atomic_int next;       // next task to take
+  unsigned long gen;     // incremented for every job
+  int active;            // workers inside the job
+  int quit;              // workers must exit
+} job;
+
+// Set while running a task (nested ThreadsRun calls run inline).
+static _Thread_local int inTask = 0;
+
+// Per-thread counters.  Thread 0 is the calling thread (any thread that
+// is not a worker); worker i is thread i+1.  Each entry is only updated by
+// its own thread (threads beyond STATS_MAX share the last one).
+#define STATS_MAX 256
+
+static struct {
+  unsigned long tasks;    // tasks run
+  unsigned long tiles;    // tiles run
+  unsigned long steals;   // tiles stolen from other threads
+  double busy;            // seconds spent running tasks
+} stats[STATS_MAX];
+
+static _Thread_local int self = 0;   // index in stats
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Run one task, counting it.
+static void runTask(void (*fn)(void*, int, int), void* arg, int t, int ntasks) {
+  double t0 = now();
+  fn(arg, t, ntasks);
+  stats[self].tasks++;
+  stats[self].busy += now() - t0;
+}
+
+// Take and run tasks of the current job until there are none left.
+static void runTasks(void (*fn)(void*, int, int), void* arg, int ntasks) {
+  inTask = 1;
+  int t;
+  while ((t = atomic_fetch_add(&job.next, 1)) < ntasks) {
+    runTask(fn, arg, t, ntasks);
+  }
+  inTask = 0;
+}
+
+static void* worker(void* index) {
+  self = (int)(intptr_t)index < STATS_MAX ? (int)(intptr_t)index : STATS_MAX - 1;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&lock);
+  seen = job.gen;
+  for (;;) {
+    while (!job.quit && job.gen == seen) pthread_cond_wait(&wake, &lock);
+    if (job.quit) break;
+    seen = job.gen;
+    // Join the job: the caller waits for us before posting another one,
+    // so the fields read here stay valid until we leave.
+    job.active++;
+    void (*fn)(void*, int, int) = job.fn;
+    void* arg = job.arg;
+    int ntasks = job.ntasks;
+    pthread_mutex_unlock(&lock);
+    runTasks(fn, arg, ntasks);
+    pthread_mutex_lock(&lock);
+    if (--job.active == 0) pthread_cond_signal(&idle);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Start the workers, if not running.  Returns the number running.
+static int startWorkers(void) {
+  if (workers != NULL || wanted <= 1) return nworkers;
+  workers = malloc((wanted - 1) * sizeof(pthread_t));
+  if (workers == NULL) return 0;
+  job.quit = 0;
+  for (nworkers = 0; nworkers < wanted - 1; nworkers++) {
+    if (pthread_create(&workers[nworkers], NULL, worker, (void*)(intptr_t)(nworkers + 1)) != 0) break;
+  }
+  return nworkers;
+}
+
+// Stop the workers (with runLock held).
+static void stopWorkers(void) {
+  if (workers == NULL) return;
+  pthread_mutex_lock(&lock);
+  job.quit = 1;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++) pthread_join(workers[i], NULL);
+  free(workers);
+  workers = NULL;
+  nworkers = 0;
+}
+
+static int onlineCpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+/// Read the defaults from the environment.
+void ThreadsInit(void) { ///
+  const char* s = getenv("IMAGE8BIT_GRAIN");
+  if (s != NULL && atol(s) > 0) grain = (size_t)atol(s);
+  s = getenv("IMAGE8BIT_THREADS");
+  ThreadsSet(s != NULL ? atoi(s) : 0);
+}
+
+/// Set the number of threads used to run tasks (0: number of CPUs).
+int ThreadsSet(int n) { ///
+  if (n <= 0) n = onlineCpus();
+  pthread_mutex_lock(&runLock);
+  if (n != wanted) stopWorkers();
+  wanted = n;
+  pthread_mutex_unlock(&runLock);
+  return n;
+}
+
+/// Number of threads used to run tasks.
+int ThreadsCount(void) { ///
+  return wanted;
+}
+
+/// Stop the worker threads.
+void ThreadsDone(void) { ///
+  pthread_mutex_lock(&runLock);
+  stopWorkers();
+  pthread_mutex_unlock(&runLock);
+}
+
+/// Number of tasks worth splitting work units of work in.
+int ThreadsTasks(size_t work) { ///
+  size_t n = work / grain;
+  if (n > (size_t)wanted) n = (size_t)wanted;
+  return n > 1 ? (int)n : 1;
+}
+
+/// Run fn(arg, task, ntasks) for every task in [0, ntasks), in parallel.
+void ThreadsRun(int ntasks, void (*fn)(void* arg, int task, int ntasks), void* arg) { ///
+  if (ntasks <= 0) return;
+  if (ntasks == 1 || inTask) {
+    for (int t = 0; t < ntasks; t++) runTask(fn, arg, t, ntasks);
+    return;
+  }
+  pthread_mutex_lock(&runLock);
+  if (startWorkers() == 0) {
+    // No workers (1 thread wanted, or they could not be started)
+    pthread_mutex_unlock(&runLock);
+    for (int t = 0; t < ntasks; t++) runTask(fn, arg, t, ntasks);
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  // A worker that woke up late may still be leaving the previous job
+  while (job.active > 0) pthread_cond_wait(&idle, &lock);
+  job.fn = fn;
+  job.arg = arg;
+  job.ntasks = ntasks;
+  atomic_store(&job.next, 0);
+  job.gen++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  // The caller works too
+  runTasks(fn, arg, ntasks);
+
+  // Every task was taken; wait until the workers that took them are done
+  pthread_mutex_lock(&lock);
+  while (job.active > 0) pthread_cond_wait(&idle, &lock);
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&runLock);
+}
+
+
+// Work stealing
+//
+// Deque d holds the tiles d, d+nq, d+2*nq, ... (round robin), as the
+// range [head, tail) of their ordinals, packed in a single atomic word,
+// so that the owner (taking from the front) and thieves (taking from the
+// back) need no locks: each takes a tile with one compare-and-swap.
+
+typedef struct {
+  void (*fn)(void* arg, const ThreadsTile* tile);
+  void* arg;
+  int w, h, tw, th;
+  int cols;                 // tiles per row
+  int nq;                   // number of deques (one per task)
+  _Atomic uint64_t* q;      // the deques: head << 32 | tail
+} Tiles;
+
+// Take the ordinal of a tile from the front (back) of deque q.
+// Returns 0 if empty.
+static int takeTile(_Atomic uint64_t* q, int back, int* k) {
+  uint64_t v = atomic_load(q);
+  for (;;) {
+    uint32_t head = (uint32_t)(v >> 32);
+    uint32_t tail = (uint32_t)v;
+    if (head >= tail) return 0;
+    uint64_t nv = back ? (uint64_t)head << 32 | (tail - 1)
+                       : (uint64_t)(head + 1) << 32 | tail;
+    if (atomic_compare_exchange_weak(q, &v, nv)) {
+      *k = (int)(back ? tail - 1 : head);
+      return 1;
+    }
+  }
+}
+
+static void runTile(Tiles* T, int tile) {
+  ThreadsTile r;
+  r.x0 = tile % T->cols * T->tw;
+  r.y0 = tile / T->cols * T->th;
+  r.x1 = T->w - r.x0 > T->tw ? r.x0 + T->tw : T->w;
+  r.y1 = T->h - r.y0 > T->th ? r.y0 + T->th : T->h;
+  T->fn(T->arg, &r);
+  stats[self].tiles++;
+}
+
+static void tilesTask(void* arg, int task, int ntasks) {
+  Tiles* T = arg;
+  (void)ntasks;
+  int k;
+  // Own tiles first, from the front
+  while (takeTile(&T->q[task], 0, &k)) runTile(T, task + k * T->nq);
+  // Then steal from the back of the others, until all are empty
+  for (int i = 1; i < T->nq; i++) {
+    int v = (task + i) % T->nq;
+    while (takeTile(&T->q[v], 1, &k)) {
+      stats[self].steals++;
+      runTile(T, v + k * T->nq);
+    }
+  }
+}
+
+/// Run fn(arg, tile) for every tile of [0, w) x [0, h), with work stealing.
+void ThreadsRunTiles(int w, int h, int tw, int th,
+                     void (*fn)(void* arg, const ThreadsTile* tile), void* arg) { ///
+  if (w <= 0 || h <= 0) return;
+  Tiles T = { fn, arg, w, h, tw, th, 0, 0, NULL };
+  T.cols = (w - 1) / tw + 1;
+  long long ntiles = (long long)T.cols * ((h - 1) / th + 1);
+  if (ntiles > UINT32_MAX) ntiles = UINT32_MAX;   // (never, with sane tiles)
+  int tasks = ThreadsTasks((size_t)w * (size_t)h);
+  T.nq = ntiles < tasks ? (int)ntiles : tasks;
+  if (inTask) T.nq = 1;
+  // (With a single deque, the tiles just run in order, on this thread.)
+  _Atomic uint64_t q[T.nq];
+  for (int d = 0; d < T.nq; d++) {
+    uint32_t n = (uint32_t)((ntiles - d + T.nq - 1) / T.nq);   // tiles d, d+nq, ...
+    atomic_init(&q[d], n);
+  }
+  T.q = q;
+  ThreadsRun(T.nq, tilesTask, &T);
+}
+
+/// Reset the per-thread counters.
+void ThreadsStatsReset(void) { ///
+  for (int i = 0; i < STATS_MAX; i++) {
+    stats[i].tasks = stats[i].tiles = stats[i].steals = 0;
+    stats[i].busy = 0.0;
+  }
+}
+
+/// Print the per-thread counters, one line per thread.
+void ThreadsStatsPrint(void) { ///
+  int n = wanted < STATS_MAX ? wanted : STATS_MAX;
+  printf("#%14.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s\n",
+         "thread", "tasks", "tiles", "steals", "busy(s)");
+  for (int i = 0; i < n; i++) {
+    printf("%15d\t%15lu\t%15lu\t%15lu\t%15.6f\n",
+           i, stats[i].tasks, stats[i].tiles, stats[i].steals, stats[i].busy);
+  }
+}
@@ -0,0 +1,81 @@
+/// imageThreads - A persistent pool of worker threads.
+///
+/// This is an internal module of image8bit.
+/// Whole-image operations split their work in tasks (usually bands of
+/// rows) and run them with ThreadsRun(), on the calling thread and on a
+/// pool of worker threads that are started once and then reused, so that
+/// each operation pays only for a wake-up, not for creating threads.
+///
+/// Work too small to be worth splitting (see ThreadsTasks) runs entirely
+/// on the calling thread.
+///
+/// Work whose cost varies across the image (searches that stop early, ...)
+/// is better split in many small 2D tiles, run by ThreadsRunTiles():
+/// each thread has a deque of tiles, takes tiles from its front, and,
+/// when it runs out, steals tiles from the back of the other deques.
+///
+/// Each thread counts the tasks and tiles it runs, the tiles it steals and
+/// the time it spends on them (see ThreadsStatsPrint).
+///
+/// Defaults may be set with environment variables (read by ThreadsInit):
+///   IMAGE8BIT_THREADS  number of threads (0 or unset: number of CPUs);
+///   IMAGE8BIT_GRAIN    minimum units of work (pixels) per task.
+
+#ifndef IMAGETHREADS_H
+#define IMAGETHREADS_H
+
+#include <stddef.h>
+
+/// Read the defaults from the environment.
+void ThreadsInit(void) ;
+
+/// Set the number of threads (including the calling one) used to run
+/// tasks.  n == 0 selects the number of online CPUs.
+/// Returns the number of threads set.
+int ThreadsSet(int n) ;
+
+/// Number of threads used to run tasks.
+int ThreadsCount(void) ;
+
+/// Stop the worker threads (they are restarted when needed).
+void ThreadsDone(void) ;
+
+/// Number of tasks worth splitting work units of work in:
+/// at most ThreadsCount(), and each with at least the grain (except
+/// that there is always at least 1 task).
+int ThreadsTasks(size_t work) ;
+
+/// Run fn(arg, task, ntasks) for every task in [0, ntasks), in parallel,
+/// and return when all are done.  Tasks run in any order, on any thread.
+/// (Called from inside a task, runs all the tasks on the calling thread.)
+void ThreadsRun(int ntasks, void (*fn)(void* arg, int task, int ntasks), void* arg) ;
+
+/// A tile: the rectangle [x0, x1) x [y0, y1).
+typedef struct {
+  int x0, y0, x1, y1;
+} ThreadsTile;
+
+/// Split [0, w) x [0, h) in tiles of (at most) tw x th, and run
+/// fn(arg, tile) for every tile, in parallel, with work stealing.
+/// Tiles are dealt to the threads in raster order (round robin), and each
+/// thread runs its own in raster order, so the tiles nearer the origin
+/// tend to run first.  (Like ThreadsTasks, takes each of the w*h elements
+/// as a unit of work: with little work, runs all tiles, in raster order,
+/// on the calling thread.)
+void ThreadsRunTiles(int w, int h, int tw, int th,
+                     void (*fn)(void* arg, const ThreadsTile* tile), void* arg) ;
+
+/// Reset the per-thread counters.
+void ThreadsStatsReset(void) ;
+
+/// Print the per-thread counters (tasks, tiles, steals and busy time,
+/// since the last reset), one line per thread.
+void ThreadsStatsPrint(void) ;
+
+/// Range [*lo, *hi) of task of ntasks, splitting [0, n) in nearly equal parts.
+static inline void ThreadsRange(int n, int task, int ntasks, int* lo, int* hi) {
+  *lo = (int)((long long)n * task / ntasks);
+  *hi = (int)((long long)n * (task + 1) / ntasks);
+}
+
+#endif
@@ -9,18 +9,30 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#define _GNU_SOURCE   // (for F_SETPIPE_SZ)
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <error.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "image8bit.h"
+#include "imageBatch.h"
+#include "imagePipeline.h"
+#include "imageServer.h"
+#include "imageStream.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [--plan PLAN] [-j N] [-m MIB] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --plan PLAN [-q N] [-- FILE...]\n"
+    "       imageTool --stream [ARGUMENTS...]\n"
+    "       imageTool --serve SOCKET\n"
+    "       imageTool --client SOCKET [ARGUMENTS...]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,199 +41,203 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Images that no operation uses any more are freed at once.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -j N            Use N threads (0: one per CPU, the default)\n"
+    "                  for the operations that follow\n"
+    "  -m MIB          Limit the memory of the images in the buffer to MIB MiB\n"
+    "                  (default: half of the physical memory)\n"
+    "  --plan PLAN     Compile the pipeline and save it to file PLAN, then run it.\n"
+    "                  Alone, load the pipeline from PLAN and run it again;\n"
+    "                  with -- FILE..., run it on each group of new input FILES\n"
+    "                  (as many as the pipeline loads), in order.\n"
+    "  -q N            With --plan PLAN -- FILE..., read N files ahead, and\n"
+    "                  write up to N saved files, while runs compute (with\n"
+    "                  io_uring, or threads; 0: none; default 8)\n"
+    "  --stream        Run the pipeline on every frame (PGM image) of the\n"
+    "                  standard input, in order: each run takes the next\n"
+    "                  frames as its inputs -, and its output (save -, info...)\n"
+    "                  goes to the standard output.  In save FILE, {} stands\n"
+    "                  for the frame number (000000, 000001, ...).\n"
+    "                  Frames are read ahead and written in separate threads.\n"
+    "  --serve SOCKET  Serve pipelines on Unix domain socket SOCKET, until killed:\n"
+    "                  the library is initialized once, and requests from\n"
+    "                  several clients are received concurrently.\n"
+    "  --client SOCKET Run the pipeline in the server at SOCKET, as if run here\n"
+    "                  (file names are relative to the current directory;\n"
+    "                  tic and toc report on the server).\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  Input file - is the next image from the standard input, and\n"
+    "  save - writes to the standard output.\n"
+    "  In save FILE, {} stands for the name of the first input file\n"
+    "  (without directory and .pgm suffix), for batch runs of plans.\n"
+    "  The whole pipeline is checked (operands, image sizes) before it runs.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info [--hist]   Show information on CURR (size, range, mean, variance)\n"
+    "                  and, with --hist, its histogram (LEVEL COUNT per line)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters and times\n"
+    "                  (and per-thread counters, with more than 1 thread).\n"
+    "  cpuinfo         Show CPU features and the kernels chosen for each operation\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  dup             Duplicate CURR, creating new image (it shares the pixels\n"
+    "                  of CURR, and takes no more memory, until it changes)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  turn DEG[,FILL] Rotate CURR DEG degrees counter-clockwise (bilinear),\n"
+    "                  creating new image; uncovered pixels are set to FILL [0]\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH, creating new image; M is the mode:\n"
+    "                  nearest, bilinear (default) or area\n"
+    "  pyramid N       Reduce CURR by 2, N times (or down to 1x1),\n"
+    "                  creating a new image for each level\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  plocate         Same as locate, coarse to fine (any match, not the first)\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  erode DX,DY     erode CURR with (2DX+1)x(2DY+1) rectangle (minimum)\n"
+    "  dilate DX,DY    dilate CURR with (2DX+1)x(2DY+1) rectangle (maximum)\n"
+    "  open DX,DY      open CURR (erode, then dilate)\n"
+    "  close DX,DY     close CURR (dilate, then erode)\n"
+    "  median DX,DY    median filter CURR over (2DX+1)x(2DY+1) windows\n"
+    "  gauss SIGMA     blur CURR using Gaussian filter of std deviation SIGMA\n"
+    "  conv KX[/KY]    convolve CURR with separable kernel: KX along rows,\n"
+    "                  KY (default KX) along columns\n"
     "\n"              
+    "ENVIRONMENT:\n"
+    "  IMAGETOOL_CACHE=DIR\n"
+    "                  Cache the results of rotate, turn, resize and the filters\n"
+    "                  in directory DIR, and reuse them for the same operation\n"
+    "                  on the same image (toc shows cache hits and misses)\n"
+    "  IMAGETOOL_AIO=threads\n"
+    "                  Read and write the files of -q with threads, not io_uring\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  KX, KY          Kernel taps, comma-separated (e.g. .25,.5,.25);\n"
+    "                  tap N/2 of N applies to the pixel itself\n"
     "\n"
     ;
 
-static char* errors[] = {
-  "Success",
-  "Insufficient operands",
-  "Insufficient images",
-  "Image buffer is full",
-  "Image8bit failure: %s",
-  "Invalid operand",
-  "Invalid rect (overflow)",
-  "Invalid alpha",
-};
 
 
 // This program strives for correctness and robustness.
-// You may want to temporarily comment out operand validation, namely
+// The operations are compiled, checked and run by the imagePipeline module.
+// You may want to temporarily comment out operand validation there, namely
 // precondition checks, so that you can force precondition violations, and
 // observe the effect of assertions.
 //
 // Also, the program does not test every module function, but you may easily
-// add new operations for that purpose.
+// add new operations (to imagePipeline.c) for that purpose.
+
+// Size of the pipes of the standard streams (see largePipes).
+#define PIPE_SIZE (1 << 20)
+
+// Enlarge the pipes of the standard input and output, if they are pipes
+// (as in a shell pipeline of imageTools), so that images pass between the
+// stages in fewer and larger transfers, with fewer context switches.
+// (Best effort: the size may be limited by /proc/sys/fs/pipe-max-size.)
+static void largePipes(void) {
+  for (int fd = 0; fd <= 1; fd++) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      int e = errno;
+      fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+      errno = e;
+    }
+  }
+}
 
 int main(int ac, char* av[]) {
   if (ac <= 1) {
     error(5, 0, "\n%s", USAGE);
   }
+  largePipes();
+
+  if (strcmp(av[1], "--client") == 0) {
+    // Send the pipeline to a server (no need for image8bit here)
+    if (ac < 3) error(PIPE_EOPERANDS, 0, "%s", PipelineErrFormat(PIPE_EOPERANDS));
+    char msg[1024];
+    int status = ServerRequest(av[2], ac - 3, av + 3, msg, sizeof(msg));
+    if (status < 0) error(PIPE_ESERVER, errno, "%s", PipelineErrFormat(PIPE_ESERVER));
+    error(status, 0, "%s", msg);
+    return 0;
+  }
 
   ImageInit();
 
   int err = 0;
-  int x, y, w, h;
-
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
-  while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "crop") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "paste") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
-    } else if (strcmp(av[k], "blend") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
-      }
-    } else if (strcmp(av[k], "blur") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+  int bad;
+  Pipeline p = NULL;
+
+  if (strcmp(av[1], "--serve") == 0) {
+    if (ac != 3) error(PIPE_EOPERANDS, 0, "%s", PipelineErrFormat(PIPE_EOPERANDS));
+    ServerRun(av[2]);
+    error(PIPE_ESERVER, errno, "%s", PipelineErrFormat(PIPE_ESERVER));
+  } else if (strcmp(av[1], "--plan") == 0 && ac == 3) {
+    // Run a saved plan on its own inputs
+    if ((p = PipelineLoad(av[2], &err)) != NULL) err = PipelineRun(p, NULL);
+  } else if (strcmp(av[1], "--plan") == 0 && ac > 3
+             && (strcmp(av[3], "--") == 0 || strcmp(av[3], "-q") == 0)) {
+    // Run a saved plan on each group of new inputs, reading them ahead
+    int depth = BATCH_DEPTH;
+    int k = 3;
+    if (strcmp(av[k], "-q") == 0) {
+      char* end;
+      long q = k + 1 < ac ? strtol(av[k+1], &end, 10) : -1;
+      depth = q >= 0 && q <= BATCH_DEPTH_MAX && *end == '\0' ? (int)q : -1;
+      k += 2;
     }
-    k++;
-  }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+    if (depth < 0 || k >= ac || strcmp(av[k], "--") != 0) {
+      err = PIPE_EOPERANDS;
+    } else if ((p = PipelineLoad(av[2], &err)) != NULL) {
+      PipelineIO io = { .in = stdin, .out = stdout, .log = stderr, .cache = getenv("IMAGETOOL_CACHE") };
+      unsigned long runs;
+      err = BatchRun(p, ac - k - 1, av + k + 1, depth, &io, &runs);
+      if (err != 0) fprintf(stderr, "Stopped after %lu runs\n", runs);
+    }
+  } else if (strcmp(av[1], "--plan") == 0) {
+    // Compile, save the plan, and run it
+    if (ac < 3) {
+      err = 1;
+    } else if ((p = PipelineCompile(ac - 3, av + 3, &err, &bad)) != NULL) {
+      err = PipelineSave(p, av[2]);
+      if (err == 0) err = PipelineRun(p, NULL);
+    }
+  } else if (strcmp(av[1], "--stream") == 0) {
+    // Run the pipeline on every frame of the standard input
+    if ((p = PipelineCompile(ac - 2, av + 2, &err, &bad)) != NULL) {
+      PipelineIO io = { .in = stdin, .out = stdout, .log = stderr, .cache = getenv("IMAGETOOL_CACHE") };
+      unsigned long runs;
+      err = StreamRun(p, &io, &runs);
+      if (err != 0) fprintf(stderr, "Stopped after %lu runs\n", runs);
+    }
+  } else if ((p = PipelineCompile(ac - 1, av + 1, &err, &bad)) != NULL) {
+    err = PipelineRun(p, NULL);
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  PipelineDestroy(&p);
+  ImageDone();
+
+  error(err, errno, PipelineErrFormat(err), ImageErrMsg());
   return 0;
 }
-
@@ -0,0 +1,137 @@
+/// xxhash64 - XXH64, a fast non-cryptographic 64-bit hash.
+///
+/// See xxhash64.h.
+
+#include "xxhash64.h"
+
+#include <string.h>
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads (memcpy: no alignment required).
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+  acc ^= round64(0, v);
+  return acc * P1 + P4;
+}
+
+// Hash the stripes of 32 bytes at p (n bytes, a multiple of 32) into v.
+static void stripes(uint64_t v[4], const uint8_t* p, size_t n) {
+  uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+  for (const uint8_t* end = p + n; p < end; p += 32) {
+    v1 = round64(v1, read64(p));
+    v2 = round64(v2, read64(p + 8));
+    v3 = round64(v3, read64(p + 16));
+    v4 = round64(v4, read64(p + 24));
+  }
+  v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+}
+
+// Finish a hash: h is the initial value, p the last n (< 32) bytes.
+static uint64_t finish(uint64_t h, uint64_t total, const uint8_t* p, size_t n) {
+  h += total;
+  for (; n >= 8; p += 8, n -= 8) {
+    h ^= round64(0, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+  }
+  if (n >= 4) {
+    h ^= (uint64_t)read32(p) * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+    n -= 4;
+  }
+  for (; n > 0; p++, n--) {
+    h ^= *p * P5;
+    h = rotl(h, 11) * P1;
+  }
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t converge(const uint64_t v[4]) {
+  uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+  for (int i = 0; i < 4; i++) h = merge64(h, v[i]);
+  return h;
+}
+
+/// Reset a streaming hash.
+void XXH64_reset(XXH64_state* st, uint64_t seed) { ///
+  memset(st, 0, sizeof(*st));
+  st->seed = seed;
+  st->v[0] = seed + P1 + P2;
+  st->v[1] = seed + P2;
+  st->v[2] = seed;
+  st->v[3] = seed - P1;
+}
+
+/// Add n bytes to a streaming hash.
+void XXH64_update(XXH64_state* st, const void* data, size_t n) { ///
+  const uint8_t* p = data;
+  st->total += n;
+  if (st->n + n < 32) {
+    if (n > 0) memcpy(st->buf + st->n, p, n);
+    st->n += n;
+    return;
+  }
+  if (st->n > 0) {
+    size_t k = 32 - st->n;
+    memcpy(st->buf + st->n, p, k);
+    stripes(st->v, st->buf, 32);
+    p += k;
+    n -= k;
+    st->n = 0;
+  }
+  size_t whole = n & ~(size_t)31;
+  stripes(st->v, p, whole);
+  memcpy(st->buf, p + whole, n - whole);
+  st->n = n - whole;
+}
+
+/// Hash of the data added to a streaming hash.
+uint64_t XXH64_digest(const XXH64_state* st) { ///
+  uint64_t h = st->total >= 32 ? converge(st->v) : st->seed + P5;
+  return finish(h, st->total, st->buf, st->n);
+}
+
+/// Hash the n bytes at data.
+uint64_t XXH64(const void* data, size_t n, uint64_t seed) { ///
+  XXH64_state st;
+  XXH64_reset(&st, seed);
+  XXH64_update(&st, data, n);
+  return XXH64_digest(&st);
+}
@@ -0,0 +1,31 @@
+/// xxhash64 - XXH64, a fast non-cryptographic 64-bit hash.
+///
+/// A small implementation of the XXH64 algorithm of the xxHash library
+/// (Yann Collet, BSD 2-Clause License, https://github.com/Cyan4973/xxHash),
+/// with its one-shot and streaming interfaces; the results are those of
+/// the reference implementation.
+
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// State of a streaming hash.
+typedef struct {
+  uint64_t total;     // bytes hashed
+  uint64_t v[4];      // accumulators
+  uint8_t buf[32];    // pending bytes (a partial stripe)
+  size_t n;           // number of pending bytes
+  uint64_t seed;
+} XXH64_state;
+
+/// Hash the n bytes at data.
+uint64_t XXH64(const void* data, size_t n, uint64_t seed) ;
+
+/// Streaming: hash the concatenation of the data of the updates.
+void XXH64_reset(XXH64_state* st, uint64_t seed) ;
+void XXH64_update(XXH64_state* st, const void* data, size_t n) ;
+uint64_t XXH64_digest(const XXH64_state* st) ;
+
+#endif